@@ -0,0 +1,263 @@
+#ifndef BYTE_SCAN_HPP__
+#define BYTE_SCAN_HPP__
+
+#include <cstring>
+#include <cstddef>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BYTE_SCAN_X86 1
+#endif
+
+// delimiter scanning of header bytes: a byte, either of two bytes, or a short sequence such as "\r\n\r\n"
+// every function returns the first match in [begin, end), end if there is none
+// the kernels compare 32 (AVX2) or 16 (SSE2) bytes at a time, the best one the CPU supports is picked on first use,
+// other CPUs get the scalar kernel
+// a sequence is searched by comparing its first and last byte at every position at once, only positions matching
+// both are compared in full, so "\r\n\r\n" is rarely compared at the "\r\n" ending every header line
+class ByteScan
+{
+public:
+	enum Isa
+	{
+		SCALAR,
+		SSE2,
+		AVX2
+	};
+
+	struct Kernels
+	{
+		const char * name;
+		const char * (*find)(const char * begin, const char * end, char c);
+		const char * (*findEither)(const char * begin, const char * end, char a, char b);
+		const char * (*findSequence)(const char * begin, const char * end, const char * seq, size_t n);
+	};
+
+private:
+	static const char * findScalar(const char * begin, const char * end, char c)
+	{
+		const char * res = (const char *)memchr(begin, c, end - begin);
+		return res == NULL ? end : res;
+	}
+
+	static const char * findEitherScalar(const char * begin, const char * end, char a, char b)
+	{
+		for(; begin < end && *begin != a && *begin != b; ++begin);
+		return begin;
+	}
+
+	static const char * findSequenceScalar(const char * begin, const char * end, const char * seq, size_t n)
+	{
+		if((size_t)(end - begin) < n || n == 0)
+		{
+			return n == 0 ? begin : end;
+		}
+		const char * last = end - n + 1; // last position a match may start at, exclusive
+		for(const char * p = begin; (p = findScalar(p, last, seq[0])) < last; ++p)
+		{
+			if(memcmp(p + 1, seq + 1, n - 1) == 0)
+			{
+				return p;
+			}
+		}
+		return end;
+	}
+
+#ifdef BYTE_SCAN_X86
+	// candidates is a bit mask of positions from p on, the first one holding the whole sequence wins
+	static const char * verify(const char * p, unsigned candidates, const char * seq, size_t n)
+	{
+		while(candidates != 0)
+		{
+			int idx = __builtin_ctz(candidates);
+			if(n <= 2 || memcmp(p + idx + 1, seq + 1, n - 2) == 0)
+			{
+				return p + idx;
+			}
+			candidates &= candidates - 1;
+		}
+		return NULL;
+	}
+
+	__attribute__((target("sse2")))
+	static const char * findSse2(const char * begin, const char * end, char c)
+	{
+		const __m128i needle = _mm_set1_epi8(c);
+		for(; begin + 16 <= end; begin += 16)
+		{
+			unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)begin), needle));
+			if(mask != 0)
+			{
+				return begin + __builtin_ctz(mask);
+			}
+		}
+		return findScalar(begin, end, c);
+	}
+
+	__attribute__((target("sse2")))
+	static const char * findEitherSse2(const char * begin, const char * end, char a, char b)
+	{
+		const __m128i needle_a = _mm_set1_epi8(a);
+		const __m128i needle_b = _mm_set1_epi8(b);
+		for(; begin + 16 <= end; begin += 16)
+		{
+			__m128i block = _mm_loadu_si128((const __m128i *)begin);
+			unsigned mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(block, needle_a), _mm_cmpeq_epi8(block, needle_b)));
+			if(mask != 0)
+			{
+				return begin + __builtin_ctz(mask);
+			}
+		}
+		return findEitherScalar(begin, end, a, b);
+	}
+
+	__attribute__((target("sse2")))
+	static const char * findSequenceSse2(const char * begin, const char * end, const char * seq, size_t n)
+	{
+		if(n == 0)
+		{
+			return begin;
+		}
+		const __m128i first = _mm_set1_epi8(seq[0]);
+		const __m128i last = _mm_set1_epi8(seq[n - 1]);
+		for(; begin + n - 1 + 16 <= end; begin += 16)
+		{
+			__m128i head = _mm_loadu_si128((const __m128i *)begin);
+			__m128i tail = _mm_loadu_si128((const __m128i *)(begin + n - 1));
+			unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(head, first), _mm_cmpeq_epi8(tail, last)));
+			const char * res = verify(begin, mask, seq, n);
+			if(res != NULL)
+			{
+				return res;
+			}
+		}
+		return findSequenceScalar(begin, end, seq, n);
+	}
+
+	__attribute__((target("avx2")))
+	static const char * findAvx2(const char * begin, const char * end, char c)
+	{
+		const __m256i needle = _mm256_set1_epi8(c);
+		for(; begin + 32 <= end; begin += 32)
+		{
+			unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)begin), needle));
+			if(mask != 0)
+			{
+				return begin + __builtin_ctz(mask);
+			}
+		}
+		return findSse2(begin, end, c);
+	}
+
+	__attribute__((target("avx2")))
+	static const char * findEitherAvx2(const char * begin, const char * end, char a, char b)
+	{
+		const __m256i needle_a = _mm256_set1_epi8(a);
+		const __m256i needle_b = _mm256_set1_epi8(b);
+		for(; begin + 32 <= end; begin += 32)
+		{
+			__m256i block = _mm256_loadu_si256((const __m256i *)begin);
+			unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(block, needle_a), _mm256_cmpeq_epi8(block, needle_b)));
+			if(mask != 0)
+			{
+				return begin + __builtin_ctz(mask);
+			}
+		}
+		return findEitherSse2(begin, end, a, b);
+	}
+
+	__attribute__((target("avx2")))
+	static const char * findSequenceAvx2(const char * begin, const char * end, const char * seq, size_t n)
+	{
+		if(n == 0)
+		{
+			return begin;
+		}
+		const __m256i first = _mm256_set1_epi8(seq[0]);
+		const __m256i last = _mm256_set1_epi8(seq[n - 1]);
+		for(; begin + n - 1 + 32 <= end; begin += 32)
+		{
+			__m256i head = _mm256_loadu_si256((const __m256i *)begin);
+			__m256i tail = _mm256_loadu_si256((const __m256i *)(begin + n - 1));
+			unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(head, first), _mm256_cmpeq_epi8(tail, last)));
+			const char * res = verify(begin, mask, seq, n);
+			if(res != NULL)
+			{
+				return res;
+			}
+		}
+		return findSequenceSse2(begin, end, seq, n);
+	}
+#endif
+
+	static const Kernels & active()
+	{
+		static const Kernels & kernels = forIsa(best());
+		return kernels;
+	}
+
+public:
+	// the best kernel the CPU supports
+	static Isa best()
+	{
+#ifdef BYTE_SCAN_X86
+		__builtin_cpu_init();
+		if(__builtin_cpu_supports("avx2"))
+		{
+			return AVX2;
+		}
+		if(__builtin_cpu_supports("sse2"))
+		{
+			return SSE2;
+		}
+#endif
+		return SCALAR;
+	}
+
+	// kernels of one instruction set, for benchmarks; one the CPU doesn't support must not be called
+	static const Kernels & forIsa(Isa isa)
+	{
+		static const Kernels scalar = { "scalar", findScalar, findEitherScalar, findSequenceScalar };
+#ifdef BYTE_SCAN_X86
+		static const Kernels sse2 = { "sse2", findSse2, findEitherSse2, findSequenceSse2 };
+		static const Kernels avx2 = { "avx2", findAvx2, findEitherAvx2, findSequenceAvx2 };
+		if(isa == AVX2)
+		{
+			return avx2;
+		}
+		if(isa == SSE2)
+		{
+			return sse2;
+		}
+#endif
+		return scalar;
+	}
+
+	static const char * name()
+	{
+		return active().name;
+	}
+
+	static const char * find(const char * begin, const char * end, char c)
+	{
+		return active().find(begin, end, c);
+	}
+
+	static const char * findEither(const char * begin, const char * end, char a, char b)
+	{
+		return active().findEither(begin, end, a, b);
+	}
+
+	static const char * findSequence(const char * begin, const char * end, const char * seq, size_t n)
+	{
+		return active().findSequence(begin, end, seq, n);
+	}
+
+	// same as above with a string literal, eg: findSequence(begin, end, "\r\n\r\n")
+	template <size_t N>
+	static const char * findSequence(const char * begin, const char * end, const char (&seq)[N])
+	{
+		return active().findSequence(begin, end, seq, N - 1);
+	}
+};
+
+#endif
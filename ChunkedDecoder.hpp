@@ -0,0 +1,289 @@
+#ifndef CHUNKED_DECODER_HPP__
+#define CHUNKED_DECODER_HPP__
+
+#include "ProxyException.hpp"
+#include "ByteScan.hpp"
+#include "HttpParser.hpp"
+#include <string>
+#include <cstring>
+#include <strings.h>
+#include <algorithm>
+#include <sys/types.h>
+#define CHUNKED_MAX_LINE 65536 // a chunk size line or trailer line longer than this is rejected
+
+// streaming decoder of a chunked body, fed with the body bytes as they are received
+// chunk sizes, extensions and trailers may be split anywhere between two receives
+// decode() moves the chunk data of the received bytes to their front, in place, so the framing is dropped without a copy
+// done() tells the exact end of the body, which is the last chunk and the trailer section after it
+// trailer fields are dropped, the decoded body is complete without them
+class ChunkedDecoder
+{
+private:
+	enum State
+	{
+		SIZE, // hex digits of the chunk size
+		EXTENSION, // chunk extension after the size, up to the end of line
+		SIZE_LF, // '\n' after the size line
+		DATA, // chunk data
+		DATA_CR, // "\r\n" after the chunk data
+		DATA_LF,
+		TRAILER, // beginning of a trailer line, an empty line ends the body
+		TRAILER_LINE, // rest of a trailer line
+		TRAILER_LF, // '\n' of the empty line
+		DONE
+	};
+
+	State state;
+	size_t chunk_size;
+	size_t size_digits;
+	size_t remaining; // data bytes of the chunk not received yet
+	size_t line_length; // bytes of the size or trailer line so far
+	size_t decoded; // data bytes of every chunk so far
+
+	static int hexValue(char c)
+	{
+		if(c >= '0' && c <= '9') return c - '0';
+		if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+		if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+		return -1;
+	}
+
+	// the size line is over, a zero size is the last chunk
+	void endSizeLine()
+	{
+		if(size_digits == 0)
+		{
+			throw ProxyException("Malformed chunked body");
+		}
+		remaining = chunk_size;
+		state = chunk_size == 0 ? TRAILER : DATA;
+		chunk_size = 0;
+		size_digits = 0;
+		line_length = 0;
+	}
+
+	void countLine(size_t n)
+	{
+		line_length += n;
+		if(line_length > CHUNKED_MAX_LINE)
+		{
+			throw ProxyException("Malformed chunked body");
+		}
+	}
+
+public:
+	ChunkedDecoder() :
+		state { SIZE },
+		chunk_size { 0 },
+		size_digits { 0 },
+		remaining { 0 },
+		line_length { 0 },
+		decoded { 0 }
+		{}
+
+	bool done() const
+	{
+		return state == DONE;
+	}
+
+	// data bytes decoded so far
+	size_t size() const
+	{
+		return decoded;
+	}
+
+	// decode the next len bytes of the body
+	// the chunk data among them is moved to the front of data, its length is stored into data_length
+	// return the bytes consumed, fewer than len only if the body ends before, the rest belongs to whatever follows it
+	size_t decode(char * data, size_t len, size_t & data_length)
+	{
+		size_t in = 0;
+		size_t out = 0;
+		while(in < len && state != DONE)
+		{
+			char c = data[in];
+			switch(state)
+			{
+				case SIZE:
+				{
+					int value = hexValue(c);
+					if(value != -1)
+					{
+						if(chunk_size > ((size_t)-1 >> 4))
+						{
+							throw ProxyException("Malformed chunked body");
+						}
+						chunk_size = chunk_size * 16 + value;
+						++size_digits;
+						countLine(1);
+						++in;
+					}
+					else if(c == ';' || c == ' ' || c == '\t')
+					{
+						state = EXTENSION;
+					}
+					else if(c == '\r')
+					{
+						state = SIZE_LF;
+						++in;
+					}
+					else if(c == '\n')
+					{
+						endSizeLine();
+						++in;
+					}
+					else
+					{
+						throw ProxyException("Malformed chunked body");
+					}
+					break;
+				}
+				case EXTENSION:
+				{
+					const char * newline = ByteScan::find(data + in, data + len, '\n');
+					countLine(newline - (data + in));
+					in = newline - data;
+					if(in < len)
+					{
+						endSizeLine();
+						++in;
+					}
+					break;
+				}
+				case SIZE_LF:
+					if(c != '\n')
+					{
+						throw ProxyException("Malformed chunked body");
+					}
+					endSizeLine();
+					++in;
+					break;
+				case DATA:
+				{
+					size_t n = std::min(remaining, len - in);
+					if(out != in)
+					{
+						memmove(data + out, data + in, n);
+					}
+					in += n;
+					out += n;
+					remaining -= n;
+					decoded += n;
+					if(remaining == 0)
+					{
+						state = DATA_CR;
+					}
+					break;
+				}
+				case DATA_CR:
+					if(c == '\r')
+					{
+						state = DATA_LF;
+					}
+					else if(c == '\n')
+					{
+						state = SIZE;
+					}
+					else
+					{
+						throw ProxyException("Malformed chunked body");
+					}
+					++in;
+					break;
+				case DATA_LF:
+					if(c != '\n')
+					{
+						throw ProxyException("Malformed chunked body");
+					}
+					state = SIZE;
+					++in;
+					break;
+				case TRAILER:
+					state = c == '\r' ? TRAILER_LF : c == '\n' ? DONE : TRAILER_LINE;
+					in += state == TRAILER_LINE ? 0 : 1;
+					break;
+				case TRAILER_LINE:
+				{
+					const char * newline = ByteScan::find(data + in, data + len, '\n');
+					countLine(newline - (data + in));
+					in = newline - data;
+					if(in < len)
+					{
+						state = TRAILER;
+						line_length = 0;
+						++in;
+					}
+					break;
+				}
+				case TRAILER_LF:
+					if(c != '\n')
+					{
+						throw ProxyException("Malformed chunked body");
+					}
+					state = DONE;
+					++in;
+					break;
+				default:
+					break;
+			}
+		}
+		data_length = out;
+		return in;
+	}
+
+	// header of the decoded body: chunked is dropped from Transfer-Encoding and Content-Length: length is added
+	// chunked is the last item of the last Transfer-Encoding field, only that item goes, other codings and fields stay
+	// the header is rebuilt from the fields of the parser, so lines ending in a bare "\n" are taken as well
+	// header includes the empty line at its end
+	static std::string unchunkedHeader(const std::string & header, size_t length)
+	{
+		const char * buf = header.data();
+		HttpParser head(HttpParser::RESPONSE);
+		if(head.parse(buf, header.size()) != HttpParser::DONE)
+		{
+			throw ProxyException("Malformed chunked response header");
+		}
+		size_t chunked_field = head.fieldCount();
+		for(size_t i = 0; i < head.fieldCount(); ++i)
+		{
+			const HttpParser::Field & f = head.field(i);
+			if(f.name.length == 17 && strncasecmp(f.name.data(buf), "Transfer-Encoding", 17) == 0)
+			{
+				chunked_field = HttpParser::lastIs(f.value.data(buf), f.value.length, "chunked") ? i : head.fieldCount();
+			}
+		}
+
+		std::string res;
+		res.reserve(header.size() + 24);
+		res.append(head.firstLine().data(buf), head.firstLine().length);
+		res += "\r\n";
+		for(size_t i = 0; i < head.fieldCount(); ++i)
+		{
+			const HttpParser::Field & f = head.field(i);
+			const char * value = f.value.data(buf);
+			const char * value_end = value + f.value.length;
+			if(f.name.length == 14 && strncasecmp(f.name.data(buf), "Content-Length", 14) == 0)
+			{
+				continue;
+			}
+			if(i == chunked_field)
+			{
+				// cut the last item and the separators before it, the field goes if nothing is left
+				for(; value_end > value && value_end[-1] != ','; --value_end);
+				for(; value_end > value && (value_end[-1] == ',' || value_end[-1] == ' ' || value_end[-1] == '\t'); --value_end);
+				if(value_end == value)
+				{
+					continue;
+				}
+			}
+			res.append(f.name.data(buf), f.name.length);
+			res += ": ";
+			res.append(value, value_end);
+			res += "\r\n";
+		}
+		res += "Content-Length: " + std::to_string(length) + "\r\n\r\n";
+		return res;
+	}
+};
+
+#endif
@@ -0,0 +1,298 @@
+#ifndef COALESCER_HPP__
+#define COALESCER_HPP__
+
+#include "Response.hpp"
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <functional>
+#include <unordered_map>
+#include <condition_variable>
+
+// one origin fetch shared by concurrent requests for the same url
+// the leader publishes the response bytes as they arrive, followers stream them from the first byte on
+// bytes are only kept once a follower has joined: until then publishing just counts them, and a request arriving
+// after uncounted bytes can't get the whole response, so it fetches alone
+// a response growing beyond max_bytes fails the flight and its bytes are dropped
+class Flight
+{
+public:
+	typedef std::shared_ptr<const std::vector<char>> Chunk;
+	typedef std::function<void()> Watcher; // called after new bytes or the end are published
+
+	enum State
+	{
+		PENDING, // more bytes may come
+		DONE, // every byte is published
+		CACHED, // the leader's revalidation got status code 304, respond with response() instead
+		FAILED // the leader gave up or the response is too large, followers which got no byte yet fetch on their own
+	};
+
+private:
+	std::mutex mtx;
+	std::condition_variable cv;
+	std::vector<Chunk> chunks;
+	size_t bytes; // bytes published, kept in chunks unless skipped
+	size_t max_bytes;
+	size_t followers;
+	bool skipped; // bytes were published before any follower joined, and not kept
+	State state;
+	bool persistent; // DONE: the response ends at a known length, clients may send another request afterwards
+	std::shared_ptr<const Response> cached;
+	std::vector<Watcher> watchers;
+
+	// wake up followers, the lock is released first so that watchers may take their own locks
+	void notify(std::unique_lock<std::mutex> & lck)
+	{
+		std::vector<Watcher> to_call(watchers);
+		lck.unlock();
+		cv.notify_all();
+		for(const Watcher & watcher : to_call)
+		{
+			watcher();
+		}
+	}
+
+	void end(State new_state, const std::shared_ptr<const Response> & response)
+	{
+		std::unique_lock<std::mutex> lck(mtx);
+		end(lck, new_state, response);
+	}
+
+	void end(std::unique_lock<std::mutex> & lck, State new_state, const std::shared_ptr<const Response> & response)
+	{
+		if(state != PENDING)
+		{
+			return;
+		}
+		state = new_state;
+		cached = response;
+		if(state == FAILED)
+		{
+			// nobody relays bytes of a failed flight to completion, release them now
+			std::vector<Chunk>().swap(chunks);
+		}
+		notify(lck);
+	}
+
+public:
+	const int leader_id;
+
+	Flight(int _leader_id, size_t _max_bytes) :
+		bytes { 0 },
+		max_bytes { _max_bytes },
+		followers { 0 },
+		skipped { false },
+		state { PENDING },
+		persistent { false },
+		leader_id { _leader_id }
+		{}
+
+	// leader side
+	// the bytes are copied only if a follower may still need them, no-op once the flight has ended
+	void publish(const char * data, size_t len)
+	{
+		std::unique_lock<std::mutex> lck(mtx);
+		if(len == 0 || state != PENDING)
+		{
+			return;
+		}
+		bytes += len;
+		if(bytes > max_bytes)
+		{
+			end(lck, FAILED, std::shared_ptr<const Response>());
+			return;
+		}
+		if(followers == 0)
+		{
+			skipped = true;
+			return;
+		}
+
+		// only the leader publishes, so the chunks stay in order while the copy is made without the lock
+		lck.unlock();
+		Chunk chunk = std::make_shared<const std::vector<char>>(data, data + len);
+		lck.lock();
+		if(state == PENDING)
+		{
+			chunks.push_back(chunk);
+			notify(lck);
+		}
+	}
+
+	void finish(bool _persistent)
+	{
+		{
+			std::unique_lock<std::mutex> lck(mtx);
+			persistent = _persistent;
+		}
+		end(DONE, std::shared_ptr<const Response>());
+	}
+
+	void finishCached(const std::shared_ptr<const Response> & response)
+	{
+		end(CACHED, response);
+	}
+
+	// no-op once the flight has ended
+	void fail()
+	{
+		end(FAILED, std::shared_ptr<const Response>());
+	}
+
+	// follower side
+	// join the flight, false if it can no longer deliver the whole response
+	bool follow()
+	{
+		std::unique_lock<std::mutex> lck(mtx);
+		if(skipped || state == FAILED)
+		{
+			return false;
+		}
+		++followers;
+		return true;
+	}
+
+	// used by event loops, which can't block
+	void watch(const Watcher & watcher)
+	{
+		std::unique_lock<std::mutex> lck(mtx);
+		watchers.push_back(watcher);
+	}
+
+	// append the chunks from index next on to out, without blocking
+	// once the returned state is not PENDING, out holds every chunk left
+	State take(size_t next, std::vector<Chunk> & out)
+	{
+		std::unique_lock<std::mutex> lck(mtx);
+		for(size_t i = next; i < chunks.size(); ++i)
+		{
+			out.push_back(chunks[i]);
+		}
+		return state;
+	}
+
+	// take(), blocking until there is a chunk from index next on or the flight ends
+	State wait(size_t next, std::vector<Chunk> & out)
+	{
+		std::unique_lock<std::mutex> lck(mtx);
+		while(state == PENDING && chunks.size() <= next)
+		{
+			cv.wait(lck);
+		}
+		for(size_t i = next; i < chunks.size(); ++i)
+		{
+			out.push_back(chunks[i]);
+		}
+		return state;
+	}
+
+	// whether the connection of a client may carry another request after DONE
+	bool isPersistent()
+	{
+		std::unique_lock<std::mutex> lck(mtx);
+		return persistent;
+	}
+
+	// the response to send for CACHED
+	std::shared_ptr<const Response> response()
+	{
+		std::unique_lock<std::mutex> lck(mtx);
+		return cached;
+	}
+};
+
+// the flights in progress, keyed by url
+class Coalescer
+{
+public:
+	enum Role
+	{
+		LEADER, // fetch from the server and publish to the flight
+		FOLLOWER, // respond from the flight
+		ALONE // fetch from the server without a flight
+	};
+
+private:
+	std::mutex mtx;
+	std::unordered_map<std::string, std::shared_ptr<Flight>> flights;
+	size_t max_bytes; // a flight publishing more bytes than this fails
+
+public:
+	explicit Coalescer(size_t _max_bytes) :
+		max_bytes { _max_bytes }
+		{}
+
+	Role join(const std::string & url, int client_id, std::shared_ptr<Flight> & flight)
+	{
+		std::unique_lock<std::mutex> lck(mtx);
+		std::unordered_map<std::string, std::shared_ptr<Flight>>::iterator it = flights.find(url);
+		if(it == flights.end())
+		{
+			flight = std::make_shared<Flight>(client_id, max_bytes);
+			flights[url] = flight;
+			return LEADER;
+		}
+		if(!it->second->follow())
+		{
+			return ALONE;
+		}
+		flight = it->second;
+		return FOLLOWER;
+	}
+
+	// the leader is done with the flight, later requests for the url start a new one
+	// a flight left before it finished fails
+	void leave(const std::string & url, const std::shared_ptr<Flight> & flight)
+	{
+		{
+			std::unique_lock<std::mutex> lck(mtx);
+			std::unordered_map<std::string, std::shared_ptr<Flight>>::iterator it = flights.find(url);
+			if(it != flights.end() && it->second == flight)
+			{
+				flights.erase(it);
+			}
+		}
+		flight->fail();
+	}
+};
+
+// held by a threaded leader, leaves its flight when going out of scope, also when an exception unwinds
+class FlightGuard
+{
+private:
+	Coalescer & coalescer;
+	std::string url;
+	std::shared_ptr<Flight> flight;
+
+public:
+	FlightGuard(Coalescer & _coalescer, const std::string & _url) :
+		coalescer (_coalescer),
+		url { _url }
+		{}
+
+	FlightGuard(const FlightGuard &) = delete;
+	FlightGuard & operator=(const FlightGuard &) = delete;
+
+	~FlightGuard()
+	{
+		if(flight)
+		{
+			coalescer.leave(url, flight);
+		}
+	}
+
+	void lead(const std::shared_ptr<Flight> & _flight)
+	{
+		flight = _flight;
+	}
+
+	// NULL without a flight
+	Flight * get() const
+	{
+		return flight.get();
+	}
+};
+
+#endif
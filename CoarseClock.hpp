@@ -0,0 +1,61 @@
+#ifndef COARSE_CLOCK_HPP__
+#define COARSE_CLOCK_HPP__
+
+#include <ctime>
+#include <string>
+
+// wall clock for log lines, which only need seconds
+// now() reads the coarse clock the kernel keeps for every tick, without a syscall and without asking the hardware,
+// the text of a time is kept per thread, so asctime() runs once per second per thread at most
+class CoarseClock
+{
+private:
+	// the last time formatted and its text
+	struct Formatted
+	{
+		time_t time;
+		std::string text;
+
+		Formatted() :
+			time { -1 }
+			{}
+
+		const std::string & get(time_t t)
+		{
+			if(t != time)
+			{
+				struct tm tm;
+				char dt[32];
+				localtime_r(&t, &tm);
+				asctime_r(&tm, dt);
+				text = dt;
+				time = t;
+			}
+			return text;
+		}
+	};
+
+public:
+	static time_t now()
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+		return ts.tv_sec;
+	}
+
+	// the current time in the format of asctime(), including its '\n'
+	static const std::string & asctime()
+	{
+		static thread_local Formatted current;
+		return current.get(now());
+	}
+
+	// any other time, such as an expiration time, which tends to repeat for the same response
+	static const std::string & format(time_t t)
+	{
+		static thread_local Formatted other;
+		return other.get(t);
+	}
+};
+
+#endif
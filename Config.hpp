@@ -0,0 +1,286 @@
+#ifndef CONFIG_HPP__
+#define CONFIG_HPP__
+
+#include "ProxyException.hpp"
+#include <string>
+#include <thread>
+#include <cstdlib>
+#define CACHE_SIZE 500 // default number of cached responses
+
+// runtime options of the proxy, parsed from command line arguments of the form --key=value
+class Config
+{
+private:
+	// size in bytes, with an optional K/M/G suffix
+	static size_t toBytes(const std::string & key, const std::string & val)
+	{
+		char * end = NULL;
+		long long res = strtoll(val.c_str(), &end, 10);
+		size_t unit = 1;
+		if(*end == 'K' || *end == 'k') unit = 1ULL << 10;
+		else if(*end == 'M' || *end == 'm') unit = 1ULL << 20;
+		else if(*end == 'G' || *end == 'g') unit = 1ULL << 30;
+		if(val.empty() || end == val.c_str() || res <= 0 || (unit != 1 && *++end != '\0') || (unit == 1 && *end != '\0'))
+		{
+			throw ProxyException("Invalid value for option " + key);
+		}
+		return res * unit;
+	}
+
+	static int toInt(const std::string & key, const std::string & val)
+	{
+		char * end = NULL;
+		long res = strtol(val.c_str(), &end, 10);
+		if(val.empty() || *end != '\0' || res < 0)
+		{
+			throw ProxyException("Invalid value for option " + key);
+		}
+		return res;
+	}
+
+public:
+	enum Mode
+	{
+		THREAD, // one blocking thread per connection
+		EVENT // edge-triggered epoll loops, one per core
+	};
+
+	// what THREAD mode does with a new connection when every worker is busy
+	enum Overload
+	{
+		QUEUE, // wait in the admission queue, respond 503 once the queue is full
+		SHED, // respond 503 right away
+		BLOCK // wait in the admission queue, stop accepting once the queue is full
+	};
+
+	Mode mode;
+	int loops; // number of event loops in EVENT mode
+	int workers; // number of worker threads in THREAD mode
+	int queue_size; // capacity of the admission queue in THREAD mode
+	Overload overload;
+	int listeners; // listening sockets sharing the port with SO_REUSEPORT, each with its own acceptor
+	bool pin; // pin acceptors (THREAD mode) or loops (EVENT mode) to cores
+	int cache_size; // total number of cached responses
+	int cache_shards; // number of independently locked cache shards, rounded up to a power of two
+	size_t cache_bytes; // memory budget of the cache
+	size_t max_object; // responses larger than this are not cached
+	bool zerocopy; // send large cached responses with MSG_ZEROCOPY
+	bool splice; // tunnels move bytes with splice() instead of copying them through user space
+	std::string disk_dir; // directory of the disk cache, empty for no disk cache
+	size_t disk_bytes; // disk budget of the disk cache
+	int promote; // disk hits before a response moves back to memory, 0 for never
+	bool coalesce; // concurrent misses of the same url share one fetch
+	std::string snapshot; // file of the warm-start snapshot, empty for no snapshot
+	int snapshot_interval; // seconds between two snapshots, 0 for only on shutdown
+	int upstream_idle; // idle keep-alive connections kept per server, 0 for no reuse
+	int upstream_max; // connections per server which may be kept for reuse, busy or idle
+	int upstream_idle_timeout; // seconds an idle server connection is kept
+	int client_idle_timeout; // seconds a client connection waits for its next request, 0 for one request per connection (the THREAD mode default)
+	int dns_cache; // number of server name lookups kept
+	int dns_ttl; // seconds a resolved name is kept
+	int dns_negative_ttl; // seconds a name which failed to resolve is kept
+	size_t log_buffer; // bytes of log lines buffered per thread
+	bool log_block; // a thread whose log buffer is full waits for the writer, otherwise the line is dropped
+	int timing_sample; // one request in this many logs its timing line, 0 for none
+
+	Config() :
+		mode { EVENT },
+		loops { cores() },
+		workers { 4 * cores() }, // workers block on I/O, so several of them per core
+		queue_size { 1024 },
+		overload { QUEUE },
+		listeners { 1 },
+		pin { false },
+		cache_size { CACHE_SIZE },
+		cache_shards { 16 },
+		cache_bytes { 256ULL << 20 },
+		max_object { 16ULL << 20 },
+		zerocopy { false },
+		splice { true },
+		disk_bytes { 1ULL << 30 },
+		promote { 2 },
+		coalesce { true },
+		snapshot_interval { 300 },
+		upstream_idle { 8 },
+		upstream_max { 32 },
+		upstream_idle_timeout { 30 },
+		client_idle_timeout { -1 }, // not given yet, the default depends on the mode
+		dns_cache { 1024 },
+		dns_ttl { 60 },
+		dns_negative_ttl { 5 },
+		log_buffer { 256ULL << 10 },
+		log_block { true },
+		timing_sample { 100 }
+		{}
+
+	static int cores()
+	{
+		return std::thread::hardware_concurrency() == 0 ? 1 : (int)std::thread::hardware_concurrency();
+	}
+
+	void parse(int argc, char ** argv)
+	{
+		for(int i = 1; i < argc; ++i)
+		{
+			const std::string arg(argv[i]);
+			size_t idx = arg.find('=');
+			if(arg.find("--") != 0 || idx == std::string::npos)
+			{
+				throw ProxyException("Unknown argument " + arg);
+			}
+			const std::string key = arg.substr(2, idx - 2);
+			const std::string val = arg.substr(idx + 1);
+
+			if(key == "mode")
+			{
+				if(val == "thread") mode = THREAD;
+				else if(val == "event") mode = EVENT;
+				else throw ProxyException("Unknown mode " + val);
+			}
+			else if(key == "loops")
+			{
+				loops = toInt(key, val);
+				if(loops == 0) throw ProxyException("Option loops must be positive");
+			}
+			else if(key == "workers")
+			{
+				workers = toInt(key, val);
+				if(workers == 0) throw ProxyException("Option workers must be positive");
+			}
+			else if(key == "queue")
+			{
+				queue_size = toInt(key, val);
+			}
+			else if(key == "overload")
+			{
+				if(val == "queue") overload = QUEUE;
+				else if(val == "shed") overload = SHED;
+				else if(val == "block") overload = BLOCK;
+				else throw ProxyException("Unknown overload policy " + val);
+			}
+			else if(key == "listeners")
+			{
+				listeners = toInt(key, val);
+				if(listeners == 0) throw ProxyException("Option listeners must be positive");
+			}
+			else if(key == "cache-size")
+			{
+				cache_size = toInt(key, val);
+				if(cache_size == 0) throw ProxyException("Option cache-size must be positive");
+			}
+			else if(key == "cache-shards")
+			{
+				cache_shards = toInt(key, val);
+				if(cache_shards == 0) throw ProxyException("Option cache-shards must be positive");
+			}
+			else if(key == "cache-bytes")
+			{
+				cache_bytes = toBytes(key, val);
+			}
+			else if(key == "max-object")
+			{
+				max_object = toBytes(key, val);
+			}
+			else if(key == "zerocopy")
+			{
+				zerocopy = toInt(key, val) != 0;
+			}
+			else if(key == "splice")
+			{
+				splice = toInt(key, val) != 0;
+			}
+			else if(key == "disk-dir")
+			{
+				if(val.empty()) throw ProxyException("Option disk-dir must not be empty");
+				disk_dir = val;
+			}
+			else if(key == "disk-bytes")
+			{
+				disk_bytes = toBytes(key, val);
+			}
+			else if(key == "promote")
+			{
+				promote = toInt(key, val);
+			}
+			else if(key == "coalesce")
+			{
+				coalesce = toInt(key, val) != 0;
+			}
+			else if(key == "snapshot")
+			{
+				if(val.empty()) throw ProxyException("Option snapshot must not be empty");
+				snapshot = val;
+			}
+			else if(key == "snapshot-interval")
+			{
+				snapshot_interval = toInt(key, val);
+			}
+			else if(key == "upstream-idle")
+			{
+				upstream_idle = toInt(key, val);
+			}
+			else if(key == "upstream-max")
+			{
+				upstream_max = toInt(key, val);
+				if(upstream_max == 0) throw ProxyException("Option upstream-max must be positive");
+			}
+			else if(key == "upstream-idle-timeout")
+			{
+				upstream_idle_timeout = toInt(key, val);
+				if(upstream_idle_timeout == 0) throw ProxyException("Option upstream-idle-timeout must be positive");
+			}
+			else if(key == "client-idle-timeout")
+			{
+				client_idle_timeout = toInt(key, val);
+			}
+			else if(key == "dns-cache")
+			{
+				dns_cache = toInt(key, val);
+				if(dns_cache == 0) throw ProxyException("Option dns-cache must be positive");
+			}
+			else if(key == "dns-ttl")
+			{
+				dns_ttl = toInt(key, val);
+				if(dns_ttl == 0) throw ProxyException("Option dns-ttl must be positive");
+			}
+			else if(key == "dns-negative-ttl")
+			{
+				dns_negative_ttl = toInt(key, val);
+				if(dns_negative_ttl == 0) throw ProxyException("Option dns-negative-ttl must be positive");
+			}
+			else if(key == "log-buffer")
+			{
+				log_buffer = toBytes(key, val);
+			}
+			else if(key == "log-full")
+			{
+				if(val == "block") log_block = true;
+				else if(val == "drop") log_block = false;
+				else throw ProxyException("Unknown log-full policy " + val);
+			}
+			else if(key == "timing-sample")
+			{
+				timing_sample = toInt(key, val);
+			}
+			else if(key == "pin")
+			{
+				pin = toInt(key, val) != 0;
+			}
+			else
+			{
+				throw ProxyException("Unknown option " + key);
+			}
+		}
+		if(client_idle_timeout == -1)
+		{
+			client_idle_timeout = mode == THREAD ? 0 : 15;
+		}
+	}
+
+	static const char * usage()
+	{
+		return "usage: proxy [--mode=event|thread] [--loops=N] [--workers=N] [--queue=N] [--overload=queue|shed|block] [--listeners=N] [--pin=0|1] [--cache-size=N] [--cache-shards=N] [--cache-bytes=N[K|M|G]] [--max-object=N[K|M|G]] [--zerocopy=0|1] [--splice=0|1] [--disk-dir=PATH] [--disk-bytes=N[K|M|G]] [--promote=N] [--coalesce=0|1] [--snapshot=PATH] [--snapshot-interval=N] [--upstream-idle=N] [--upstream-max=N] [--upstream-idle-timeout=N] [--client-idle-timeout=N] [--dns-cache=N] [--dns-ttl=N] [--dns-negative-ttl=N] [--log-buffer=N[K|M|G]] [--log-full=block|drop] [--timing-sample=N]";
+	}
+};
+
+#endif
@@ -0,0 +1,139 @@
+#ifndef CONNECTION_HPP__
+#define CONNECTION_HPP__
+
+#include "Request.hpp"
+#include "Response.hpp"
+#include "SegmentSender.hpp"
+#include "Coalescer.hpp"
+#include "SplicePipe.hpp"
+#include "HttpParser.hpp"
+#include "ChunkedDecoder.hpp"
+#include "RequestTiming.hpp"
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+// per-client state of the event-driven engine
+// the event loop drives every accepted client as a state machine:
+// READ_REQUEST -> (RESOLVE) -> CONNECT_SERVER -> FORWARD / TUNNEL -> WRITE_RESPONSE -> CLOSED
+// a fresh cache hit goes from READ_REQUEST to WRITE_RESPONSE directly
+// a miss of a url which is being fetched already goes from READ_REQUEST to FOLLOW -> WRITE_RESPONSE
+// a kept-alive client goes from WRITE_RESPONSE back to READ_REQUEST for its next request
+class Connection
+{
+public:
+	enum State
+	{
+		READ_REQUEST, // receiving request from client until the header (and body) is complete
+		RESOLVE, // the server name is being looked up in the background
+		CONNECT_SERVER, // non-blocking connect to server is in progress
+		FORWARD, // sending request to server, relaying response to client
+		TUNNEL, // CONNECT request, relaying bytes in both directions
+		FOLLOW, // relaying the response fetched by another request for the same url
+		WRITE_RESPONSE, // response is complete, draining bytes left for client
+		CLOSED
+	};
+
+	State state;
+	int client_id;
+	int client_fd;
+	int server_fd;
+	std::string client_ip;
+	Request request;
+	std::string upstream_key; // host:port of the server fd in the upstream pool
+	bool upstream_pooled; // server fd counts against the upstream pool
+	std::vector<char> upstream_retry; // request sent on an idle pooled server fd, sent again on a new one if that fails before responding
+	bool upstream_fresh; // the pool is skipped, the request is retried on a new connection
+
+	std::vector<char> client_in; // bytes received from client, the request being read and pipelined ones after it
+	HttpParser request_head; // progress of parsing the request header at the beginning of client_in
+	std::chrono::steady_clock::time_point read_since; // when READ_REQUEST began, for the idle timeout
+	std::vector<char> server_out; // bytes waiting to be sent to server
+	size_t server_out_off;
+	std::vector<char> client_out; // bytes waiting to be sent to client
+	size_t client_out_off;
+
+	// cached response being sent to client, shared with the cache
+	std::shared_ptr<const Response> cached;
+	SegmentSender cached_sender; // position in the cached response
+
+	// response bookkeeping, used in FORWARD state
+	bool revalidating; // request carries If-None-Match/If-Modified-Since
+	bool header_done;
+	std::string header; // complete response header, including the trailing \r\n\r\n
+	std::vector<char> header_buf; // response bytes received before the header is complete
+	HttpParser response_head; // progress of parsing the response header in header_buf
+	ResponseBuffer body; // the whole response, stored into cache
+	size_t kept_length; // bytes of the response kept for cache
+	std::vector<char> scratch; // receive buffer of the server side
+	long content_length; // -1 for unknown length
+	long body_received;
+	bool chunked;
+	ChunkedDecoder decoder; // finds the end of a chunked body, decodes the body kept for cache
+
+	// the fetch shared with concurrent requests for the same url
+	std::shared_ptr<Flight> flight;
+	bool flight_leader; // publishes to flight, otherwise follows it
+	size_t flight_next; // index of the next chunk to relay when following
+
+	bool persistent; // the client can tell where the response ends without the connection being closed
+
+	RequestTiming timing; // where the time of the request went, also recorded into the metrics
+
+	// CONNECT tunnel, index 0 for client to server, 1 for server to client
+	std::unique_ptr<SplicePipe> tunnel_pipes[2]; // empty if the bytes are copied through server_out/client_out
+	bool tunnel_eof[2]; // the sending side has closed
+	bool tunnel_shut[2]; // the close has been passed on to the receiving side
+
+	Connection(int _client_id, int _client_fd, const std::string & _client_ip) :
+		state { READ_REQUEST },
+		client_id { _client_id },
+		client_fd { _client_fd },
+		server_fd { -1 },
+		client_ip { _client_ip },
+		upstream_pooled { false },
+		upstream_fresh { false },
+		request_head { HttpParser::REQUEST },
+		read_since { std::chrono::steady_clock::now() },
+		server_out_off { 0 },
+		client_out_off { 0 },
+		revalidating { false },
+		header_done { false },
+		response_head { HttpParser::RESPONSE },
+		kept_length { 0 },
+		content_length { -1 },
+		body_received { 0 },
+		chunked { false },
+		flight_leader { false },
+		flight_next { 0 },
+		persistent { false },
+		tunnel_eof { false, false },
+		tunnel_shut { false, false }
+		{}
+
+	// forget the request just responded to, keeping the client fd and the bytes received after the request
+	// the server fd has been released already
+	void nextRequest(int _client_id)
+	{
+		Connection next(_client_id, client_fd, client_ip);
+		next.client_in.swap(client_in);
+		*this = std::move(next);
+	}
+
+	size_t pendingClient() const
+	{
+		return client_out.size() - client_out_off;
+	}
+
+	size_t pendingServer() const
+	{
+		return server_out.size() - server_out_off;
+	}
+};
+
+// both client fd and server fd of a connection map to the same Connection
+typedef std::unordered_map<int, std::shared_ptr<Connection>> ConnectionMap;
+
+#endif
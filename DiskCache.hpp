@@ -0,0 +1,482 @@
+#ifndef DISK_CACHE_HPP__
+#define DISK_CACHE_HPP__
+
+#include "ProxyException.hpp"
+#include "Parser.hpp"
+#include "Response.hpp"
+#include "ResponseBuffer.hpp"
+#include <list>
+#include <deque>
+#include <mutex>
+#include <ctime>
+#include <cerrno>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <algorithm>
+#include <unordered_map>
+#include <condition_variable>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/types.h>
+#define DISK_CACHE_MAGIC 0x31504348 // "HCP1"
+#define DISK_PENDING_MAX (64ULL << 20) // bytes of evicted responses waiting to be written, more are dropped
+
+// second tier of the cache, holds responses evicted from memory in a local directory
+// every response is one file: a fixed header, the url, the response header, then the raw response
+// hits map the file read-only, so a response is served from the page cache without reading it into the heap
+// evicted responses are written by a background thread, so the evicting thread never waits for the disk
+// the index lives in memory and is rebuilt from the files on startup, the tier has its own byte budget
+class DiskCache
+{
+private:
+	struct FileHeader
+	{
+		uint32_t magic;
+		uint32_t url_length;
+		uint64_t header_length;
+		uint64_t content_length;
+		int64_t cur_time; // when the response was received, ages are computed from it
+	};
+
+	typedef std::list<const std::string *> LRUList; // points at the keys of index, front is the least recently used
+
+	struct Entry
+	{
+		unsigned long long id; // the file is <id>.obj
+		size_t bytes; // file size
+		unsigned hits; // hits since the response was written
+		LRUList::iterator pos;
+	};
+
+	Parser parser;
+	std::string dir;
+	size_t max_bytes;
+
+	std::mutex mtx; // protects everything below
+	size_t bytes; // bytes of all files in index
+	unsigned long long next_id;
+	LRUList lru;
+	std::unordered_map<std::string, Entry> index; // key for url
+
+	// evicted responses waiting for the writer
+	std::deque<std::pair<std::string, std::shared_ptr<const Response>>> pending;
+	size_t pending_bytes;
+	std::string writing; // url of the response the writer is writing, empty if none
+	bool writing_removed; // the url was removed meanwhile, the file is dropped once written
+	std::condition_variable not_empty;
+	bool stopping;
+	std::thread writer;
+
+	std::string pathOf(unsigned long long id, const char * suffix) const
+	{
+		return dir + "/" + std::to_string(id) + suffix;
+	}
+
+	void erase(std::unordered_map<std::string, Entry>::iterator it, std::vector<unsigned long long> & unlinked)
+	{
+		unlinked.push_back(it->second.id);
+		bytes -= it->second.bytes;
+		lru.erase(it->second.pos);
+		index.erase(it);
+	}
+
+	// add a file to index, replacing an older file of the same url, then evict down to the byte budget
+	// files to unlink are collected, so that the disk is touched outside the lock
+	void insert(const std::string & url, unsigned long long id, size_t file_bytes, std::vector<unsigned long long> & unlinked)
+	{
+		std::unordered_map<std::string, Entry>::iterator it = index.find(url);
+		if(it != index.end())
+		{
+			erase(it, unlinked);
+		}
+		while(!lru.empty() && bytes + file_bytes > max_bytes)
+		{
+			erase(index.find(*lru.front()), unlinked);
+		}
+		it = index.insert(std::make_pair(url, Entry())).first;
+		it->second.id = id;
+		it->second.bytes = file_bytes;
+		it->second.hits = 0;
+		it->second.pos = lru.insert(lru.end(), &it->first);
+		bytes += file_bytes;
+	}
+
+	void unlinkAll(const std::vector<unsigned long long> & unlinked)
+	{
+		for(unsigned long long id : unlinked)
+		{
+			unlink(pathOf(id, ".obj").c_str());
+		}
+	}
+
+	// read the fixed header and the url of a file
+	// return false if the file is not a complete response file
+	static bool readHead(int fd, FileHeader & head, std::string & url, size_t & file_bytes)
+	{
+		struct stat st;
+		if(fstat(fd, &st) == -1 || pread(fd, &head, sizeof(head), 0) != sizeof(head) || head.magic != DISK_CACHE_MAGIC)
+		{
+			return false;
+		}
+		file_bytes = st.st_size;
+		if(file_bytes != sizeof(head) + head.url_length + head.header_length + head.content_length)
+		{
+			return false;
+		}
+		url.resize(head.url_length);
+		return head.url_length == 0 || pread(fd, &url[0], head.url_length, sizeof(head)) == (ssize_t)head.url_length;
+	}
+
+	// write one response to a new file, the file only gets its final name once it is complete
+	// return the file size, 0 on failure
+	size_t writeFile(const std::string & url, const Response & response, unsigned long long id)
+	{
+		FileHeader head;
+		memset(&head, 0, sizeof(head));
+		head.magic = DISK_CACHE_MAGIC;
+		head.url_length = url.size();
+		head.header_length = response.header.size();
+		head.content_length = response.content.size();
+		head.cur_time = response.cur_time;
+
+		struct iovec iov[4];
+		iov[0].iov_base = &head;
+		iov[0].iov_len = sizeof(head);
+		iov[1].iov_base = (void *)url.data();
+		iov[1].iov_len = url.size();
+		iov[2].iov_base = (void *)response.header.data();
+		iov[2].iov_len = response.header.size();
+		iov[3].iov_base = (void *)response.content.data();
+		iov[3].iov_len = response.content.size();
+		size_t total = 0;
+		for(const struct iovec & span : iov)
+		{
+			total += span.iov_len;
+		}
+
+		const std::string tmp = pathOf(id, ".tmp");
+		int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if(fd == -1)
+		{
+			return 0;
+		}
+		size_t written = 0;
+		int idx = 0;
+		while(written < total)
+		{
+			ssize_t len = writev(fd, &iov[idx], 4 - idx);
+			if(len == -1)
+			{
+				if(errno == EINTR) continue;
+				break;
+			}
+			written += len;
+
+			// skip the spans written completely, advance into the partial one
+			while(idx < 4 && (size_t)len >= iov[idx].iov_len)
+			{
+				len -= iov[idx].iov_len;
+				++idx;
+			}
+			if(idx < 4)
+			{
+				iov[idx].iov_base = (char *)iov[idx].iov_base + len;
+				iov[idx].iov_len -= len;
+			}
+		}
+		close(fd);
+		if(written < total || rename(tmp.c_str(), pathOf(id, ".obj").c_str()) == -1)
+		{
+			unlink(tmp.c_str());
+			return 0;
+		}
+		return total;
+	}
+
+	void writerLoop()
+	{
+		while(true)
+		{
+			std::pair<std::string, std::shared_ptr<const Response>> job;
+			unsigned long long id = 0;
+			{
+				std::unique_lock<std::mutex> lck(mtx);
+				while(!stopping && pending.empty())
+				{
+					not_empty.wait(lck);
+				}
+				if(pending.empty())
+				{
+					return;
+				}
+				job = std::move(pending.front());
+				pending.pop_front();
+				pending_bytes -= job.second->content.size();
+				id = next_id++;
+				writing = job.first;
+				writing_removed = false;
+			}
+
+			size_t file_bytes = writeFile(job.first, *job.second, id);
+			std::vector<unsigned long long> unlinked;
+			{
+				std::unique_lock<std::mutex> lck(mtx);
+				if(file_bytes != 0 && writing_removed)
+				{
+					unlinked.push_back(id);
+				}
+				else if(file_bytes != 0)
+				{
+					insert(job.first, id, file_bytes, unlinked);
+				}
+				writing.clear();
+			}
+			unlinkAll(unlinked);
+		}
+	}
+
+	// rebuild index from the files in dir, least recently modified first
+	// partial files of an interrupted write are removed
+	void rebuild()
+	{
+		DIR * dp = opendir(dir.c_str());
+		if(dp == NULL)
+		{
+			throw ProxyException("Open disk cache directory error");
+		}
+
+		struct Found
+		{
+			std::string url;
+			unsigned long long id;
+			size_t bytes;
+			time_t mtime;
+		};
+		std::vector<Found> found;
+		std::vector<std::string> garbage;
+		struct dirent * ent;
+		while((ent = readdir(dp)) != NULL)
+		{
+			const std::string name(ent->d_name);
+			size_t dot = name.rfind('.');
+			if(dot == std::string::npos || dot == 0 || name.find_first_not_of("0123456789") != dot)
+			{
+				continue;
+			}
+			const std::string path = dir + "/" + name;
+			if(name.substr(dot) == ".tmp")
+			{
+				garbage.push_back(path);
+				continue;
+			}
+			if(name.substr(dot) != ".obj")
+			{
+				continue;
+			}
+
+			Found file;
+			file.id = strtoull(name.c_str(), NULL, 10);
+			FileHeader head;
+			struct stat st;
+			int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+			bool valid = fd != -1 && readHead(fd, head, file.url, file.bytes) && fstat(fd, &st) == 0;
+			if(fd != -1)
+			{
+				close(fd);
+			}
+			if(!valid)
+			{
+				garbage.push_back(path);
+				continue;
+			}
+			file.mtime = st.st_mtime;
+			found.push_back(file);
+		}
+		closedir(dp);
+
+		std::sort(found.begin(), found.end(), [](const Found & a, const Found & b)
+		{
+			return a.mtime != b.mtime ? a.mtime < b.mtime : a.id < b.id;
+		});
+		std::vector<unsigned long long> unlinked;
+		for(const Found & file : found)
+		{
+			insert(file.url, file.id, file.bytes, unlinked);
+			next_id = std::max(next_id, file.id + 1);
+		}
+		unlinkAll(unlinked);
+		for(const std::string & path : garbage)
+		{
+			unlink(path.c_str());
+		}
+	}
+
+public:
+	DiskCache() :
+		max_bytes { 0 },
+		bytes { 0 },
+		next_id { 0 },
+		pending_bytes { 0 },
+		writing_removed { false },
+		stopping { false }
+		{}
+
+	DiskCache(const DiskCache &) = delete;
+	DiskCache & operator=(const DiskCache &) = delete;
+
+	// finish pending writes, so that a restart finds them
+	~DiskCache()
+	{
+		{
+			std::unique_lock<std::mutex> lck(mtx);
+			stopping = true;
+		}
+		not_empty.notify_all();
+		if(writer.joinable())
+		{
+			writer.join();
+		}
+	}
+
+	// use dir as the store, it is created if missing and its files are indexed
+	void open(const std::string & _dir, size_t _max_bytes)
+	{
+		dir = _dir;
+		max_bytes = _max_bytes;
+		if(mkdir(dir.c_str(), 0755) == -1 && errno != EEXIST)
+		{
+			throw ProxyException("Create disk cache directory error");
+		}
+		rebuild();
+		writer = std::thread(&DiskCache::writerLoop, this);
+	}
+
+	bool enabled() const
+	{
+		return !dir.empty();
+	}
+
+	// queue an evicted response for writing, dropped if the writer is too far behind or it can never fit
+	void store(const std::string & url, const std::shared_ptr<const Response> & response)
+	{
+		size_t response_bytes = response->content.size();
+		std::unique_lock<std::mutex> lck(mtx);
+		if(response_bytes > max_bytes || pending_bytes + response_bytes > DISK_PENDING_MAX)
+		{
+			return;
+		}
+		pending.push_back(std::make_pair(url, response));
+		pending_bytes += response_bytes;
+		lck.unlock();
+		not_empty.notify_one();
+	}
+
+	// look up the url and map its response
+	// the file is opened, its header read and its response mapped on the calling thread, event loops included,
+	// which stays off the disk as long as the file is in the page cache
+	// hits tells how many times the response has been hit on disk, including this one
+	// return false if url doesn't exist on disk
+	bool tryGet(const std::string & url, std::shared_ptr<const Response> & response, unsigned & hits)
+	{
+		unsigned long long id = 0;
+		{
+			std::unique_lock<std::mutex> lck(mtx);
+			std::unordered_map<std::string, Entry>::iterator it = index.find(url);
+			if(it == index.end())
+			{
+				return false;
+			}
+			lru.splice(lru.end(), lru, it->second.pos);
+			id = it->second.id;
+			hits = ++it->second.hits;
+		}
+
+		// the file may be evicted meanwhile, the url is then a miss
+		int fd = ::open(pathOf(id, ".obj").c_str(), O_RDONLY | O_CLOEXEC);
+		if(fd == -1)
+		{
+			return false;
+		}
+		FileHeader head;
+		std::string file_url;
+		size_t file_bytes = 0;
+		std::string header;
+		ResponseBuffer content;
+		bool valid = readHead(fd, head, file_url, file_bytes) && file_url == url;
+		if(valid)
+		{
+			header.resize(head.header_length);
+			off_t offset = sizeof(head) + head.url_length;
+			valid = (head.header_length == 0 || pread(fd, &header[0], head.header_length, offset) == (ssize_t)head.header_length)
+				&& content.map(fd, offset + head.header_length, head.content_length);
+		}
+		close(fd);
+		if(!valid)
+		{
+			remove(url);
+			return false;
+		}
+
+		std::shared_ptr<Response> res = std::make_shared<Response>(url, std::move(content), header);
+		res->cur_time = head.cur_time;
+		parser.parseResponse(*res);
+		response = res;
+		return true;
+	}
+
+	// writes of the url still waiting for the writer are dropped, and the one being written is dropped once done,
+	// so that no older copy shows up after the remove
+	void remove(const std::string & url)
+	{
+		std::vector<unsigned long long> unlinked;
+		{
+			std::unique_lock<std::mutex> lck(mtx);
+			for(std::deque<std::pair<std::string, std::shared_ptr<const Response>>>::iterator job = pending.begin(); job != pending.end(); )
+			{
+				if(job->first == url)
+				{
+					pending_bytes -= job->second->content.size();
+					job = pending.erase(job);
+				}
+				else
+				{
+					++job;
+				}
+			}
+			if(writing == url)
+			{
+				writing_removed = true;
+			}
+			std::unordered_map<std::string, Entry>::iterator it = index.find(url);
+			if(it != index.end())
+			{
+				erase(it, unlinked);
+			}
+		}
+		unlinkAll(unlinked);
+	}
+
+	// number of responses on disk
+	size_t size()
+	{
+		std::unique_lock<std::mutex> lck(mtx);
+		return index.size();
+	}
+
+	// bytes of all files on disk
+	size_t bytesUsed()
+	{
+		std::unique_lock<std::mutex> lck(mtx);
+		return bytes;
+	}
+};
+
+#endif
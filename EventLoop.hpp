@@ -0,0 +1,137 @@
+#ifndef EVENT_LOOP_HPP__
+#define EVENT_LOOP_HPP__
+
+#include "ProxyException.hpp"
+#include <mutex>
+#include <cerrno>
+#include <vector>
+#include <cstdint>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+// thin wrapper of epoll, every event-driven worker thread owns exactly one loop
+// fds are registered with their own fd number as the user data
+// other threads hand fds to the loop with post(), which wakes it up through an eventfd
+class EventLoop
+{
+private:
+	int epoll_fd;
+	int wake_fd;
+	std::vector<struct epoll_event> events; // ready list filled by wait()
+	std::mutex mtx; // protects posted
+	std::vector<int> posted;
+
+	void control(int op, int fd, uint32_t flags)
+	{
+		struct epoll_event ev;
+		ev.events = flags;
+		ev.data.u64 = 0;
+		ev.data.fd = fd;
+		if(epoll_ctl(epoll_fd, op, fd, &ev) == -1)
+		{
+			throw ProxyException("Event loop epoll_ctl error");
+		}
+	}
+
+public:
+	explicit EventLoop(int max_events = 1024) :
+		epoll_fd { epoll_create1(EPOLL_CLOEXEC) },
+		wake_fd { eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC) },
+		events(max_events)
+	{
+		if(epoll_fd == -1 || wake_fd == -1)
+		{
+			throw ProxyException("Event loop create error");
+		}
+		add(wake_fd, EPOLLIN);
+	}
+
+	EventLoop(const EventLoop &) = delete;
+	EventLoop & operator=(const EventLoop &) = delete;
+
+	~EventLoop() noexcept
+	{
+		close(wake_fd);
+		close(epoll_fd);
+	}
+
+	void add(int fd, uint32_t flags)
+	{
+		control(EPOLL_CTL_ADD, fd, flags);
+	}
+
+	void modify(int fd, uint32_t flags)
+	{
+		control(EPOLL_CTL_MOD, fd, flags);
+	}
+
+	// closing an fd removes it from epoll as well, so failure here is not an error
+	void remove(int fd)
+	{
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+	}
+
+	// block until at least one fd is ready or timeout (in ms, -1 for infinite)
+	// return the number of ready events, interrupted waits count as 0
+	int wait(int timeout)
+	{
+		int n = epoll_wait(epoll_fd, &events.data()[0], events.size(), timeout);
+		if(n == -1)
+		{
+			if(errno == EINTR)
+			{
+				return 0;
+			}
+			throw ProxyException("Event loop epoll_wait error");
+		}
+		return n;
+	}
+
+	const struct epoll_event & event(int idx) const
+	{
+		return events[idx];
+	}
+
+	// ask the loop to look at fd again, callable from any thread
+	void post(int fd)
+	{
+		{
+			std::unique_lock<std::mutex> lck(mtx);
+			posted.push_back(fd);
+		}
+		uint64_t one = 1;
+		ssize_t res = write(wake_fd, &one, sizeof(one));
+		(void)res; // a full counter already wakes the loop
+	}
+
+	// events on this fd mean there are posted fds
+	int wakeFd() const
+	{
+		return wake_fd;
+	}
+
+	// the fds posted since the last call, called by the loop thread
+	std::vector<int> takePosted()
+	{
+		uint64_t cnt;
+		ssize_t res = read(wake_fd, &cnt, sizeof(cnt));
+		(void)res;
+		std::vector<int> res_fds;
+		std::unique_lock<std::mutex> lck(mtx);
+		res_fds.swap(posted);
+		return res_fds;
+	}
+
+	static void setNonBlocking(int fd)
+	{
+		int flags = fcntl(fd, F_GETFL, 0);
+		if(flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+		{
+			throw ProxyException("Set non-blocking fd error");
+		}
+	}
+};
+
+#endif
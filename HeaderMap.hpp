@@ -0,0 +1,277 @@
+#ifndef HEADER_MAP_HPP__
+#define HEADER_MAP_HPP__
+
+#include "HttpParser.hpp"
+#include <string>
+#include <vector>
+#include <cstddef>
+
+// names of the well-known header fields, indexed by HeaderMap::Field, lowercase
+// a class template, so that the table can be defined in this header and shared by every translation unit
+template <typename Unused = void>
+struct HeaderNames
+{
+	static constexpr const char * names[] = {
+		"cache-control",
+		"etag",
+		"last-modified",
+		"expires",
+		"date",
+		"age",
+		"pragma",
+		"vary",
+		"content-length",
+		"content-type",
+		"content-encoding",
+		"content-range",
+		"transfer-encoding",
+		"connection",
+		"keep-alive",
+		"server",
+		"set-cookie",
+		"location",
+		"accept-ranges",
+		"trailer",
+		"via",
+		"warning"
+	};
+};
+
+template <typename Unused>
+constexpr const char * HeaderNames<Unused>::names[];
+
+// fields of a response header, stored as spans into the header they were parsed from, so nothing is copied
+// a well-known field goes to its own slot, found through a perfect hash of its name generated at compile time,
+// the rest go to a small side vector
+// names are matched ignoring case, only the first occurrence of a well-known field takes its slot
+class HeaderMap
+{
+public:
+	enum Field
+	{
+		CACHE_CONTROL,
+		ETAG,
+		LAST_MODIFIED,
+		EXPIRES,
+		DATE,
+		AGE,
+		PRAGMA,
+		VARY,
+		CONTENT_LENGTH,
+		CONTENT_TYPE,
+		CONTENT_ENCODING,
+		CONTENT_RANGE,
+		TRANSFER_ENCODING,
+		CONNECTION,
+		KEEP_ALIVE,
+		SERVER,
+		SET_COOKIE,
+		LOCATION,
+		ACCEPT_RANGES,
+		TRAILER,
+		VIA,
+		WARNING,
+		KNOWN_FIELDS,
+		UNKNOWN = -1
+	};
+
+	struct Entry
+	{
+		Span name;
+		Span value;
+	};
+
+private:
+	static constexpr size_t TABLE_SIZE = 64;
+	static constexpr size_t NO_VALUE = (size_t)-1; // offset of an empty slot
+
+	Span slots[KNOWN_FIELDS]; // value of every well-known field
+	std::vector<Entry> others; // fields with other names, and repeats of well-known ones
+
+	// the hash of a name is its length plus its first byte twice plus its last byte, with letters folded to lowercase,
+	// no two well-known names collide (checked in lookup()), any other name is told apart by comparing it
+	static constexpr size_t hash(size_t length, char first, char last)
+	{
+		return (length + 2 * (size_t)(unsigned char)(first | 0x20) + (size_t)(unsigned char)(last | 0x20)) % TABLE_SIZE;
+	}
+
+	static constexpr size_t length(const char * s, size_t n = 0)
+	{
+		return s[n] == '\0' ? n : length(s, n + 1);
+	}
+
+	static constexpr size_t hashOf(int field)
+	{
+		return hash(length(HeaderNames<>::names[field]), HeaderNames<>::names[field][0],
+			HeaderNames<>::names[field][length(HeaderNames<>::names[field]) - 1]);
+	}
+
+	static constexpr bool collidesAfter(int field, int other)
+	{
+		return other < KNOWN_FIELDS && (hashOf(field) == hashOf(other) || collidesAfter(field, other + 1));
+	}
+
+	static constexpr bool perfect(int field = 0)
+	{
+		return field == KNOWN_FIELDS || (!collidesAfter(field, field + 1) && perfect(field + 1));
+	}
+
+	// the field whose name hashes to h, UNKNOWN if none
+	static constexpr int slotFor(size_t h, int field = 0)
+	{
+		return field == KNOWN_FIELDS ? UNKNOWN : hashOf(field) == h ? field : slotFor(h, field + 1);
+	}
+
+	template <size_t... H>
+	struct Hashes {};
+
+	template <size_t N, size_t... H>
+	struct MakeHashes : MakeHashes<N - 1, N - 1, H...> {};
+
+	template <size_t... H>
+	struct MakeHashes<0, H...>
+	{
+		typedef Hashes<H...> type;
+	};
+
+	// hash value to field, every entry is a constant, so the table is filled in at compile time
+	template <size_t... H>
+	static const signed char * table(Hashes<H...>)
+	{
+		static const signed char res[TABLE_SIZE] = { (signed char)slotFor(H)... };
+		return res;
+	}
+
+	static char lower(char c)
+	{
+		return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+	}
+
+public:
+	HeaderMap()
+	{
+		clear();
+	}
+
+	// the well-known field called name, UNKNOWN for any other name
+	static Field lookup(const char * name, size_t name_length)
+	{
+		static_assert(sizeof(HeaderNames<>::names) / sizeof(const char *) == KNOWN_FIELDS, "one name per well-known field");
+		static_assert(perfect(), "well-known header names collide, change the hash");
+		if(name_length == 0)
+		{
+			return UNKNOWN;
+		}
+		int field = table(MakeHashes<TABLE_SIZE>::type())[hash(name_length, name[0], name[name_length - 1])];
+		if(field == UNKNOWN)
+		{
+			return UNKNOWN;
+		}
+		const char * known = HeaderNames<>::names[field];
+		size_t i = 0;
+		for(; i < name_length && lower(name[i]) == known[i]; ++i);
+		return i == name_length && known[i] == '\0' ? (Field)field : UNKNOWN;
+	}
+
+	static const char * name(Field field)
+	{
+		return HeaderNames<>::names[field];
+	}
+
+	void clear()
+	{
+		for(Span & slot : slots)
+		{
+			slot = Span { NO_VALUE, 0 };
+		}
+		others.clear();
+	}
+
+	// add a field of the header at base
+	void add(const char * base, const Span & name, const Span & value)
+	{
+		Field field = lookup(name.data(base), name.length);
+		if(field != UNKNOWN && slots[field].offset == NO_VALUE)
+		{
+			slots[field] = value;
+		}
+		else
+		{
+			others.push_back(Entry { name, value });
+		}
+	}
+
+	bool has(Field field) const
+	{
+		return slots[field].offset != NO_VALUE;
+	}
+
+	// the value of a field, empty if it is missing
+	Span get(Field field) const
+	{
+		return has(field) ? slots[field] : Span { 0, 0 };
+	}
+
+	std::string str(const std::string & header, Field field) const
+	{
+		return has(field) ? slots[field].str(header.data()) : std::string();
+	}
+
+	// whether the field, or any repeat of it, lists token (lowercase), see HttpParser::listHas()
+	bool listHas(const char * base, Field field, const char * token) const
+	{
+		if(!has(field))
+		{
+			return false;
+		}
+		if(HttpParser::listHas(slots[field].data(base), slots[field].length, token))
+		{
+			return true;
+		}
+		for(const Entry & entry : others)
+		{
+			if(lookup(entry.name.data(base), entry.name.length) == field && HttpParser::listHas(entry.value.data(base), entry.value.length, token))
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// the value of the last occurrence of a field, empty if it is missing
+	Span last(const char * base, Field field) const
+	{
+		for(std::vector<Entry>::const_reverse_iterator it = others.rbegin(); it != others.rend(); ++it)
+		{
+			if(lookup(it->name.data(base), it->name.length) == field)
+			{
+				return it->value;
+			}
+		}
+		return get(field);
+	}
+
+	// fields with other names, in the order of the header
+	const std::vector<Entry> & unknown() const
+	{
+		return others;
+	}
+
+	size_t size() const
+	{
+		size_t res = others.size();
+		for(const Span & slot : slots)
+		{
+			res += slot.offset != NO_VALUE;
+		}
+		return res;
+	}
+
+	// heap memory held besides the map itself
+	size_t footprint() const
+	{
+		return others.capacity() * sizeof(Entry);
+	}
+};
+
+#endif
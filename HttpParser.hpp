@@ -0,0 +1,434 @@
+#ifndef HTTP_PARSER_HPP__
+#define HTTP_PARSER_HPP__
+
+#include "ByteScan.hpp"
+#include <cctype>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <sys/types.h>
+#define HTTP_MAX_HEADERS 64 // header fields kept without allocating, the fields after them go to a vector
+#define HTTP_MAX_HEADER_BYTES 65536 // a header longer than this is rejected
+
+// part of the receive buffer, kept as an offset so that it stays valid when the buffer grows
+struct Span
+{
+	size_t offset;
+	size_t length;
+
+	const char * data(const char * base) const
+	{
+		return base + offset;
+	}
+
+	std::string str(const char * base) const
+	{
+		return std::string(base + offset, length);
+	}
+};
+
+// incremental parser of the header of an HTTP request or response
+// the caller appends received bytes to its buffer and passes the whole buffer to parse() after every receive,
+// complete lines are parsed once, only the unfinished last line is looked at again when more bytes arrive
+// nothing is copied: the first line and every header field are spans into the buffer,
+// nothing is allocated either unless a message has more than HTTP_MAX_HEADERS fields
+// once parse() returns DONE, headerLength() is where the body starts, contentLength() and chunked() tell how it ends
+class HttpParser
+{
+public:
+	enum Kind
+	{
+		REQUEST,
+		RESPONSE
+	};
+
+	enum Result
+	{
+		INCOMPLETE, // the header needs more bytes
+		DONE, // the header is complete
+		ERROR // malformed or too large, more bytes won't help
+	};
+
+	struct Field
+	{
+		Span name;
+		Span value; // leading and trailing whitespace excluded
+	};
+
+private:
+	Kind kind;
+	Result result;
+	size_t line_start; // beginning of the first line not parsed yet
+	size_t scanned; // bytes from line_start known to hold no '\n'
+	bool first_line_done;
+	Span first_line; // without the line ending
+	Span parts[3]; // method, target, version of a request; version, status, reason of a response
+	int status_code;
+	Field fields[HTTP_MAX_HEADERS];
+	std::vector<Field> more_fields; // fields after the first HTTP_MAX_HEADERS
+	size_t field_count;
+	size_t header_length;
+	long content_length;
+	bool is_chunked;
+
+	static bool isSpace(char c)
+	{
+		return c == ' ' || c == '\t';
+	}
+
+	static char lower(char c)
+	{
+		return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+	}
+
+	Field & fieldAt(size_t idx)
+	{
+		return idx < HTTP_MAX_HEADERS ? fields[idx] : more_fields[idx - HTTP_MAX_HEADERS];
+	}
+
+	// compare with a lowercase literal, ignoring case
+	static bool equalsNoCase(const char * data, size_t length, const char * literal)
+	{
+		size_t literal_length = strlen(literal);
+		if(length != literal_length)
+		{
+			return false;
+		}
+		for(size_t i = 0; i < length; ++i)
+		{
+			if(lower(data[i]) != literal[i])
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	Result fail()
+	{
+		result = ERROR;
+		return result;
+	}
+
+	// request: METHOD SP TARGET SP VERSION
+	// response: VERSION SP STATUS [SP REASON], the reason may contain spaces or be missing
+	bool parseFirstLine(const char * buf, size_t start, size_t end)
+	{
+		first_line.offset = start;
+		first_line.length = end - start;
+		size_t pos = start;
+		for(int i = 0; i < 3; ++i)
+		{
+			size_t part_end = pos;
+			while(part_end < end && (buf[part_end] != ' ' || i == 2))
+			{
+				++part_end;
+			}
+			parts[i].offset = pos;
+			parts[i].length = part_end - pos;
+			pos = part_end < end ? part_end + 1 : end;
+		}
+
+		const Span & version = kind == REQUEST ? parts[2] : parts[0];
+		if(version.length < 8 || strncmp(version.data(buf), "HTTP/", 5) != 0 || parts[0].length == 0 || parts[1].length == 0)
+		{
+			return false;
+		}
+		if(kind == REQUEST)
+		{
+			return true;
+		}
+
+		// status code is three digits
+		const char * status = parts[1].data(buf);
+		if(parts[1].length != 3 || !isdigit(status[0]) || !isdigit(status[1]) || !isdigit(status[2]))
+		{
+			return false;
+		}
+		status_code = (status[0] - '0') * 100 + (status[1] - '0') * 10 + (status[2] - '0');
+		return true;
+	}
+
+	// NAME ":" OWS VALUE OWS, no whitespace is allowed between the name and the colon
+	bool parseField(const char * buf, size_t start, size_t end)
+	{
+		const char * colon = ByteScan::find(buf + start, buf + end, ':');
+		if(colon == buf + end || colon == buf + start || isSpace(colon[-1]))
+		{
+			return false;
+		}
+		size_t value_start = colon - buf + 1;
+		while(value_start < end && isSpace(buf[value_start]))
+		{
+			++value_start;
+		}
+		size_t value_end = end;
+		while(value_end > value_start && isSpace(buf[value_end - 1]))
+		{
+			--value_end;
+		}
+
+		if(field_count >= HTTP_MAX_HEADERS)
+		{
+			more_fields.push_back(Field());
+		}
+		Field & field = fieldAt(field_count++);
+		field.name.offset = start;
+		field.name.length = colon - buf - start;
+		field.value.offset = value_start;
+		field.value.length = value_end - value_start;
+		return interpret(buf, field);
+	}
+
+	// pick up the fields which decide where the body ends
+	bool interpret(const char * buf, const Field & field)
+	{
+		const char * name = field.name.data(buf);
+		const char * value = field.value.data(buf);
+		if(equalsNoCase(name, field.name.length, "content-length"))
+		{
+			if(field.value.length == 0 || field.value.length > 18)
+			{
+				return false;
+			}
+			long length = 0;
+			for(size_t i = 0; i < field.value.length; ++i)
+			{
+				if(!isdigit(value[i]))
+				{
+					return false;
+				}
+				length = length * 10 + (value[i] - '0');
+			}
+
+			// repeated lengths have to agree
+			if(content_length != -1 && content_length != length)
+			{
+				return false;
+			}
+			content_length = length;
+		}
+		else if(equalsNoCase(name, field.name.length, "transfer-encoding"))
+		{
+			// chunked is the last coding applied
+			is_chunked = lastIs(value, field.value.length, "chunked");
+		}
+		return true;
+	}
+
+public:
+	explicit HttpParser(Kind _kind) :
+		kind { _kind }
+	{
+		reset();
+	}
+
+	// forget the message parsed, the next message starts at the beginning of the buffer passed to parse()
+	void reset()
+	{
+		result = INCOMPLETE;
+		line_start = 0;
+		scanned = 0;
+		first_line_done = false;
+		first_line = Span { 0, 0 };
+		for(Span & part : parts)
+		{
+			part = Span { 0, 0 };
+		}
+		status_code = 0;
+		field_count = 0;
+		more_fields.clear();
+		header_length = 0;
+		content_length = -1;
+		is_chunked = false;
+	}
+
+	// continue parsing buf, which holds the bytes of the previous call and maybe more after them
+	Result parse(const char * buf, size_t len)
+	{
+		while(result == INCOMPLETE)
+		{
+			const char * newline = ByteScan::find(buf + line_start + scanned, buf + len, '\n');
+			if(newline == buf + len)
+			{
+				scanned = len - line_start;
+				return len > HTTP_MAX_HEADER_BYTES ? fail() : INCOMPLETE;
+			}
+			size_t next = newline - buf + 1;
+			size_t end = next - 1; // "\r\n" and a bare "\n" both end a line
+			if(end > line_start && buf[end - 1] == '\r')
+			{
+				--end;
+			}
+
+			if(!first_line_done)
+			{
+				// empty lines before a request line are ignored
+				if(end > line_start)
+				{
+					if(!parseFirstLine(buf, line_start, end))
+					{
+						return fail();
+					}
+					first_line_done = true;
+				}
+			}
+			else if(end == line_start)
+			{
+				header_length = next;
+				result = DONE;
+			}
+			else if(isSpace(buf[line_start]))
+			{
+				// obsolete line folding continues the value of the previous field
+				if(field_count == 0)
+				{
+					return fail();
+				}
+				Field & field = fieldAt(field_count - 1);
+				while(end > line_start && isSpace(buf[end - 1]))
+				{
+					--end;
+				}
+				field.value.length = end - field.value.offset;
+			}
+			else if(!parseField(buf, line_start, end))
+			{
+				return fail();
+			}
+			line_start = next;
+			scanned = 0;
+			if(next > HTTP_MAX_HEADER_BYTES)
+			{
+				return fail();
+			}
+		}
+		return result;
+	}
+
+	Result state() const
+	{
+		return result;
+	}
+
+	// the first line, method, target and version of a request
+	const Span & firstLine() const
+	{
+		return first_line;
+	}
+
+	const Span & method() const
+	{
+		return parts[0];
+	}
+
+	const Span & target() const
+	{
+		return parts[1];
+	}
+
+	const Span & version() const
+	{
+		return kind == REQUEST ? parts[2] : parts[0];
+	}
+
+	// status code and reason of a response
+	int status() const
+	{
+		return status_code;
+	}
+
+	const Span & reason() const
+	{
+		return parts[2];
+	}
+
+	size_t fieldCount() const
+	{
+		return field_count;
+	}
+
+	// whether the comma-separated list value holds token (lowercase), ignoring case, whitespace and a parameter after '='
+	// eg: Connection: keep-alive, close holds close, Cache-Control: private="Set-Cookie" holds private
+	static bool listHas(const char * value, size_t length, const char * token)
+	{
+		const char * end = value + length;
+		while(value < end)
+		{
+			const char * item_end = ByteScan::find(value, end, ',');
+			const char * name_end = ByteScan::find(value, item_end, '=');
+			for(; value < name_end && isSpace(*value); ++value);
+			for(; name_end > value && isSpace(name_end[-1]); --name_end);
+			if(equalsNoCase(value, name_end - value, token))
+			{
+				return true;
+			}
+			value = item_end + (item_end < end);
+		}
+		return false;
+	}
+
+	// whether the last item of the comma-separated list value is token (lowercase), ignoring case and whitespace
+	// eg: Transfer-Encoding: gzip, chunked
+	static bool lastIs(const char * value, size_t length, const char * token)
+	{
+		const char * end = value + length;
+		const char * item = end;
+		for(; item > value && item[-1] != ','; --item);
+		for(; item < end && isSpace(*item); ++item);
+		for(; end > item && isSpace(end[-1]); --end);
+		return equalsNoCase(item, end - item, token);
+	}
+
+	// whether any field called name (lowercase) lists token
+	bool listHas(const char * buf, const char * name, const char * token) const
+	{
+		for(size_t i = 0; i < field_count; ++i)
+		{
+			const Field & f = field(i);
+			if(equalsNoCase(f.name.data(buf), f.name.length, name) && listHas(f.value.data(buf), f.value.length, token))
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+
+	const Field & field(size_t idx) const
+	{
+		return idx < HTTP_MAX_HEADERS ? fields[idx] : more_fields[idx - HTTP_MAX_HEADERS];
+	}
+
+	// the first field called name (lowercase), NULL if there is none
+	const Field * find(const char * buf, const char * name) const
+	{
+		for(size_t i = 0; i < field_count; ++i)
+		{
+			const Field & f = field(i);
+			if(equalsNoCase(f.name.data(buf), f.name.length, name))
+			{
+				return &f;
+			}
+		}
+		return NULL;
+	}
+
+	// bytes of the header including the empty line, where the body starts
+	size_t headerLength() const
+	{
+		return header_length;
+	}
+
+	// -1 if the length is unknown, a chunked body ignores Content-Length
+	long contentLength() const
+	{
+		return is_chunked ? -1 : content_length;
+	}
+
+	bool chunked() const
+	{
+		return is_chunked;
+	}
+};
+
+#endif
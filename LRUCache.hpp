@@ -5,78 +5,251 @@
 #include "Response.hpp"
 #include <list>
 #include <mutex>
+#include <cstdint>
+#include <algorithm>
+#include <memory>
 #include <string>
+#include <vector>
+#include <functional>
 #include <unordered_map>
 
-std::mutex mtx1; // first level mutex
-std::mutex mtx2; // second level mutex
-
-class LRUCache 
+// the cache is split into a power-of-two number of shards keyed by url hash
+// every shard has its own lock and LRU order, so requests for different urls rarely contend
+// with a single shard, it behaves as one globally locked LRU cache
+// every map entry keeps its position in the LRU list, so get, put and evict are O(1) with one hash lookup
+// a shard evicts once it holds too many entries or too many bytes, responses larger than max_object are not cached
+// cached responses are immutable and shared, a hit hands out a reference without copying,
+// and a response evicted while still being sent stays alive until its last reader drops it
+// evicted responses can be handed to a lower tier through the evict callback, which runs outside the shard lock
+class LRUCache
 {
+public:
+	typedef std::function<void(const std::string &, const std::shared_ptr<const Response> &)> EvictCallback;
+
 private:
-    int sz;
-    int capacity;
-    std::list<std::string> cache; // for LRU order
-    std::unordered_map<std::string, Response> kv; // key for url, value for response
-    
+	typedef std::list<const std::string *> LRUList; // points at the keys of kv, front is the least recently used
+
+	struct Entry
+	{
+		std::shared_ptr<const Response> response;
+		LRUList::iterator pos; // position in the LRU list
+		size_t bytes; // footprint of the response and its key
+	};
+
+	struct Shard
+	{
+		std::mutex mtx;
+		int sz;
+		int capacity;
+		size_t bytes; // bytes held by all entries
+		size_t max_bytes;
+		LRUList cache; // for LRU order
+		std::unordered_map<std::string, Entry> kv; // key for url, value for response
+
+		Shard(int _capacity, size_t _max_bytes) :
+			sz { 0 },
+			capacity { _capacity },
+			bytes { 0 },
+			max_bytes { _max_bytes }
+		{
+			kv.reserve(capacity);
+		}
+
+		// move the entry to the most recently used end
+		void touch(Entry & entry)
+		{
+			cache.splice(cache.end(), cache, entry.pos);
+		}
+
+		void erase(std::unordered_map<std::string, Entry>::iterator it)
+		{
+			bytes -= it->second.bytes;
+			cache.erase(it->second.pos);
+			kv.erase(it);
+			--sz;
+		}
+
+		// evict least recently used entries until one more entry of the given size fits
+		// evicted entries are collected if a lower tier wants them
+		void evictFor(size_t entry_bytes, std::vector<std::pair<std::string, std::shared_ptr<const Response>>> * evicted)
+		{
+			while(!cache.empty() && (sz >= capacity || bytes + entry_bytes > max_bytes))
+			{
+				std::unordered_map<std::string, Entry>::iterator it = kv.find(*cache.front());
+				if(evicted != NULL)
+				{
+					evicted->push_back(std::make_pair(it->first, it->second.response));
+				}
+				erase(it);
+			}
+		}
+	};
+
+	std::vector<std::unique_ptr<Shard>> shards;
+	size_t mask; // number of shards - 1
+	size_t max_object; // largest response footprint that is cached
+	EvictCallback on_evict;
+
+	Shard & shardOf(const std::string & url)
+	{
+		return *shards[std::hash<std::string>()(url) & mask];
+	}
+
 public:
-    LRUCache(int _capacity) :
-        sz { 0 },
-        capacity { _capacity }
-        {}
-
-    bool existsUrl(const std::string & url)
-    {
-        std::unique_lock<std::mutex> lck(mtx2);
-        return kv.find(url) != kv.end();
-    }
-
-    void remove(const std::string & url)
-    {
-        std::unique_lock<std::mutex> lck(mtx1);
-        kv.erase(url);
-        cache.remove(url);
-    }
-
-    Response get(const std::string & url) 
-    {
-        std::unique_lock<std::mutex> lck(mtx1);
-
-        // url doesn't exist in cache
-        if(!existsUrl(url))
-        {
-            throw ProxyException("Url doesn't exist in cache");
-        }
-
-        Response ret = kv[url];
-        cache.remove(url);
-        cache.push_back(url);
-        return ret;
-    }
-    
-    void put(const std::string & url, const Response & response) 
-    {
-        std::unique_lock<std::mutex> lck(mtx1);
-        if(existsUrl(url))
-        {
-            cache.remove(url);
-            kv[url] = response;
-        }
-        else
-        {
-            if(sz == capacity)
-            {
-                const std::string & url = cache.front(); cache.pop_front();
-                kv.erase(url);
-            }
-            else
-            {
-                ++sz;
-            }
-            kv.insert(std::make_pair(url, response));
-        }
-        cache.push_back(url);
-    }
+	// capacity is the total number of entries and max_bytes the total byte budget, both divided evenly among shards
+	// the first capacity % shards shards hold one entry more, so the shard capacities add up to capacity
+	// num_shards is rounded up to a power of two
+	LRUCache(int capacity, int num_shards = 1, size_t max_bytes = SIZE_MAX, size_t _max_object = SIZE_MAX) :
+		max_object { _max_object }
+	{
+		size_t N = 1;
+		while(N < (size_t)num_shards)
+		{
+			N <<= 1;
+		}
+		size_t shard_bytes = max_bytes == SIZE_MAX ? SIZE_MAX : max_bytes / N;
+		for(size_t i = 0; i < N; ++i)
+		{
+			int shard_capacity = capacity / (int)N + ((int)i < capacity % (int)N ? 1 : 0);
+			shards.push_back(std::unique_ptr<Shard>(new Shard(shard_capacity, shard_bytes)));
+		}
+		mask = N - 1;
+
+		// a response larger than a whole shard can never be cached
+		max_object = std::min(max_object, shard_bytes);
+	}
+
+	// called with every evicted response, must be set before the cache is shared among threads
+	void setEvictCallback(EvictCallback callback)
+	{
+		on_evict = callback;
+	}
+
+	size_t numShards() const
+	{
+		return shards.size();
+	}
+
+	bool existsUrl(const std::string & url)
+	{
+		Shard & shard = shardOf(url);
+		std::unique_lock<std::mutex> lck(shard.mtx);
+		return shard.kv.find(url) != shard.kv.end();
+	}
+
+	void remove(const std::string & url)
+	{
+		Shard & shard = shardOf(url);
+		std::unique_lock<std::mutex> lck(shard.mtx);
+		std::unordered_map<std::string, Entry>::iterator it = shard.kv.find(url);
+		if(it != shard.kv.end())
+		{
+			shard.erase(it);
+		}
+	}
+
+	std::shared_ptr<const Response> get(const std::string & url)
+	{
+		std::shared_ptr<const Response> ret;
+		if(!tryGet(url, ret))
+		{
+			// url doesn't exist in cache
+			throw ProxyException("Url doesn't exist in cache");
+		}
+		return ret;
+	}
+
+	// look up and touch the url with a single hash lookup
+	// return false if url doesn't exist in cache
+	bool tryGet(const std::string & url, std::shared_ptr<const Response> & response)
+	{
+		Shard & shard = shardOf(url);
+		std::unique_lock<std::mutex> lck(shard.mtx);
+		std::unordered_map<std::string, Entry>::iterator it = shard.kv.find(url);
+		if(it == shard.kv.end())
+		{
+			return false;
+		}
+		shard.touch(it->second);
+		response = it->second.response;
+		return true;
+	}
+
+	// return false if the response is too large to be cached, or its shard holds no entry at all (fewer entries than shards)
+	bool put(const std::string & url, const std::shared_ptr<const Response> & response)
+	{
+		size_t entry_bytes = response->footprint() + sizeof(Entry) + url.capacity() + sizeof(LRUList::value_type) + 2 * sizeof(void *);
+		std::vector<std::pair<std::string, std::shared_ptr<const Response>>> evicted;
+		Shard & shard = shardOf(url);
+		std::unique_lock<std::mutex> lck(shard.mtx);
+
+		// an older version of the url is replaced, or dropped if the new one is too large
+		std::unordered_map<std::string, Entry>::iterator it = shard.kv.find(url);
+		if(it != shard.kv.end())
+		{
+			shard.erase(it);
+		}
+		if(entry_bytes > max_object || shard.capacity == 0)
+		{
+			return false;
+		}
+
+		// evict the least recently used entries
+		shard.evictFor(entry_bytes, on_evict ? &evicted : NULL);
+		it = shard.kv.insert(std::make_pair(url, Entry())).first;
+		it->second.response = response;
+		it->second.pos = shard.cache.insert(shard.cache.end(), &it->first);
+		it->second.bytes = entry_bytes;
+		shard.bytes += entry_bytes;
+		++shard.sz;
+		lck.unlock();
+
+		for(const auto & p : evicted)
+		{
+			on_evict(p.first, p.second);
+		}
+		return true;
+	}
+
+	// every cached response, least recently used first within each shard
+	// responses are shared, so the snapshot stays valid while the cache moves on
+	std::vector<std::pair<std::string, std::shared_ptr<const Response>>> entries()
+	{
+		std::vector<std::pair<std::string, std::shared_ptr<const Response>>> res;
+		for(const auto & shard : shards)
+		{
+			std::unique_lock<std::mutex> lck(shard->mtx);
+			for(const std::string * url : shard->cache)
+			{
+				res.push_back(std::make_pair(*url, shard->kv.find(*url)->second.response));
+			}
+		}
+		return res;
+	}
+
+	// number of cached responses
+	size_t size()
+	{
+		size_t res = 0;
+		for(const auto & shard : shards)
+		{
+			std::unique_lock<std::mutex> lck(shard->mtx);
+			res += shard->sz;
+		}
+		return res;
+	}
+
+	// bytes held by all cached responses
+	size_t bytes()
+	{
+		size_t res = 0;
+		for(const auto & shard : shards)
+		{
+			std::unique_lock<std::mutex> lck(shard->mtx);
+			res += shard->bytes;
+		}
+		return res;
+	}
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -2,38 +2,274 @@
 #define LOGGER_HPP__
 
 #include <mutex>
+#include <memory>
 #include <string>
-#include <fstream>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+#include <condition_variable>
+#include <fcntl.h>
+#include <unistd.h>
+#define LOG_BATCH_BYTES (64 << 10) // the writer thread writes once this much is pending
+#define LOG_FLUSH_INTERVAL 100 // milliseconds a line may wait for the writer thread at most
 
+// asynchronous logger
+// every thread logging has its own ring buffer of lines, log() copies the line into the ring of the calling thread
+// without a lock or a syscall, a background thread drains all rings and writes their lines in batches
+// a ring full because the disk is slow either drops the line (counted and reported in the log) or makes log() wait
+// lines of one thread keep their order, lines of different threads are ordered by when they are drained
 class Logger
 {
 private:
-	std::mutex mtx;
+	// single producer (the logging thread), single consumer (the writer thread) ring of bytes
+	// head and tail only grow, the position in data is taken modulo the capacity, which is a power of two
+	struct Ring
+	{
+		std::unique_ptr<char[]> data;
+		size_t capacity;
+		std::atomic<size_t> head; // end of the lines logged, moved by the producer
+		std::atomic<size_t> tail; // end of the lines drained, moved by the consumer
+		std::atomic<unsigned long long> dropped;
+
+		explicit Ring(size_t _capacity) :
+			data { new char[_capacity] },
+			capacity { _capacity },
+			head { 0 },
+			tail { 0 },
+			dropped { 0 }
+			{}
+
+		// append the line and a '\n', false if there is no room
+		bool push(const char * line, size_t len)
+		{
+			size_t h = head.load(std::memory_order_relaxed);
+			if(capacity - (h - tail.load(std::memory_order_acquire)) < len + 1)
+			{
+				return false;
+			}
+			size_t pos = h & (capacity - 1);
+			size_t first = std::min(len, capacity - pos);
+			memcpy(&data[pos], line, first);
+			memcpy(&data[0], line + first, len - first);
+			data[(h + len) & (capacity - 1)] = '\n';
+			head.store(h + len + 1, std::memory_order_release);
+			return true;
+		}
+
+		size_t pending() const
+		{
+			return head.load(std::memory_order_acquire) - tail.load(std::memory_order_relaxed);
+		}
+
+		// move every complete line to out
+		void drain(std::vector<char> & out)
+		{
+			size_t h = head.load(std::memory_order_acquire);
+			size_t t = tail.load(std::memory_order_relaxed);
+			size_t pos = t & (capacity - 1);
+			size_t first = std::min(h - t, capacity - pos);
+			out.insert(out.end(), &data[pos], &data[pos] + first);
+			out.insert(out.end(), &data[0], &data[0] + (h - t - first));
+			tail.store(h, std::memory_order_release);
+		}
+	};
+
 	std::string path;
-	std::ofstream out;
+	int fd;
+	size_t ring_size; // bytes of each ring
+	bool block; // wait for room in a full ring, otherwise drop the line
+
+	std::mutex rings_mtx; // guards rings, taken when a thread logs for the first time and by the writer thread
+	std::vector<std::shared_ptr<Ring>> rings; // rings of threads which have exited stay, they are small
+
+	std::mutex write_mtx; // one drain at a time, the writer thread or flush()
+	std::vector<char> batch;
+	unsigned long long reported_drops;
+
+	std::mutex wake_mtx;
+	std::condition_variable wake;
+	bool stopping;
+	std::thread writer;
+
+	static size_t roundUp(size_t n)
+	{
+		size_t res = 4096;
+		while(res < n)
+		{
+			res <<= 1;
+		}
+		return res;
+	}
+
+	// the ring of the calling thread, created on its first line
+	Ring & local()
+	{
+		static thread_local const Logger * owner = NULL;
+		static thread_local Ring * ring = NULL;
+		if(owner != this)
+		{
+			std::shared_ptr<Ring> created = std::make_shared<Ring>(ring_size);
+			{
+				std::unique_lock<std::mutex> lck(rings_mtx);
+				rings.push_back(created);
+			}
+			owner = this;
+			ring = created.get();
+		}
+		return *ring;
+	}
+
+	// drain every ring and write what they held, reporting lines dropped since the last time
+	void drainAll()
+	{
+		std::unique_lock<std::mutex> lck(write_mtx);
+		unsigned long long drops = 0;
+		{
+			std::unique_lock<std::mutex> rings_lck(rings_mtx);
+			for(const std::shared_ptr<Ring> & ring : rings)
+			{
+				ring->drain(batch);
+				drops += ring->dropped.load(std::memory_order_relaxed);
+			}
+		}
+		if(drops != reported_drops)
+		{
+			std::string line = "log: " + std::to_string(drops - reported_drops) + " lines dropped, the log buffers were full\n";
+			batch.insert(batch.end(), line.begin(), line.end());
+			reported_drops = drops;
+		}
+		size_t written = 0;
+		while(written < batch.size())
+		{
+			ssize_t len = write(fd, batch.data() + written, batch.size() - written);
+			if(len == -1)
+			{
+				if(errno == EINTR)
+				{
+					continue;
+				}
+				break; // nothing better to do with a log that cannot be written
+			}
+			written += len;
+		}
+		batch.clear();
+	}
+
+	bool pendingBatch()
+	{
+		std::unique_lock<std::mutex> lck(rings_mtx);
+		size_t res = 0;
+		for(const std::shared_ptr<Ring> & ring : rings)
+		{
+			res += ring->pending();
+		}
+		return res >= LOG_BATCH_BYTES;
+	}
+
+	// write every LOG_FLUSH_INTERVAL, or earlier once a ring is half full
+	void writerLoop()
+	{
+		while(true)
+		{
+			{
+				std::unique_lock<std::mutex> lck(wake_mtx);
+				if(!stopping)
+				{
+					wake.wait_for(lck, std::chrono::milliseconds(LOG_FLUSH_INTERVAL));
+				}
+				if(stopping)
+				{
+					break;
+				}
+			}
+			do
+			{
+				drainAll();
+			} while(pendingBatch());
+		}
+		drainAll();
+	}
 
 public:
-	Logger(std::string _path) : 
-		path { _path }
+	// ring_bytes is rounded up to a power of two
+	Logger(std::string _path, size_t ring_bytes, bool _block) :
+		path { _path },
+		ring_size { roundUp(ring_bytes) },
+		block { _block },
+		reported_drops { 0 },
+		stopping { false }
 	{
-		out.open(path, std::ofstream::out | std::ofstream::app);
-		out.close();
+		fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+		if(fd == -1)
+		{
+			std::cerr << "cannot open " << path << ": " << strerror(errno) << std::endl;
+		}
+		batch.reserve(LOG_BATCH_BYTES);
+		writer = std::thread(&Logger::writerLoop, this);
+	}
+
+	Logger(const Logger &) = delete;
+	Logger & operator=(const Logger &) = delete;
+
+	// lines logged before are written
+	~Logger()
+	{
+		{
+			std::unique_lock<std::mutex> lck(wake_mtx);
+			stopping = true;
+		}
+		wake.notify_one();
+		writer.join();
+		if(fd != -1)
+		{
+			close(fd);
+		}
 	}
 
 	void log(const std::string & content)
 	{
-		// protect against data race
-		std::unique_lock<std::mutex> lck(mtx);
+		Ring & ring = local();
+		size_t len = std::min(content.size(), ring.capacity - 1); // a line longer than the ring is cut
+		while(!ring.push(content.data(), len))
+		{
+			if(!block)
+			{
+				ring.dropped.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+			wake.notify_one();
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
 
-		// open the file in append mode if closed
-		if(!out.is_open())
+		// a ring half full is drained before the interval is over
+		if(ring.pending() > ring.capacity / 2)
 		{
-			out.open(path, std::ofstream::out | std::ofstream::app);
+			wake.notify_one();
 		}
+	}
+
+	// write every line logged so far, used before the process exits
+	void flush()
+	{
+		drainAll();
+	}
 
-		out << content << std::endl;
-		out.close();
+	// lines dropped so far because a ring was full
+	unsigned long long dropped()
+	{
+		std::unique_lock<std::mutex> lck(rings_mtx);
+		unsigned long long res = 0;
+		for(const std::shared_ptr<Ring> & ring : rings)
+		{
+			res += ring->dropped.load(std::memory_order_relaxed);
+		}
+		return res;
 	}
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,288 @@
+#ifndef METRICS_HPP__
+#define METRICS_HPP__
+
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#define HISTOGRAM_SUB_BUCKETS 4 // linear buckets per power of two
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB_BUCKETS * 36) // up to 2^36 microseconds, longer durations go to the last bucket
+#define HISTOGRAM_MIN_EXPORTED 8 // microseconds, buckets below are only exported through the cumulative count
+#define HISTOGRAM_MAX_EXPORTED (1ULL << 26) // microseconds (about 67 s), longer durations are only counted in +Inf
+
+// counters and latency histograms of the proxy
+// every thread records into a shard of its own, without a lock and without atomic read-modify-write instructions,
+// render() merges the shards and formats them in the Prometheus text format
+// histograms are log-linear: every power of two of microseconds is split into HISTOGRAM_SUB_BUCKETS equal buckets,
+// so the relative error of a quantile stays below 1 / HISTOGRAM_SUB_BUCKETS at any scale
+class Metrics
+{
+public:
+	enum Counter
+	{
+		REQUESTS_GET,
+		REQUESTS_POST,
+		REQUESTS_CONNECT,
+		REQUEST_ERRORS,
+		CACHE_MISS, // outcomes of looking up a GET in the cache
+		CACHE_FRESH,
+		CACHE_REVALIDATE,
+		CACHE_EXPIRED,
+		REVALIDATED_NOT_MODIFIED, // outcomes of a re-validation with the server
+		REVALIDATED_MODIFIED,
+		UPSTREAM_NEW, // server connections opened
+		UPSTREAM_POOLED, // server connections taken from the upstream pool
+		BYTES_CACHE, // response bytes sent to clients from cache
+		BYTES_ORIGIN, // response bytes relayed from servers, coalesced requests included
+		COUNTERS
+	};
+
+	enum Timer
+	{
+		CONNECT, // resolving the server name and connecting to the server
+		FIRST_BYTE, // from a connected server until the first byte of its response, sending the request included
+		REQUEST, // from a complete request until its response is sent, tunnels excluded
+		TIMERS
+	};
+
+	// buckets of one histogram, and the count and sum of every duration recorded
+	struct Distribution
+	{
+		uint64_t buckets[HISTOGRAM_BUCKETS];
+		uint64_t count;
+		uint64_t sum_us;
+	};
+
+private:
+	// only its thread writes to a shard, so a relaxed load and store make an increment, readers see it whole
+	struct Shard
+	{
+		std::atomic<uint64_t> counters[COUNTERS];
+		std::atomic<uint64_t> buckets[TIMERS][HISTOGRAM_BUCKETS];
+		std::atomic<uint64_t> sums_us[TIMERS];
+
+		Shard()
+		{
+			for(std::atomic<uint64_t> & counter : counters)
+			{
+				counter.store(0, std::memory_order_relaxed);
+			}
+			for(int t = 0; t < TIMERS; ++t)
+			{
+				for(std::atomic<uint64_t> & bucket : buckets[t])
+				{
+					bucket.store(0, std::memory_order_relaxed);
+				}
+				sums_us[t].store(0, std::memory_order_relaxed);
+			}
+		}
+
+		static void add(std::atomic<uint64_t> & value, uint64_t n)
+		{
+			value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+		}
+	};
+
+	std::mutex shards_mtx; // guards shards, taken when a thread records for the first time and by render()
+	std::vector<std::shared_ptr<Shard>> shards; // shards of threads which have exited stay, their counts still count
+
+	// the shard of the calling thread, created on its first record
+	Shard & local()
+	{
+		static thread_local const Metrics * owner = NULL;
+		static thread_local Shard * shard = NULL;
+		if(owner != this)
+		{
+			std::shared_ptr<Shard> created = std::make_shared<Shard>();
+			{
+				std::unique_lock<std::mutex> lck(shards_mtx);
+				shards.push_back(created);
+			}
+			owner = this;
+			shard = created.get();
+		}
+		return *shard;
+	}
+
+	static void appendCounter(std::string & out, const char * name, const char * labels, uint64_t value)
+	{
+		out += name;
+		out += labels;
+		out += " " + std::to_string(value) + "\n";
+	}
+
+	static void appendHistogram(std::string & out, const char * name, const char * help, const Distribution & dist)
+	{
+		out += std::string("# HELP ") + name + " " + help + "\n";
+		out += std::string("# TYPE ") + name + " histogram\n";
+		uint64_t cumulative = 0;
+		char le[32];
+		for(size_t idx = 0; idx < HISTOGRAM_BUCKETS; ++idx)
+		{
+			cumulative += dist.buckets[idx];
+			uint64_t upper = upperBound(idx);
+			if(upper > HISTOGRAM_MAX_EXPORTED)
+			{
+				break;
+			}
+			if(upper < HISTOGRAM_MIN_EXPORTED)
+			{
+				continue;
+			}
+			snprintf(le, sizeof(le), "%g", upper / 1e6);
+			out += std::string(name) + "_bucket{le=\"" + le + "\"} " + std::to_string(cumulative) + "\n";
+		}
+		out += std::string(name) + "_bucket{le=\"+Inf\"} " + std::to_string(dist.count) + "\n";
+		snprintf(le, sizeof(le), "%.6f", dist.sum_us / 1e6);
+		out += std::string(name) + "_sum " + le + "\n";
+		out += std::string(name) + "_count " + std::to_string(dist.count) + "\n";
+	}
+
+public:
+	Metrics() = default;
+	Metrics(const Metrics &) = delete;
+	Metrics & operator=(const Metrics &) = delete;
+
+	// bucket of a duration in microseconds
+	// below 2 * HISTOGRAM_SUB_BUCKETS every microsecond has a bucket, above the bucket width doubles every
+	// HISTOGRAM_SUB_BUCKETS buckets
+	static size_t bucketOf(uint64_t us)
+	{
+		if(us < HISTOGRAM_SUB_BUCKETS)
+		{
+			return us;
+		}
+		int exp = 63 - __builtin_clzll(us); // us is in [2^exp, 2^(exp+1))
+		int shift = exp - 2; // log2 of HISTOGRAM_SUB_BUCKETS
+		size_t idx = (exp - 1) * HISTOGRAM_SUB_BUCKETS + ((us >> shift) & (HISTOGRAM_SUB_BUCKETS - 1));
+		return idx < HISTOGRAM_BUCKETS ? idx : HISTOGRAM_BUCKETS - 1;
+	}
+
+	// the smallest duration beyond the bucket, in microseconds
+	static uint64_t upperBound(size_t idx)
+	{
+		if(idx < HISTOGRAM_SUB_BUCKETS)
+		{
+			return idx + 1;
+		}
+		int exp = idx / HISTOGRAM_SUB_BUCKETS + 1;
+		uint64_t sub = idx % HISTOGRAM_SUB_BUCKETS;
+		return (HISTOGRAM_SUB_BUCKETS + sub + 1) << (exp - 2);
+	}
+
+	void add(Counter counter, uint64_t n = 1)
+	{
+		Shard::add(local().counters[counter], n);
+	}
+
+	void record(Timer timer, std::chrono::steady_clock::duration elapsed)
+	{
+		int64_t us = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+		us = us < 0 ? 0 : us;
+		Shard & shard = local();
+		Shard::add(shard.buckets[timer][bucketOf(us)], 1);
+		Shard::add(shard.sums_us[timer], us);
+	}
+
+	// record the time since begin
+	void recordSince(Timer timer, std::chrono::steady_clock::time_point begin)
+	{
+		record(timer, std::chrono::steady_clock::now() - begin);
+	}
+
+	// sum of a counter over every thread
+	uint64_t count(Counter counter)
+	{
+		std::unique_lock<std::mutex> lck(shards_mtx);
+		uint64_t res = 0;
+		for(const std::shared_ptr<Shard> & shard : shards)
+		{
+			res += shard->counters[counter].load(std::memory_order_relaxed);
+		}
+		return res;
+	}
+
+	// merged histogram of every thread
+	Distribution distribution(Timer timer)
+	{
+		Distribution res = Distribution();
+		std::unique_lock<std::mutex> lck(shards_mtx);
+		for(const std::shared_ptr<Shard> & shard : shards)
+		{
+			for(size_t idx = 0; idx < HISTOGRAM_BUCKETS; ++idx)
+			{
+				uint64_t n = shard->buckets[timer][idx].load(std::memory_order_relaxed);
+				res.buckets[idx] += n;
+				res.count += n;
+			}
+			res.sum_us += shard->sums_us[timer].load(std::memory_order_relaxed);
+		}
+		return res;
+	}
+
+	// every counter and histogram in the Prometheus text format
+	std::string render()
+	{
+		uint64_t values[COUNTERS];
+		for(int c = 0; c < COUNTERS; ++c)
+		{
+			values[c] = count((Counter)c);
+		}
+
+		std::string out;
+		out += "# HELP proxy_requests_total Requests received from clients.\n";
+		out += "# TYPE proxy_requests_total counter\n";
+		appendCounter(out, "proxy_requests_total", "{method=\"GET\"}", values[REQUESTS_GET]);
+		appendCounter(out, "proxy_requests_total", "{method=\"POST\"}", values[REQUESTS_POST]);
+		appendCounter(out, "proxy_requests_total", "{method=\"CONNECT\"}", values[REQUESTS_CONNECT]);
+
+		out += "# HELP proxy_request_errors_total Requests which ended with an error.\n";
+		out += "# TYPE proxy_request_errors_total counter\n";
+		appendCounter(out, "proxy_request_errors_total", "", values[REQUEST_ERRORS]);
+
+		out += "# HELP proxy_cache_lookups_total Outcomes of looking up GET requests in the cache.\n";
+		out += "# TYPE proxy_cache_lookups_total counter\n";
+		appendCounter(out, "proxy_cache_lookups_total", "{outcome=\"miss\"}", values[CACHE_MISS]);
+		appendCounter(out, "proxy_cache_lookups_total", "{outcome=\"fresh\"}", values[CACHE_FRESH]);
+		appendCounter(out, "proxy_cache_lookups_total", "{outcome=\"revalidate\"}", values[CACHE_REVALIDATE]);
+		appendCounter(out, "proxy_cache_lookups_total", "{outcome=\"expired\"}", values[CACHE_EXPIRED]);
+
+		out += "# HELP proxy_revalidations_total Outcomes of re-validating cached responses with the server.\n";
+		out += "# TYPE proxy_revalidations_total counter\n";
+		appendCounter(out, "proxy_revalidations_total", "{result=\"not_modified\"}", values[REVALIDATED_NOT_MODIFIED]);
+		appendCounter(out, "proxy_revalidations_total", "{result=\"modified\"}", values[REVALIDATED_MODIFIED]);
+
+		// fresh hits and re-validations answered with 304 are served from cache
+		uint64_t lookups = values[CACHE_MISS] + values[CACHE_FRESH] + values[CACHE_REVALIDATE] + values[CACHE_EXPIRED];
+		uint64_t hits = values[CACHE_FRESH] + values[REVALIDATED_NOT_MODIFIED];
+		char ratio[32];
+		snprintf(ratio, sizeof(ratio), "%.6f", lookups == 0 ? 0.0 : (double)hits / lookups);
+		out += "# HELP proxy_cache_hit_ratio Share of cache lookups served from cache, fresh or re-validated.\n";
+		out += "# TYPE proxy_cache_hit_ratio gauge\n";
+		out += std::string("proxy_cache_hit_ratio ") + ratio + "\n";
+
+		out += "# HELP proxy_upstream_connections_total Server connections used, opened or taken from the upstream pool.\n";
+		out += "# TYPE proxy_upstream_connections_total counter\n";
+		appendCounter(out, "proxy_upstream_connections_total", "{kind=\"new\"}", values[UPSTREAM_NEW]);
+		appendCounter(out, "proxy_upstream_connections_total", "{kind=\"pooled\"}", values[UPSTREAM_POOLED]);
+
+		out += "# HELP proxy_served_bytes_total Response bytes sent to clients.\n";
+		out += "# TYPE proxy_served_bytes_total counter\n";
+		appendCounter(out, "proxy_served_bytes_total", "{source=\"cache\"}", values[BYTES_CACHE]);
+		appendCounter(out, "proxy_served_bytes_total", "{source=\"origin\"}", values[BYTES_ORIGIN]);
+
+		appendHistogram(out, "proxy_connect_seconds", "Time to resolve and connect to a server, pooled connections excluded.",
+			distribution(CONNECT));
+		appendHistogram(out, "proxy_first_byte_seconds", "Time from a connected server until the first byte of its response, sending the request included.",
+			distribution(FIRST_BYTE));
+		appendHistogram(out, "proxy_request_seconds", "Time from a complete request until its response is sent, tunnels excluded.",
+			distribution(REQUEST));
+		return out;
+	}
+};
+
+#endif
@@ -3,10 +3,13 @@
 
 #include "Request.hpp"
 #include "Response.hpp"
+#include "HttpParser.hpp"
+#include "ByteScan.hpp"
 #include <ctime>
 #include <string>
 #include <vector>
 #include <cctype>
+#include <cstring>
 #include <cstdlib>
 #include <iostream>
 #include <algorithm>
@@ -25,7 +28,7 @@ private:
 	}
 
 	// tell the difference between http and https: http request starts with http://
-	// http reuqest has no trailing port number, while https has trailing port 443
+	// http request uses port 80 unless the url names one, while https has trailing port 443
 	void extractAddrPort(std::string & url, std::string & hostname, std::string & port)
 	{
 		// eg: http://people.duke.edu/~bmr23/ece568/
@@ -50,18 +53,26 @@ private:
 				}
 			}
 			hostname = url.substr(7, idx - 7);
+
+			// eg: http://localhost:8080/ names its port
+			size_t colon = hostname.find_last_of(':');
+			if(colon != std::string::npos && hostname.find(']', colon) == std::string::npos)
+			{
+				port = hostname.substr(colon + 1);
+				hostname = hostname.substr(0, colon);
+			}
 		}
 
 		// eg: github.com:443
 		// url: github.com
 		// hostname: github.com
-		// port: 443
+		// port: 443, which is also the default
 		else
 		{
-			int idx = url.find_last_of(':');
+			size_t idx = url.find_last_of(':');
+			port = idx == std::string::npos ? "443" : url.substr(idx + 1);
 			hostname = url.substr(0, idx);
 			url = url.substr(0, idx);
-			port = "443";
 		}
 	}
 
@@ -69,25 +80,13 @@ private:
 	void extractFirstLine(Response & response)
 	{
 		// first line
-		const std::string header = response.header;
-		for(char c : header)
-		{
-			if(c == '\r')
-			{
-				break;
-			}
-			else
-			{
-				response.first_line += c;
-			}
-		}
+		response.first_line = extractFirstLine(response.header);
 
-		// status code
+		// status code, the reason after it may be missing
 		// eg: first line: HTTP/1.1 200 OK
 		const std::string & first_line = response.first_line;
-		int idx1 = first_line.find_first_of(' ');
-		int idx2 = first_line.find_last_of(' ');
-		response.status_code = std::stoi(first_line.substr(idx1, idx2 - idx1)); // [idx1, idx2)
+		size_t idx = first_line.find(' ');
+		response.status_code = idx == std::string::npos ? -1 : atoi(first_line.c_str() + idx + 1);
 	}
 
 	// helper function for extractKV()
@@ -112,72 +111,59 @@ private:
 	void extractKV(Response & response)
 	{
 		// extract k-v pair header
+		// the first line status and kv-pair is seperated by \r\n, header and content is seperated by \r\n\r\n
 		const std::string & header = response.header;
-		std::unordered_map<std::string, std::string> & kv = response.kv; 
-		unsigned idx1 = header.find_first_of("\r\n"); // the first line status and kv-pair is seperated by \r\n
-		unsigned idx2 = header.find_first_of("\r\n\r\n"); // header and content is seperated by \r\n\r\n
-		std::string kv_header = header.substr(idx1 + 2, idx2 - idx1 - 2); // extract the real header in k-v pair
+		HeaderMap & kv = response.kv;
+		const char * begin = header.data();
+		const char * end = ByteScan::findSequence(begin, begin + header.size(), "\r\n\r\n");
+		const char * line = ByteScan::findSequence(begin, end, "\r\n");
+		kv.clear();
 
-		// extract k-v pair to the unordered_map
-		int N = kv_header.length();
-		std::string key;
-		std::string val;
-		std::string temp;
-		for(int idx = 0; idx < N; ++idx)
+		// extract k-v pair to the map, one line at a time, a line without colon is skipped
+		// eg: Cache-Control: no-cache, no-store
+		while(line < end)
 		{
-			char c = kv_header[idx];
-
-			// \r\n the seperator of lines
-			if(c == '\r' && idx + 1 <= N - 1 && kv_header[idx + 1] == '\n')
+			line += 2;
+			const char * line_end = ByteScan::findSequence(line, end, "\r\n");
+			const char * sep = ByteScan::find(line, line_end, ':');
+			if(sep != line_end)
 			{
-				pushClear(temp, val);
-				kv.insert(std::make_pair(key, val));
-				key.clear();
-				val.clear();
-				++idx;
-			}
-
-			// : the seperator of key-value pair
-			else if(c == ':' && idx + 1 <= N - 1 && kv_header[idx + 1] == ' ')
-			{
-				pushClear(temp, key);
-				++idx;
-			}
-
-			// normal characters
-			else
-			{
-				temp += c;
+				const char * val = sep + 1;
+				const char * val_end = line_end;
+				for(; val < val_end && (*val == ' ' || *val == '\t'); ++val);
+				for(; val_end > val && (val_end[-1] == ' ' || val_end[-1] == '\t'); --val_end);
+				kv.add(begin, Span { (size_t)(line - begin), (size_t)(sep - line) }, Span { (size_t)(val - begin), (size_t)(val_end - val) });
 			}
+			line = line_end;
 		}
-		pushClear(temp, val);
-		kv.insert(std::make_pair(key, val));
 	}
 
 	// extract key attributes from the response k-v pair
 	// including no-store, no-cache, max-age, e-tag
 	void extractAttri(Response & response)
 	{
-		std::unordered_map<std::string, std::string> & kv = response.kv; 
+		const HeaderMap & kv = response.kv;
 
 		// no-store and no-cache attribute
-		if(kv.find("Cache-Control") != kv.end())
+		if(kv.has(HeaderMap::CACHE_CONTROL))
 		{
-			std::string cache_control = kv["Cache-Control"];
-			if(cache_control.find("no-store") != -1)
+			Span cache_control = kv.get(HeaderMap::CACHE_CONTROL);
+			const char * begin = cache_control.data(response.header.data());
+			const char * end = begin + cache_control.length;
+			if(ByteScan::findSequence(begin, end, "no-store") != end)
 			{
 				response.no_store = true;
 			}
-			if(cache_control.find("no-cache") != -1)
+			if(ByteScan::findSequence(begin, end, "no-cache") != end)
 			{
 				response.no_cache = true;
 			}
 		}
 
 		// e-tag
-		if(kv.find("ETag") != kv.end())
+		if(kv.has(HeaderMap::ETAG))
 		{
-			response.etag = kv["ETag"];
+			response.etag = kv.str(response.header, HeaderMap::ETAG);
 		}
 	}
 
@@ -185,20 +171,21 @@ private:
 	// expirationTime = responseTime + freshnessLifetime - currentAge
 	void calcExpiration(Response & response)
 	{
-		std::unordered_map<std::string, std::string> & kv = response.kv;
+		const HeaderMap & kv = response.kv;
 		const time_t & response_time = response.cur_time;
 
 		// get fressness time
 		int fressness_time = 0;
-		if(kv.find("Cache-Control") != kv.end())
+		if(kv.has(HeaderMap::CACHE_CONTROL))
 		{
-			const std::string & cache_control = kv["Cache-Control"];
-			int idx = cache_control.find("max-age");
-			if(idx != -1)
+			Span cache_control = kv.get(HeaderMap::CACHE_CONTROL);
+			const char * begin = cache_control.data(response.header.data());
+			const char * end = begin + cache_control.length;
+			const char * max_age = ByteScan::findSequence(begin, end, "max-age");
+			if(max_age + 8 <= end)
 			{
-				// eg: max-age=1234567
-				std::string max_age_s = cache_control.substr(idx + 8);
-				fressness_time = std::stoi(max_age_s);
+				// eg: max-age=1234567, the header goes on after the value, so the digits end before it does
+				fressness_time = atoi(max_age + 8);
 			}
 		}
 
@@ -208,10 +195,11 @@ private:
 	// extract last modified time
 	void extractLastModified(Response & response)
 	{
-		std::unordered_map<std::string, std::string> & kv = response.kv;
-		if(kv.find("Last-Modified") != kv.end())
+		const HeaderMap & kv = response.kv;
+		if(kv.has(HeaderMap::LAST_MODIFIED))
 		{
-			const char * time = kv["Last-Modified"].c_str();
+			// strptime() stops at the end of the format, so the line end after the value is left alone
+			const char * time = kv.get(HeaderMap::LAST_MODIFIED).data(response.header.data());
 			struct tm tm;
 			memset(&tm, 0, sizeof(struct tm));
 			strptime(time, "%a, %d %b %Y %H:%M:%S %z", &tm);
@@ -263,6 +251,26 @@ public:
 		}
 	}
 
+	// fill the request from its header parsed by head, the spans of head point into request.content
+	// same result as parseRequest() above, without walking the request character by character,
+	// and the header fields are read as well
+	void parseRequest(Request & request, const HttpParser & head)
+	{
+		const char * base = request.content.data();
+		request.first_line = head.firstLine().str(base);
+		request.httpAction = head.method().str(base);
+		request.url = head.target().str(base);
+		extractAddrPort(request.url, request.hostname, request.port);
+
+		// HTTP/1.1 keeps alive by default, HTTP/1.0 only if asked to, close on either field ends it
+		const Span & version = head.version();
+		bool http11 = version.length == 8 && strncmp(version.data(base), "HTTP/1.1", 8) == 0;
+		bool close = head.listHas(base, "connection", "close") || head.listHas(base, "proxy-connection", "close");
+		bool keep = head.listHas(base, "connection", "keep-alive") || head.listHas(base, "proxy-connection", "keep-alive");
+		request.keep_alive = !close && (http11 || keep);
+		request.credentials = head.find(base, "cookie") != NULL || head.find(base, "authorization") != NULL;
+	}
+
 	// parse all k-v pair in the response
 	// response header format eg:
 	// HTTP/1.1 200 OK
@@ -285,27 +293,14 @@ public:
 	// extract content length from response from server
 	int extractContentLength(const std::string & header)
 	{
-		// start extract content length
+		// start extract content length, 0 if there is none
+		const char * end = header.data() + header.size();
+		const char * p = ByteScan::findSequence(header.data(), end, "Content-Length");
+		for(; p < end && !isdigit(*p); ++p);
 		int res = 0;
-		int idx = header.find("Content-Length");
-		int N = header.length();
-		bool digit_found = false;
-		for(int i = idx; i < N; ++i)
+		for(; p < end && isdigit(*p); ++p)
 		{
-			char c = header[i];
-			if(digit_found && isdigit(c))
-			{
-				res = res * 10 + (c - '0');
-			}
-			else if(digit_found && !isdigit(c))
-			{
-				break;
-			}
-			else if(!digit_found && isdigit(c))
-			{
-				digit_found = true;
-				res = c - '0';
-			}
+			res = res * 10 + (*p - '0');
 		}
 		return res;
 	}
@@ -314,22 +309,21 @@ public:
 	// true for valid etag, false for invalid etag
 	bool checkEtagValidiklity(const std::vector<char> & buffer, Response & response)
 	{
-		const std::string etag1 = response.etag;
+		const std::string & etag1 = response.etag;
 		if(etag1.empty()) return false;
-		const std::string header = std::string(buffer.begin(), buffer.end());
-		int idx1 = header.find("ETag");
-		if(idx1 == -1) return false;
-		int idx2 = header.find(": ", idx1);
-		int idx3 = header.find("\r\n", idx2);
-		const std::string etag2(header.begin() + idx2 + 2, header.begin() + idx3);
-		return etag1 == etag2;
+		const char * end = buffer.data() + buffer.size();
+		const char * idx1 = ByteScan::findSequence(buffer.data(), end, "ETag");
+		const char * idx2 = ByteScan::findSequence(idx1, end, ": ");
+		if(idx2 == end) return false;
+		const char * idx3 = ByteScan::findSequence(idx2 + 2, end, "\r\n");
+		return etag1.compare(0, std::string::npos, idx2 + 2, idx3 - idx2 - 2) == 0;
 	}
 
 	// get first line from header, used in return 304 status code
 	std::string extractFirstLine(const std::string & header)
 	{
-		int idx = header.find_first_of('\r');
-		return header.substr(0, idx);
+		const char * begin = header.data();
+		return std::string(begin, ByteScan::find(begin, begin + header.size(), '\r'));
 	}
 };
 
@@ -4,7 +4,33 @@
 #include "Request.hpp"
 #include "Response.hpp"
 #include "LRUCache.hpp"
+#include "DiskCache.hpp"
+#include "Snapshot.hpp"
+#include "Coalescer.hpp"
+#include "UpstreamPool.hpp"
+#include "Resolver.hpp"
+#include "Config.hpp"
+#include "EventLoop.hpp"
+#include "Connection.hpp"
+#include "ThreadPool.hpp"
+#include "SegmentSender.hpp"
+#include "SplicePipe.hpp"
+#include "HttpParser.hpp"
+#include "ByteScan.hpp"
+#include "ChunkedDecoder.hpp"
+#include "CoarseClock.hpp"
+#include "Metrics.hpp"
+#include "RequestTiming.hpp"
+#include <ctime>
+#include <atomic>
+#include <cerrno>
+#include <cctype>
+#include <memory>
 #include <thread>
+#include <poll.h>
+#include <sched.h>
+#include <csignal>
+#include <pthread.h>
 #include <string>
 #include <vector>
 #include <climits>
@@ -20,8 +46,13 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #define BACKLOG 100
-#define CACHE_SIZE 500
 #define BUFFER_SIZE 65536
+#define ZEROCOPY_TIMEOUT 1000 // ms to wait for MSG_ZEROCOPY completions before releasing a response
+#define POOL_STATS_INTERVAL 10 // seconds between two pool statistics lines in log
+#define HIGH_WATER_MARK (4 * BUFFER_SIZE) // stop reading from one side while this many bytes wait for the other
+#define TUNNEL_PIPE_SIZE HIGH_WATER_MARK // room asked for in the splice pipe of every tunnel direction
+#define TUNNEL_SEND_TIMEOUT 30000 // ms a tunnel waits for one side to take any byte before giving up
+#define STATS_PATH "/__proxy/stats" // GET of this path is answered by the proxy with its metrics
 
 class Proxy
 {
@@ -29,14 +60,22 @@ private:
 	Parser parser; // has-a relationship
 	Logger logger; // has-a relationship
 	LRUCache cache; // has-a relationship
+	DiskCache disk; // second tier, holds responses evicted from cache
+	Config config; // has-a relationship
+	Snapshot snapshot; // warm-start copy of cache, unused without a snapshot path
+	Coalescer coalescer; // fetches in progress, shared by concurrent requests for the same url
+	UpstreamPool upstream; // idle keep-alive connections to servers
+	Resolver resolver; // cached server name lookups
+	Metrics metrics; // counters and latency histograms, served at STATS_PATH
 	const char * listen_port = "5555"; // listern port
 	int status; // global status to mark success or not
-	int socket_fd;
+	std::vector<int> listen_fds; // listening sockets, more than one shares the port with SO_REUSEPORT
+	std::atomic<int> next_client_id; // id of the next client, shared by all acceptors
 
-	// construct a proxy, listen on port 5555
+	// construct a listening socket of the proxy, listen on port 5555
 	// called in the constructor, exception cannot happen here
 	// if an error happens, release all allocated resource and exit the process
-	void constructServer()
+	int constructServer()
     {
         // initialize host information
         struct addrinfo host_info;
@@ -55,7 +94,7 @@ private:
         }
 
         // create a socket file descriptor
-        socket_fd = socket(host_info_list->ai_family,
+        int socket_fd = socket(host_info_list->ai_family,
                         host_info_list->ai_socktype,
                         host_info_list->ai_protocol);
         if(socket_fd == -1) 
@@ -76,6 +115,19 @@ private:
             exit(EXIT_FAILURE);
         }
 
+        // several listeners on the same port, the kernel balances new connections among them
+        if(config.listeners > 1)
+        {
+	        status = setsockopt(socket_fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int));
+	        if(status == -1)
+	        {
+	        	freeaddrinfo(host_info_list);
+	        	close(socket_fd);
+	            std::cerr << "Construct server set SO_REUSEPORT error" << std::endl;
+	            exit(EXIT_FAILURE);
+	        }
+        }
+
         // bind
         status = bind(socket_fd, host_info_list->ai_addr, host_info_list->ai_addrlen);
         if(status == -1) 
@@ -96,67 +148,154 @@ private:
             exit(EXIT_FAILURE);
         }
 
+        // event loops share listening sockets, which must not block
+        if(config.mode == Config::EVENT)
+        {
+        	try
+        	{
+        		EventLoop::setNonBlocking(socket_fd);
+        	}
+        	catch(ProxyException & e)
+        	{
+	        	freeaddrinfo(host_info_list);
+	        	close(socket_fd);
+	            std::cerr << "Construct server " << e.what() << std::endl;
+	            exit(EXIT_FAILURE);
+        	}
+        }
+
         // free allocated host_info_list
         freeaddrinfo(host_info_list);
+        return socket_fd;
     }
 
     // blocking status, wait until a client request arrives
+    // flags are passed to accept4(), SOCK_NONBLOCK is used by the event loops
     // return client_fd if success, return -1 if error
-    int acceptConnection(std::string & client_ip)
+    int acceptConnection(int socket_fd, std::string & client_ip, int flags = 0)
     {
     	// keep waiting until a client request
         struct sockaddr_storage socket_addr;
         socklen_t socket_addr_len = sizeof(socket_addr);
-        int accept_fd = accept(socket_fd, (struct sockaddr *)&socket_addr, &socket_addr_len); // accept() implements blocking accept
+        int accept_fd = accept4(socket_fd, (struct sockaddr *)&socket_addr, &socket_addr_len, flags); // blocks unless the listening socket is non-blocking
         if(accept_fd == -1) 
         {
             return -1;
         }
 
-        // get the client ip
-        struct sockaddr_in * temp = (struct sockaddr_in *)&socket_addr;
-  		client_ip = inet_ntoa(temp->sin_addr);
+        // get the client ip, inet_ntop() is used since several loops may accept at the same time
+        char ip[INET6_ADDRSTRLEN] = { 0 };
+        if(socket_addr.ss_family == AF_INET6)
+        {
+        	inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&socket_addr)->sin6_addr, ip, sizeof(ip));
+        }
+        else
+        {
+        	inet_ntop(AF_INET, &((struct sockaddr_in *)&socket_addr)->sin_addr, ip, sizeof(ip));
+        }
+  		client_ip = ip;
 
         return accept_fd;
     }
 
-	// accept HTTP request
-	Request acceptRequest(int fd)
+	// accept the next HTTP request of a client, receive until its header and body are complete
+	// bytes after the request (pipelined requests) stay in pending for the next call
+	// return false if the client closes the connection or stays idle for the idle timeout before sending a byte
+	bool acceptRequest(int fd, std::vector<char> & pending, Request & request)
 	{
-		// receive port number of the current player
-		std::vector<char> buffer(BUFFER_SIZE, '\0');
-	    int len = recv(fd, &buffer.data()[0], BUFFER_SIZE, 0);
-	    if(len == -1)
-	    {
-	        throw ProxyException("In acceptRequest(), server receive request error");
-	    }
-	    buffer[len] = '\0';
+		HttpParser head(HttpParser::REQUEST);
+		long request_length = -1;
+		while((request_length = requestLength(head, pending)) == -1)
+		{
+			// wait for the request at most the idle timeout, without keep-alive the only request is waited for as long as it takes
+			if(config.client_idle_timeout > 0)
+			{
+				struct pollfd pfd;
+				pfd.fd = fd;
+				pfd.events = POLLIN;
+				pfd.revents = 0;
+				int res = poll(&pfd, 1, config.client_idle_timeout * 1000);
+				if(res == -1 && errno == EINTR)
+				{
+					continue;
+				}
+				if(res == -1)
+				{
+					throw ProxyException("In acceptRequest(), poll error");
+				}
+				if(res == 0)
+				{
+					if(pending.empty())
+					{
+						return false;
+					}
+					throw ProxyException("In acceptRequest(), request timeout");
+				}
+			}
 
-	    // get current time for request
-	    time_t cur = time(NULL);
-	    tm * tm = localtime(&cur);
-	    char * dt = asctime(tm);
-	    std::string cur_time(dt);
+			size_t old_size = pending.size();
+			pending.resize(old_size + BUFFER_SIZE);
+			int len = recv(fd, &pending.data()[0] + old_size, BUFFER_SIZE, 0);
+			pending.resize(old_size + (len > 0 ? len : 0));
+			if(len == -1)
+			{
+				if(errno == EINTR) continue;
+				throw ProxyException("In acceptRequest(), server receive request error");
+			}
+			if(len == 0)
+			{
+				if(pending.empty())
+				{
+					return false;
+				}
+				throw ProxyException("In acceptRequest(), client closed in the middle of a request");
+			}
+		}
 
 	    // extract HTTP action and url from request
-	    Request request(cur_time, buffer, len);
-	    parser.parseRequest(request);
-	    return request;
+	    request = Request(currentTime(), pending, request_length);
+	    pending.erase(pending.begin(), pending.begin() + request_length);
+	    parser.parseRequest(request, head);
+	    return true;
 	}
 
-	// helper function for checkCaching(), find the index of first '\r\n'
-	int findFirstLine(const std::vector<char> & content)
+	// length of the first request in buffer including its body, -1 if it is not complete yet
+	// head continues where the previous call stopped, so every received byte of the header is parsed once
+	long requestLength(HttpParser & head, const std::vector<char> & buffer)
 	{
-		int i = 0;
-		int N = content.size();
-		for(; i + 1 <= N - 1; ++i)
+		HttpParser::Result res = head.parse(buffer.data(), buffer.size());
+		if(res == HttpParser::ERROR)
 		{
-			if(content[i] == '\r' && content[i + 1] == '\n')
-			{
-				break;
-			}
+			throw ProxyException(buffer.size() > HTTP_MAX_HEADER_BYTES ? "Request header too large" : "Malformed request header");
+		}
+		if(res == HttpParser::INCOMPLETE)
+		{
+			return -1;
+		}
+
+		// request with a body (POST), wait until the body is complete
+		long header_length = head.headerLength();
+		long content_length = std::max(head.contentLength(), 0L);
+		if((long)buffer.size() < header_length + content_length)
+		{
+			return -1;
 		}
-		return i;
+		return header_length + content_length;
+	}
+
+	// get current time for request, in the format of asctime()
+	std::string currentTime()
+	{
+	    return CoarseClock::asctime();
+	}
+
+	// helper function for checkCaching(), find the index of first '\r\n'
+	int findFirstLine(const std::vector<char> & content)
+	{
+		const char * begin = content.data();
+		const char * end = begin + content.size();
+		const char * res = ByteScan::findSequence(begin, end, "\r\n");
+		return res == end ? std::max((int)content.size() - 1, 0) : res - begin;
 	}
 
 	// helper function for checkCaching()
@@ -170,53 +309,34 @@ private:
 		return content_to_send;
 	}
 
-	// helper function for checkCaching(), check whether the return code is legal
-	// status code 304 for legal, 200 for illegal
-	// return value true for legal, false for illegal
-	bool checkStatusCode(const std::string & header)
-	{
-		int idx = header.find("\r\n");
-		int i = 0;
-		for(; i + 2 <= idx; ++i)
-		{
-			if(header[i] == '3' && header[i + 1] == '0' && header[i + 2] == '4')
-			{
-				return true;
-			}
-		}
-		return false;
-	}
-
 	// resend and validate
 	// if receive status code 304, directly return content stored in the cache
 	// if receive status code 200, receive all the bytes sent by the server, send it to the client, and stored in cache
-	void resendCheckStatus(int client_id, int client_fd, int server_fd, const std::vector<char> & content_to_send, const std::string & url)
+	// the server is connected here, server fd and pooled are set, see fetchHeader()
+	// the response is published to flight unless it is NULL
+	// return true if server fd may serve another request, persistent tells whether client fd may
+	bool resendCheckStatus(int client_id,
+						int client_fd,
+						int & server_fd,
+						bool & pooled,
+						const Request & request,
+						const std::vector<char> & content_to_send,
+						const std::shared_ptr<const Response> & cached,
+						Flight * flight,
+						RequestTiming & timing,
+						bool & persistent)
 	{
-		// re-send the inserted message to the server
-		int sent_length = 0;
-		int N = content_to_send.size();
-		while(sent_length < N)
-		{
-			int len = send(server_fd, &content_to_send.data()[0] + sent_length, N - sent_length, 0);
-			if(len == -1)
-			{
-				throw ProxyException("Send with If-None-Match/If-Modified-Since error");
-			}
-			sent_length += len;
-		}
-
-		// receive header from server and decide by the status code
-		std::vector<char> buffer(BUFFER_SIZE, '\0'); // buffer to store header temporarily
-		int len = recv(server_fd, &buffer.data()[0], BUFFER_SIZE, 0);
-		if(len == -1)
-		{
-			throw ProxyException("Receive with If-None-Match/If-Modified-Since error");
-		}
-		buffer[len] = '\0';
+		// re-send the inserted message to the server, receive header from server and decide by the status code
+		const std::string & url = request.url;
+		std::vector<char> buffer(BUFFER_SIZE + 1, '\0'); // buffer to store header temporarily
+		HttpParser head(HttpParser::RESPONSE);
+		int len = fetchHeader(request, content_to_send.data(), content_to_send.size(), server_fd, pooled, buffer, head, timing);
 
 		// check header status
-		const std::string header(buffer.begin(), buffer.begin() + len);
-		bool status_304 = checkStatusCode(header);
+		const std::string header(buffer.begin(), buffer.begin() + head.headerLength());
+		bool status_304 = head.status() == 304;
+
+		metrics.add(status_304 ? Metrics::REVALIDATED_NOT_MODIFIED : Metrics::REVALIDATED_MODIFIED);
 
 		// if get true(status code 304), directly return cached content
 		if(status_304)
@@ -229,17 +349,26 @@ private:
 			logger.log(log_content);
 
 			// respond to the client with client
-			respondCached(client_fd, url);
-			return;
+			if(flight != NULL)
+			{
+				flight->finishCached(cached);
+			}
+			respondCached(client_fd, *cached);
+			persistent = delimited(*cached);
+
+			// a 304 has no body, nothing may follow the header
+			return head.headerLength() == (size_t)len && keepsAlive(header.data(), head);
 		}
 
 		// if get false(status code 200), receive all the sent, and send to the client
-		std::vector<std::vector<char>> segment;
-		segment.push_back(std::vector<char>(buffer.begin(), buffer.begin() + len));
+		ResponseBuffer body;
+		size_t header_length = head.headerLength();
+		keepResponse(body, header_length, &buffer.data()[0], header_length);
 
 		// respond header to client, send every character in the buffer to client
 		// true for send success, false for send error
-		bool respondClient_suc = respondClient(client_fd, buffer, len);
+		flight = leadFlight(flight, &buffer.data()[0], head);
+		bool respondClient_suc = relayResponse(client_fd, flight, &buffer.data()[0], len);
 		if(!respondClient_suc) 
 		{
 			throw ProxyException("Respond header to client error");
@@ -249,7 +378,9 @@ private:
 		try
 		{
 			std::string httpAction = "GET"; // for resend, the http action has to be "GET"
-			getResponse(client_id, client_fd, server_fd, url, header, segment, len, httpAction);	
+			persistent = getResponse(client_id, client_fd, server_fd, url, header, head, body,
+				&buffer.data()[0] + header_length, len - header_length, httpAction, flight, timing);
+			return persistent;
 		}
 		catch(std::exception & e)
 		{
@@ -257,20 +388,68 @@ private:
 		}
 	}
 
-	// when receiving request from client, first check caching
-	// true means caching function handles responding
-	// false means main function handles responding
-	bool checkCaching(int client_id, int client_fd, int server_fd, Request & request)
+	// look up the url in memory, then on disk
+	// a response hit on disk often enough is promoted back into memory, otherwise it is served from its file mapping
+	bool tryGetCached(int client_id, const std::string & url, std::shared_ptr<const Response> & cached)
+	{
+		if(cache.tryGet(url, cached))
+		{
+			return true;
+		}
+		unsigned hits = 0;
+		if(!disk.enabled() || !disk.tryGet(url, cached, hits))
+		{
+			return false;
+		}
+
+		std::string log_content = std::to_string(client_id) + ": NOTE in disk cache";
+		if(config.promote > 0 && hits >= (unsigned)config.promote)
+		{
+			// the copy lives on the heap, independent of the file
+			std::shared_ptr<const Response> copy = std::make_shared<Response>(*cached);
+			if(cache.put(url, copy))
+			{
+				disk.remove(url);
+				cached = copy;
+				log_content += ", promoted to memory";
+			}
+		}
+		logger.log(log_content);
+		return true;
+	}
+
+	// outcome of looking up a request in the cache
+	enum CacheStatus
+	{
+		CACHE_MISS, // url not in cache
+		CACHE_FRESH, // in cache and valid, respond with the cached response
+		CACHE_REVALIDATE, // in cache, needs If-None-Match/If-Modified-Since validation
+		CACHE_EXPIRED // in cache but expired, and cannot be re-validated
+	};
+
+	// outcome of a lookup in the timing line of a request
+	static const char * outcomeName(CacheStatus cache_status)
+	{
+		static const char * names[] = { "miss", "fresh", "revalidate", "expired" };
+		return names[cache_status];
+	}
+
+	// look up the request in the cache and write the decision to log
+	// shared by the threaded and event-driven paths, no I/O with client or server happens here
+	// for CACHE_FRESH and CACHE_REVALIDATE, cached holds the shared cached response
+	// for CACHE_REVALIDATE, content_to_send holds the request with validation section inserted
+	CacheStatus lookupCache(int client_id, const Request & request, std::shared_ptr<const Response> & cached, std::vector<char> & content_to_send)
 	{
 		// (1) url not exist in the cache
 		const std::string url = request.url;
-		if(!cache.existsUrl(url))
+		if(!tryGetCached(client_id, url, cached))
 		{
 			std::string log_content = std::to_string(client_id) + ": not in cache";
 			logger.log(log_content);
-			return false;
+			metrics.add(Metrics::CACHE_MISS);
+			return CACHE_MISS;
 		}
-		Response response = cache.get(url);
+		const Response & response = *cached;
 
 		// (2) check expiration time
 		// note: expiration time = response time + max-age 
@@ -280,8 +459,8 @@ private:
 		{
 			std::string log_content = std::to_string(client_id) + ": in cache, valid";
 			logger.log(log_content);
-			respondCached(client_fd, url);
-			return true;
+			metrics.add(Metrics::CACHE_FRESH);
+			return CACHE_FRESH;
 		}
 
 		// (3) check e-tag
@@ -297,20 +476,9 @@ private:
 			std::string if_none_match = "\r\nIf-None-Match: " + response.etag;
 
 			// insert the section into the request
-			std::vector<char> content_to_send = insertSectionToContent(request.content, if_none_match);
-
-			// resend and check the status code
-			try
-			{
-				resendCheckStatus(client_id, client_fd, server_fd, content_to_send, url);
-			}
-			catch(std::exception & e)
-			{
-				throw e;
-			}
-
-			// has resolved re-validation, updated cache and resending
-			return true;
+			content_to_send = insertSectionToContent(request.content, if_none_match);
+			metrics.add(Metrics::CACHE_REVALIDATE);
+			return CACHE_REVALIDATE;
 		}
 
 		// (4) check last-modified
@@ -322,105 +490,340 @@ private:
 			logger.log(log_content);
 
 			// create If-Modified-Since section
-  			std::string if_modified_since = "\r\nIf-Modified-Since: " + response.kv["Last-Modified"];
+  			std::string if_modified_since = "\r\nIf-Modified-Since: " + response.kv.str(response.header, HeaderMap::LAST_MODIFIED);
 
   			// insert the section into the request
-  			std::vector<char> content_to_send = insertSectionToContent(request.content, if_modified_since);
+  			content_to_send = insertSectionToContent(request.content, if_modified_since);
+			metrics.add(Metrics::CACHE_REVALIDATE);
+			return CACHE_REVALIDATE;
+		}
 
-  			// resend and check the status code
-			try
+		// convert expiration time to string
+		const std::string & expiration = CoarseClock::format(response.expiration_time);
+
+		// write to log
+		std::string log_content = std::to_string(client_id) + ": in cache, but expired at "  + expiration;
+		logger.log(log_content);
+		metrics.add(Metrics::CACHE_EXPIRED);
+
+		return CACHE_EXPIRED;
+	}
+
+	// when receiving request from client, first check caching
+	// true means caching function handles responding
+	// false means main function handles responding, and publishes to the flight of lead if any
+	// the server is only connected for a re-validation, server fd and pooled are set then, see fetchHeader()
+	// reusable tells whether server fd may serve another request afterwards, persistent whether client fd may
+	// persistent is only set if caching handles responding
+	bool checkCaching(int client_id,
+					int client_fd,
+					int & server_fd,
+					bool & pooled,
+					Request & request,
+					FlightGuard & lead,
+					RequestTiming & timing,
+					bool & reusable,
+					bool & persistent)
+	{
+		std::shared_ptr<const Response> cached;
+		std::vector<char> content_to_send;
+		CacheStatus cache_status = lookupCache(client_id, request, cached, content_to_send);
+		timing.lap(RequestTiming::CACHE);
+		timing.outcome = outcomeName(cache_status);
+
+		// directly fetch it from cache
+		if(cache_status == CACHE_FRESH)
+		{
+			respondCached(client_fd, *cached);
+			persistent = delimited(*cached);
+			return true;
+		}
+
+		// concurrent misses and re-validations of the url share one fetch, unless the response may be for this client only
+		if(config.coalesce && !request.credentials)
+		{
+			std::shared_ptr<Flight> flight;
+			Coalescer::Role role = coalescer.join(request.url, client_id, flight);
+			if(role == Coalescer::LEADER)
 			{
-				resendCheckStatus(client_id, client_fd, server_fd, content_to_send, url);
+				lead.lead(flight);
 			}
-			catch(std::exception & e)
+			else if(role == Coalescer::FOLLOWER)
 			{
-				throw e;
+				std::string log_content = std::to_string(client_id) + ": NOTE coalesced with request " + std::to_string(flight->leader_id);
+				logger.log(log_content);
+				if(followFlight(client_fd, *flight, persistent))
+				{
+					timing.lap(RequestTiming::TRANSFER);
+					timing.outcome = "coalesced";
+					return true;
+				}
+
+				// the leader failed before responding, fetch on our own
+				log_content = std::to_string(client_id) + ": NOTE request " + std::to_string(flight->leader_id) + " failed, fetching alone";
+				logger.log(log_content);
 			}
+		}
 
-			// has resolved re-validation, updated cache and resending
+		// resend and check the status code
+		// has resolved re-validation, updated cache and resending
+		if(cache_status == CACHE_REVALIDATE)
+		{
+			reusable = resendCheckStatus(client_id, client_fd, server_fd, pooled, request, content_to_send, cached, lead.get(), timing, persistent);
 			return true;
 		}
 
-		// convert expiration time to string
-		tm * tm = localtime(&response.expiration_time);
-		char * dt = asctime(tm);
-		std::string expiration(dt);
+		return false;
+	}
 
-		// write to log
-		std::string log_content = std::to_string(client_id) + ": in cache, but expired at "  + expiration;
-		logger.log(log_content);
+	// respond with the response fetched by the leader of the flight, relaying its bytes as they arrive
+	// return false if the leader failed before publishing anything, the caller then fetches on its own
+	// persistent tells whether client fd may carry another request
+	bool followFlight(int client_fd, Flight & flight, bool & persistent)
+	{
+		size_t next = 0;
+		while(true)
+		{
+			std::vector<Flight::Chunk> chunks;
+			Flight::State state = flight.wait(next, chunks);
+			for(const Flight::Chunk & chunk : chunks)
+			{
+				if(!respondClient(client_fd, &chunk->data()[0], chunk->size()))
+				{
+					throw ProxyException("Proxy respond to client error");
+				}
+				metrics.add(Metrics::BYTES_ORIGIN, chunk->size());
+			}
+			next += chunks.size();
 
-		return false;
+			if(state == Flight::DONE)
+			{
+				persistent = flight.isPersistent();
+				return true;
+			}
+			if(state == Flight::CACHED)
+			{
+				respondCached(client_fd, *flight.response());
+				persistent = delimited(*flight.response());
+				return true;
+			}
+			if(state == Flight::FAILED)
+			{
+				if(next == 0)
+				{
+					return false;
+				}
+				throw ProxyException("Coalesced request failed");
+			}
+		}
 	}
 
-	// try to connect to the server
-	// server fd will be closed in the upper layer exception handling
-	void connectServer(const Request & request, int & server_fd)
+	// try to connect to the server, or take an idle connection to it from the upstream pool unless fresh
+	// pooled tells whether server fd counts against the pool, it has to be given back by upstream.checkin()
+	// server fd will be released in the upper layer exception handling
+	// return true if server fd is an idle connection taken from the pool
+	bool connectServer(const Request & request, int & server_fd, bool & pooled, RequestTiming & timing, bool fresh = false)
 	{
-		// initialize host info
-		struct addrinfo host_info;
-	    struct addrinfo * host_info_list;
-	    memset(&host_info, 0, sizeof(host_info));
-	    host_info.ai_family = AF_UNSPEC;
-	    host_info.ai_socktype = SOCK_STREAM;
+		// a pooled connection skips the handshake, tunnels always get their own
+		const std::string key = upstreamKey(request);
+		bool poolable = upstream.enabled() && request.httpAction != "CONNECT";
+		pooled = false;
+		if(poolable && !fresh)
+		{
+			server_fd = upstream.checkout(key);
+			if(server_fd != -1)
+			{
+				pooled = true;
+				timing.lap(RequestTiming::CONNECT);
+				metrics.add(Metrics::UPSTREAM_POOLED);
+				return true;
+			}
+		}
 
-	    // get host information
-	    const std::string & hostname = request.hostname;
-	    const std::string & port = request.port;
-	    status = getaddrinfo(hostname.c_str(), port.c_str(), &host_info, &host_info_list);
-	    if(status != 0) 
+	    // get host information, from the resolver cache unless it is a miss
+	    ServerAddress address;
+	    if(!resolver.resolve(request.hostname, request.port, address))
 	    {
 	      	throw ProxyException("Connect server getaddrinfo error");
-	    } 
+	    }
+	    timing.lap(RequestTiming::DNS);
 
 	    // create socket
-	    server_fd = socket(host_info_list->ai_family, 
-	    					host_info_list->ai_socktype,
-	                       	host_info_list->ai_protocol);
+	    server_fd = socket(address.family, address.socktype, address.protocol);
 	    if(server_fd == -1) 
 	    {
-	    	freeaddrinfo(host_info_list);
 	      	throw ProxyException("Connect server create socket error");
 	    }
 
 	    // connect a socket to a server
-	    status = connect(server_fd, host_info_list->ai_addr, host_info_list->ai_addrlen);
+	    status = connect(server_fd, (struct sockaddr *)&address.addr, address.addr_len);
 	    if(status == -1) 
 	    {
-	    	freeaddrinfo(host_info_list);
 	      	throw ProxyException("Connect socket to server error");
 	    } 
+	    pooled = poolable && upstream.admit(key);
+	    timing.lap(RequestTiming::CONNECT);
+	    metrics.record(Metrics::CONNECT, timing.get(RequestTiming::DNS) + timing.get(RequestTiming::CONNECT));
+	    metrics.add(Metrics::UPSTREAM_NEW);
+	    return false;
+	}
 
-	    // free address infor list
-	    freeaddrinfo(host_info_list);
+	// key of the connections to the server of request in the upstream pool
+	static std::string upstreamKey(const Request & request)
+	{
+		return request.hostname + ":" + request.port;
 	}
 
-	// send request to server(for GET/POST http request)
-	void sendRequest(int server_fd, const Request & request)
+	// whether the server keeps the connection open after the response parsed by head from buf
+	// HTTP/1.1 keeps alive unless any Connection field lists close
+	static bool keepsAlive(const char * buf, const HttpParser & head)
 	{
-		int sent_length = 0;
-		int request_length = request.content.size();
-		const char * content = &request.content.data()[0];
-		while(sent_length < request_length)
+		const Span & version = head.version();
+		return version.length == 8 && strncmp(version.data(buf), "HTTP/1.1", 8) == 0 && !head.listHas(buf, "connection", "close");
+	}
+
+	// same for a parsed response
+	static bool keepsAlive(const Response & response)
+	{
+		return response.first_line.compare(0, 9, "HTTP/1.1 ") == 0 && !response.kv.listHas(response.header.data(), HeaderMap::CONNECTION, "close");
+	}
+
+	// whether a client can tell where the response ends without the connection being closed:
+	// it has a Content-Length, chunked as its last transfer coding, or a status code without body
+	static bool delimited(const Response & response)
+	{
+		if(!keepsAlive(response))
 		{
-			int len = send(server_fd, content + sent_length, request_length - sent_length, 0);
-			if(len == -1)
-		    {
-		        throw ProxyException("Proxy send client request error");
-		    }
-		    sent_length += len;
+			return false;
 		}
+		const HeaderMap & kv = response.kv;
+		const char * base = response.header.data();
+		Span coding = kv.last(base, HeaderMap::TRANSFER_ENCODING);
+		int status_code = response.status_code;
+		return kv.has(HeaderMap::CONTENT_LENGTH) || (coding.length > 0 && HttpParser::lastIs(coding.data(base), coding.length, "chunked"))
+			|| status_code == 304 || status_code == 204 || status_code / 100 == 1;
 	}
 
-	// get the header of response
-	// since the return value of len is needed in the upper layer, throw error when sending fails
-	int getResponseHeader(int server_fd, std::vector<char> & buffer)
+	// count a request by its method
+	void countRequest(const Request & request)
 	{
-		int len = recv(server_fd, &buffer.data()[0], BUFFER_SIZE, 0);
-	    if(len == -1)
-	    {
-	    	throw ProxyException("Receive header error");
-	    }
+		if(request.httpAction == "GET") metrics.add(Metrics::REQUESTS_GET);
+		else if(request.httpAction == "POST") metrics.add(Metrics::REQUESTS_POST);
+		else if(request.httpAction == "CONNECT") metrics.add(Metrics::REQUESTS_CONNECT);
+	}
+
+	// the response to request is sent, the rest of its time goes to draining it to the client
+	// the request time is recorded for every request, the timing line is logged for one in config.timing_sample
+	void finishTiming(int client_id, const Request & request, RequestTiming & timing)
+	{
+		timing.lap(RequestTiming::DRAIN);
+		metrics.record(Metrics::REQUEST, timing.total());
+		if(config.timing_sample > 0 && client_id % config.timing_sample == 0)
+		{
+			std::string log_content = std::to_string(client_id) + ": TIMING " + request.httpAction + " " + request.url + " " + timing.str();
+			logger.log(log_content);
+		}
+	}
+
+	// the admin endpoint, a GET of STATS_PATH sent to the proxy itself instead of through it
+	static bool isStatsRequest(const Request & request)
+	{
+		const std::string & url = request.url;
+		size_t N = strlen(STATS_PATH);
+		return request.httpAction == "GET" && url.compare(0, N, STATS_PATH) == 0 && (url.size() == N || url[N] == '?');
+	}
+
+	// metrics in the Prometheus text format, with the state of the cache and the logger
+	std::string statsResponse()
+	{
+		std::string body = metrics.render();
+		body += "# HELP proxy_cache_entries Responses in the memory cache.\n";
+		body += "# TYPE proxy_cache_entries gauge\n";
+		body += "proxy_cache_entries " + std::to_string(cache.size()) + "\n";
+		body += "# HELP proxy_cache_bytes Memory held by the responses in the memory cache.\n";
+		body += "# TYPE proxy_cache_bytes gauge\n";
+		body += "proxy_cache_bytes " + std::to_string(cache.bytes()) + "\n";
+		body += "# HELP proxy_log_dropped_lines_total Log lines dropped because a log buffer was full.\n";
+		body += "# TYPE proxy_log_dropped_lines_total counter\n";
+		body += "proxy_log_dropped_lines_total " + std::to_string(logger.dropped()) + "\n";
+		return "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\nCache-Control: no-store\r\n"
+			"Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+	}
+
+	// whether the client connection carries another request after the response to request
+	// persistent tells whether the client can tell where the response ends without the close
+	bool keepClient(const Request & request, bool persistent)
+	{
+		return persistent && config.client_idle_timeout != 0 && request.keep_alive;
+	}
+
+	// connect to the server of request, send the length bytes of data and receive the header of the response
+	// an idle pooled connection may be closed by the server right after the check in checkout(), it then fails before
+	// the first byte of the response, and a GET (re-validations included) is sent once more on a new connection,
+	// nothing has reached the client yet
+	// server fd and pooled are set as by connectServer(), the return value is the one of getResponseHeader()
+	int fetchHeader(const Request & request,
+					const char * data,
+					size_t length,
+					int & server_fd,
+					bool & pooled,
+					std::vector<char> & buffer,
+					HttpParser & head,
+					RequestTiming & timing)
+	{
+		for(bool fresh = false; ; fresh = true)
+		{
+			bool reused = connectServer(request, server_fd, pooled, timing, fresh);
+			int len = respondClient(server_fd, data, length) ? getResponseHeader(server_fd, buffer, head, timing) : 0;
+			if(len > 0)
+			{
+				return len;
+			}
+			if(!reused || request.httpAction != "GET")
+			{
+				throw ProxyException("Server closed before responding");
+			}
+			upstream.checkin(upstreamKey(request), server_fd, pooled, false);
+			server_fd = -1;
+		}
+	}
+
+	// get the header of response, receiving until head reports it complete
+	// buffer holds BUFFER_SIZE + 1 bytes, the received ones may go on with the beginning of the body
+	// since the return value of len is needed in the upper layer, throw error when receiving fails
+	// return 0 if the server closed or failed before the first byte
+	// the wait for the first byte of the response ends the WAIT phase of timing
+	int getResponseHeader(int server_fd, std::vector<char> & buffer, HttpParser & head, RequestTiming & timing)
+	{
+		int len = 0;
+		HttpParser::Result res = HttpParser::INCOMPLETE;
+		while(res == HttpParser::INCOMPLETE)
+		{
+			int received = len < BUFFER_SIZE ? recv(server_fd, &buffer.data()[0] + len, BUFFER_SIZE - len, 0) : 0;
+			if(received == -1 && errno == EINTR)
+			{
+				continue;
+			}
+			if(received <= 0 && len == 0)
+			{
+				return 0;
+			}
+			if(received <= 0)
+			{
+				throw ProxyException("Receive header error");
+			}
+			if(len == 0)
+			{
+				timing.lap(RequestTiming::WAIT);
+				metrics.record(Metrics::FIRST_BYTE, timing.get(RequestTiming::WAIT));
+			}
+			len += received;
+			res = head.parse(buffer.data(), len);
+		}
+		if(res == HttpParser::ERROR)
+		{
+			throw ProxyException("Receive header error");
+		}
 	    buffer[len] = '\0';
 	    return len;
 	}
@@ -428,14 +831,17 @@ private:
 	// receive response from server(for GET/POST http request)
 	// and send buffer to the client every time proxy receives the response of the server
 	// this part of code takes charge of header part
-	void getResponse(int client_id, int client_fd, int server_fd, const Request & request)
+	// the server is connected here, server fd and pooled are set, see fetchHeader()
+	// return true if server fd may serve another request
+	bool getResponse(int client_id, int client_fd, int & server_fd, bool & pooled, const Request & request, Flight * flight, RequestTiming & timing)
 	{
-	    // get header first, decide whether content-based or chunk-based
-	    std::vector<char> buffer(BUFFER_SIZE, '\0');
+	    // send request and get header first, decide whether content-based or chunk-based
+	    std::vector<char> buffer(BUFFER_SIZE + 1, '\0');
+	    HttpParser head(HttpParser::RESPONSE);
 	    int len = 0; // len is the length of received header length
 	    try
 	    {
-	    	len = getResponseHeader(server_fd, buffer);
+	    	len = fetchHeader(request, request.content.data(), request.content.size(), server_fd, pooled, buffer, head, timing);
 	    }
 	    catch(std::exception & e)
 	    {
@@ -443,19 +849,22 @@ private:
 	    }
 
 	    // send header to the client
-	    if(!respondClient(client_fd, buffer, len))
+	    flight = leadFlight(flight, &buffer.data()[0], head);
+	    if(!relayResponse(client_fd, flight, &buffer.data()[0], len))
 	    {
 	    	throw ProxyException("Proxy send to client error");
 	    }
 
 	    // get url of the request, and pass it as the argument of getResponse() body part
 	    const std::string url = request.url;
-	    const std::string header(buffer.begin(), buffer.begin() + len + 1);
-	    std::vector<std::vector<char>> segment; // store every segment of the response from the server
-	    segment.push_back(std::vector<char>(buffer.begin(), buffer.begin() + len)); // push header into the segment vector
+	    const std::string header(buffer.begin(), buffer.begin() + head.headerLength());
+	    ResponseBuffer body; // the whole response from the server, kept for cache
+	    size_t header_length = head.headerLength();
+	    keepResponse(body, header_length, &buffer.data()[0], header_length); // header goes first
 	    try
 	    {
-	    	getResponse(client_id, client_fd, server_fd, url, header, segment, len, request.httpAction);
+	    	return getResponse(client_id, client_fd, server_fd, url, header, head, body,
+	    		&buffer.data()[0] + header_length, len - header_length, request.httpAction, flight, timing);
 	    }
 	    catch(std::exception & e)
 	    {
@@ -466,148 +875,309 @@ private:
 	// receive response from server(for GET/POST http request)
 	// and send buffer to the client every time proxy receives the response of the server
 	// this part of code takes charge of content part
-	void getResponse(int client_id,
+	// body already holds the header, first_body is the first len bytes after it, which came with the header and
+	// have been sent to the client already, the rest is received straight into body
+	// the response is published to flight unless it is NULL
+	// return true if server fd and client fd may serve another request, which needs the response to end at a known length
+	bool getResponse(int client_id,
 					int client_fd, 
 					int server_fd, 
 					const std::string & url, 
 					const std::string & header, 
-					std::vector<std::vector<char>> & segment,
+					const HttpParser & head,
+					ResponseBuffer & body,
+					char * first_body,
 					int len,
-					const std::string & httpAction)
+					const std::string & httpAction,
+					Flight * flight,
+					RequestTiming & timing)
 	{
 	    // content-based http response
 	    // (1) extract content length from header
 	    // (2) keep receiving until total received size exceeds content length(marks end)
-	    std::vector<char> buffer(BUFFER_SIZE, '\0');
-	    if(header.find("Content-Length") != -1)
+	    std::vector<char> buffer(BUFFER_SIZE, '\0'); // receives the bytes which are not kept for cache
+	    size_t kept_length = body.size(); // bytes kept for cache
+	    char * data = NULL; // where the last receive went
+	    bool reusable = false;
+
+	    if(head.contentLength() != -1)
 	    {
-	    	int received_length = len;
-	    	int content_length = parser.extractContentLength(header);
+	    	long header_length = head.headerLength();
+	    	long received_length = len;
+	    	long content_length = head.contentLength();
+
+	    	// the whole response fits into one allocation
+	    	if((size_t)header_length + content_length <= config.max_object)
+	    	{
+	    		body.reserve(header_length + content_length);
+	    	}
+	    	kept_length += len;
+	    	keepResponse(body, kept_length, first_body, len);
 	    	while(received_length < content_length)
 	    	{
 	    		// receive response from server
-	    		len = recv(server_fd, &buffer.data()[0], BUFFER_SIZE - 1, 0);
-		    	if(len == -1)
-		    	{
-		    		throw ProxyException("Proxy received from server error");
-		    	}
-		    	buffer[len] = '\0';
-		    	segment.push_back(std::vector<char>(buffer.begin(), buffer.begin() + len));
+	    		len = recvResponse(server_fd, body, kept_length, buffer, data);
+	    		if(len == 0)
+	    		{
+	    			throw ProxyException("Proxy received from server error");
+	    		}
 		    	received_length += len;
 
 		    	// send response to client
-		    	bool respond_suc = respondClient(client_fd, buffer, len);
+		    	bool respond_suc = relayResponse(client_fd, flight, data, len);
 		    	if(!respond_suc)
 		    	{
 		    		throw ProxyException("Proxy respond to client error");
 		    	}
+		    	keepReceived(body, kept_length, len);
 	    	}
+	    	reusable = received_length == content_length;
 	    }
 
 	    // chunk-based http response
-	    // keep receiving till the last chunk of the response, which is marked as 0 at the first line of the chunk
-	    else if(header.find("chunked") != -1)
+	    // keep receiving till the decoder has seen the last chunk and the trailer after it
+	    // the client gets the chunks as they are, cache keeps the decoded body
+	    else if(head.chunked())
 	    {
-	    	bool isLastBlock = false;
-	    	while(!isLastBlock)
+	    	ChunkedDecoder decoder;
+	    	size_t consumed = keepChunked(decoder, body, kept_length, first_body, len);
+	    	bool extra = consumed < (size_t)len; // bytes after the end of body
+	    	while(!decoder.done())
 	    	{
 	    		// receive message from server
-	    		len = recv(server_fd, &buffer.data()[0], BUFFER_SIZE - 1, 0);
-		    	if(len == -1)
-		    	{
-		    		throw ProxyException("Proxy received from server error");
-		    	}
-		    	buffer[len] = '\0';
-		    	segment.push_back(std::vector<char>(buffer.begin(), buffer.begin() + len));
+	    		len = recvResponse(server_fd, body, kept_length, buffer, data);
+	    		if(len == 0)
+	    		{
+	    			throw ProxyException("Proxy received from server error");
+	    		}
 
 		    	// send response to the client
-		    	bool respond_suc = respondClient(client_fd, buffer, len);
+		    	bool respond_suc = relayResponse(client_fd, flight, data, len);
 		    	if(!respond_suc)
 		    	{
 		    		throw ProxyException("Proxy respond to client error");
 		    	}
 
-		    	// the first character of the last block starts with 0
-		    	if(buffer[0] == '0')
-		    	{
-		    		isLastBlock = true;
-		    	}
-	    	}	
+		    	// the received bytes are decoded where they are, only the chunk data is kept
+		    	size_t data_length = 0;
+		    	extra = decoder.decode(data, len, data_length) < (size_t)len;
+		    	keepReceived(body, kept_length, data_length);
+	    	}
+	    	reusable = !extra;
 	    }
 
 	    // POST action
 	    else
 	    {
 	    	// keep receiving until the received length is 0, which marks the end of transmission
-	    	int received_length = len;
+	    	kept_length += len;
+	    	keepResponse(body, kept_length, first_body, len);
 	    	while(true)
 	    	{
 	    		// receive from server
-	    		len = recv(server_fd, &buffer.data()[0], BUFFER_SIZE - 1, 0);
-		    	if(len == -1)
-		    	{
-		    		throw ProxyException("Proxy received from server error");
-		    	}
-		    	else if(len == 0)
+	    		len = recvResponse(server_fd, body, kept_length, buffer, data);
+		    	if(len == 0)
 		    	{
 		    		break;
 		    	}
-		    	segment.push_back(std::vector<char>(buffer.begin(), buffer.begin() + len));
 
 		    	// send response to the client
-		    	bool respond_suc = respondClient(client_fd, buffer, len);
+		    	bool respond_suc = relayResponse(client_fd, flight, data, len);
 		    	if(!respond_suc)
 		    	{
 		    		throw ProxyException("Proxy respond to client error");
 		    	}
+		    	keepReceived(body, kept_length, len);
 	    	}
 	    }
-	    Response response(url, segment, header);
-	    parser.parseResponse(response);
-
-	    // write first line of response to log
-	    std::string log_content = std::to_string(client_id) + ": Received " + response.first_line + " from " + response.url;
-	    logger.log(log_content);
-	    log_content = std::to_string(client_id) + ": Responding " + response.first_line;
-	    logger.log(log_content);
-
-	    // cache only works for GET http action, and apply on those with no "no-store" attribute
-	    if(!response.no_store && httpAction == "GET")
-	    {
-	    	cache.put(url, response);
-	    }
-
-	    // if http action is GET and status code is 200, write it into log
-	    if(httpAction == "GET" && response.status_code == 200)
+	    timing.lap(RequestTiming::TRANSFER);
+	    storeResponse(client_id, url, header, body, httpAction, kept_length > config.max_object, head.chunked());
+	    timing.lap(RequestTiming::CACHE);
+	    reusable = reusable && keepsAlive(header.data(), head);
+	    if(flight != NULL)
 	    {
-	    	std::string log_content;
-	    	if(response.no_store)
-	    	{
-	    		log_content = std::to_string(client_id) + ": not cachable bacause no-store in Cache-Control"; 
-	    	}
-	    	else if(!response.etag.empty() || response.last_modified != 0)
-	    	{
-	    		log_content = std::to_string(client_id) + ": cached, but requires re-validation"; 
-	    	}
-	    	else
-	    	{
-	    		// convert time_t to string
-	    		tm * tm = localtime(&response.expiration_time);
-	    		char * dt = asctime(tm);
-	    		std::string expiration_time(dt);
-	 			log_content = std::to_string(client_id) + ": cached, expired at " + expiration_time;
-	    	}
-	    	logger.log(log_content);
+	    	flight->finish(reusable);
 	    }
+	    return reusable;
+	}
+
+	// receive the next part of the response from server
+	// while the response may still be cached, it goes straight into the spare room of body, otherwise into buffer
+	// data points at the received bytes, which stay valid until keepReceived()
+	int recvResponse(int server_fd, ResponseBuffer & body, size_t kept_length, std::vector<char> & buffer, char *& data)
+	{
+		size_t room = BUFFER_SIZE - 1;
+		if(kept_length <= config.max_object)
+		{
+			data = body.tail();
+			room = std::min(room, body.spare());
+		}
+		else
+		{
+			data = &buffer.data()[0];
+		}
+		int len = recv(server_fd, data, room, 0);
+		if(len == -1)
+		{
+			throw ProxyException("Proxy received from server error");
+		}
+		return len;
+	}
+
+	// keep the bytes received into body by recvResponse()
+	// once the response grows beyond the object size cap it won't be cached, so the kept bytes are dropped
+	void keepReceived(ResponseBuffer & body, size_t & kept_length, size_t len)
+	{
+		if(kept_length > config.max_object)
+		{
+			return;
+		}
+		kept_length += len;
+		if(kept_length > config.max_object)
+		{
+			body.release();
+			return;
+		}
+		body.commit(len);
+	}
+
+	// keep a copy of received bytes of the response for cache, with the same object size cap
+	void keepResponse(ResponseBuffer & body, size_t kept_length, const char * data, size_t len)
+	{
+		if(kept_length > config.max_object)
+		{
+			body.release();
+			return;
+		}
+		body.append(data, len);
+	}
+
+	// keep the next len bytes of a chunked body for cache, with the chunk framing dropped in place
+	// return the bytes which belong to the body, the rest comes after its end
+	size_t keepChunked(ChunkedDecoder & decoder, ResponseBuffer & body, size_t & kept_length, char * data, size_t len)
+	{
+		size_t data_length = 0;
+		size_t consumed = decoder.decode(data, len, data_length);
+		kept_length += data_length;
+		keepResponse(body, kept_length, data, data_length);
+		return consumed;
+	}
+
+	// parse the complete response, write it to log and store it into cache if cachable
+	// shared by the threaded and event-driven paths
+	// the body is moved into the response, which becomes immutable once stored into cache
+	// a chunked body has been kept decoded, it is stored with a Content-Length instead, so a hit goes out as one block
+	void storeResponse(int client_id,
+					const std::string & url,
+					const std::string & header,
+					ResponseBuffer & body,
+					const std::string & httpAction,
+					bool oversized,
+					bool chunked)
+	{
+	    std::shared_ptr<Response> response;
+	    if(chunked && !oversized && httpAction == "GET")
+	    {
+	    	size_t length = body.size() - header.size();
+	    	const std::string unchunked = ChunkedDecoder::unchunkedHeader(header, length);
+	    	ResponseBuffer decoded;
+	    	decoded.reserve(unchunked.size() + length);
+	    	decoded.append(unchunked.data(), unchunked.size());
+	    	decoded.append(body.data() + header.size(), length);
+	    	response = std::make_shared<Response>(url, std::move(decoded), unchunked);
+	    }
+	    else
+	    {
+	    	body.shrink(); // a buffer grown without a known length has slack
+	    	response = std::make_shared<Response>(url, std::move(body), header);
+	    }
+	    parser.parseResponse(*response);
+
+	    // write first line of response to log
+	    std::string log_content = std::to_string(client_id) + ": Received " + response->first_line + " from " + response->url;
+	    logger.log(log_content);
+	    log_content = std::to_string(client_id) + ": Responding " + response->first_line;
+	    logger.log(log_content);
+
+	    // cache only works for GET http action, and apply on those with no "no-store" attribute
+	    // responses larger than the object size cap are not cached
+	    bool cached = false;
+	    if(!response->no_store && !oversized && httpAction == "GET")
+	    {
+	    	cached = cache.put(url, response);
+	    }
+
+	    // a copy on disk is older than the response just received
+	    if(disk.enabled() && httpAction == "GET")
+	    {
+	    	disk.remove(url);
+	    }
+
+	    // if http action is GET and status code is 200, write it into log
+	    if(httpAction == "GET" && response->status_code == 200)
+	    {
+	    	std::string log_content;
+	    	if(response->no_store)
+	    	{
+	    		log_content = std::to_string(client_id) + ": not cachable bacause no-store in Cache-Control"; 
+	    	}
+	    	else if(!cached)
+	    	{
+	    		log_content = std::to_string(client_id) + ": not cachable because larger than the object size cap"; 
+	    	}
+	    	else if(!response->etag.empty() || response->last_modified != 0)
+	    	{
+	    		log_content = std::to_string(client_id) + ": cached, but requires re-validation"; 
+	    	}
+	    	else
+	    	{
+	    		// convert time_t to string
+	    		const std::string & expiration_time = CoarseClock::format(response->expiration_time);
+	 			log_content = std::to_string(client_id) + ": cached, expired at " + expiration_time;
+	    	}
+	    	logger.log(log_content);
+	    }
+	}
+
+	// the leader has the header of its response, fail the flight right away if its followers can't have the response,
+	// so they fetch on their own before relaying any byte:
+	// (1) the response is meant for the leader's client only: no-store, private or Set-Cookie
+	// (2) it is known to exceed the object size cap, beyond which the flight would fail half way
+	// return the flight to publish the response to, NULL if there is none
+	Flight * leadFlight(Flight * flight, const char * buf, const HttpParser & head)
+	{
+		if(flight == NULL)
+		{
+			return NULL;
+		}
+		long length = head.contentLength();
+		if(head.listHas(buf, "cache-control", "no-store") || head.listHas(buf, "cache-control", "private") || head.find(buf, "set-cookie") != NULL
+			|| (length != -1 && head.headerLength() + length > config.max_object))
+		{
+			flight->fail();
+			return NULL;
+		}
+		return flight;
+	}
+
+	// send received bytes to the client, and publish them to the requests following the flight
+	bool relayResponse(int client_fd, Flight * flight, const char * data, int len)
+	{
+		if(flight != NULL)
+		{
+			flight->publish(data, len);
+		}
+		metrics.add(Metrics::BYTES_ORIGIN, len);
+		return respondClient(client_fd, data, len);
 	}
 
 	// send every character received to the client
-	bool respondClient(int client_fd, const std::vector<char> & buffer, int received_length)
+	bool respondClient(int client_fd, const char * data, int received_length)
 	{
 		int sent_length = 0;
 		while(sent_length < received_length)
 		{
-			int len = send(client_fd, &buffer.data()[0] + sent_length, received_length, 0);	
+			int len = send(client_fd, data + sent_length, received_length - sent_length, 0);	
 			if(len == -1)
 			{
 				return false;
@@ -622,33 +1192,39 @@ private:
 	// (1) the stored response in the cache hasn't expired
 	// (2) the reponse has expired, but has a etag, and pass the re-validation(get 304 status code)
 	// (3) the reponse has expired and has no etag, doesn't exceed last-modified date, and pass the re-validation(get 304 status code)
-	void respondCached(int client_fd, const std::string & url)
+	// the response is shared with the cache, it stays valid even if evicted meanwhile
+	// the response is sent straight from its buffer, one syscall covers it unless the socket buffer fills up
+	void respondCached(int client_fd, const Response & response)
 	{
 		// send response to the client
-		Response response = cache.get(url);
-		for(const auto & seg : response.content)
+		metrics.add(Metrics::BYTES_CACHE, response.content.size());
+		SegmentSender sender;
+		sender.reset(response.content.data(), response.content.size());
+		if(config.zerocopy)
 		{
-			int sent_length = 0;
-			int length_to_be_sent = seg.size();
-			while(sent_length < length_to_be_sent)
-			{
-				int len = send(client_fd, &seg.data()[0] + sent_length, length_to_be_sent - sent_length, 0);
-				if(len == -1)
-				{
-					throw ProxyException("Send with cached response error");
-				}
-				sent_length += len;
-			}
+			sender.enableZerocopy(client_fd);
+		}
+		while(!sender.done())
+		{
+			sender.sendSome(client_fd);
+		}
+
+		// the kernel may still read the buffer, which is released once the caller drops the response
+		if(!sender.waitCompletions(client_fd, ZEROCOPY_TIMEOUT))
+		{
+			throw ProxyException("Wait for zerocopy completion timeout");
 		}
 	}
 
 	// handle GET and POST request
-	void handleGetPost(int client_id, int client_fd, int server_fd, const Request & request)
+	// the server is connected here, server fd and pooled are set, see fetchHeader()
+	// the response is published to flight unless it is NULL
+	// return true if server fd may serve another request
+	bool handleGetPost(int client_id, int client_fd, int & server_fd, bool & pooled, const Request & request, RequestTiming & timing, Flight * flight = NULL)
 	{
 		try
 		{
-			sendRequest(server_fd, request);
-			getResponse(client_id, client_fd, server_fd, request);
+			return getResponse(client_id, client_fd, server_fd, pooled, request, flight, timing);
 		}
 		catch(std::exception & e)
 		{
@@ -656,36 +1232,120 @@ private:
 		}
 	}
 
+	// pipes of both tunnel directions, a direction is left without one if splice is off or no pipe can be created
+	void openTunnelPipes(std::unique_ptr<SplicePipe> (&pipes)[2])
+	{
+		for(int i = 0; i < 2 && config.splice; ++i)
+		{
+			pipes[i].reset(new SplicePipe());
+			if(!pipes[i]->open(TUNNEL_PIPE_SIZE))
+			{
+				pipes[i].reset();
+			}
+		}
+	}
+
+	// wait until the non-blocking fd of a tunnel takes bytes again
+	// a side gone (error or hang-up) or taking nothing for TUNNEL_SEND_TIMEOUT ends the tunnel
+	void waitTunnelWritable(int fd)
+	{
+		while(true)
+		{
+			struct pollfd pfd;
+			pfd.fd = fd;
+			pfd.events = POLLOUT;
+			pfd.revents = 0;
+			int res = poll(&pfd, 1, TUNNEL_SEND_TIMEOUT);
+			if(res == -1 && errno == EINTR)
+			{
+				continue;
+			}
+			if(res == -1 || (pfd.revents & (POLLERR | POLLHUP)))
+			{
+				throw ProxyException("Tunnel peer closed while sending");
+			}
+			if(res == 0)
+			{
+				throw ProxyException("Tunnel send timeout");
+			}
+			return;
+		}
+	}
+
+	// move everything in the pipe to fd, waiting whenever fd takes nothing
+	void drainTunnelPipe(SplicePipe & pipe, int fd)
+	{
+		while(pipe.size() > 0)
+		{
+			if(pipe.drain(fd) == -1)
+			{
+				waitTunnelWritable(fd);
+			}
+		}
+	}
+
+	// send every byte to the non-blocking fd of a tunnel, waiting whenever fd takes nothing
+	void sendTunnel(int fd, const char * data, size_t len)
+	{
+		size_t sent = 0;
+		while(sent < len)
+		{
+			ssize_t res = send(fd, data + sent, len - sent, MSG_NOSIGNAL);
+			if(res >= 0)
+			{
+				sent += res;
+			}
+			else if(errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				waitTunnelWritable(fd);
+			}
+			else if(errno != EINTR)
+			{
+				throw ProxyException("Send to client or server error");
+			}
+		}
+	}
+
 	// handle CONNECT request
-	void handleConnect(int client_id, int client_fd, int server_fd, const Request & request)
+	// bytes the client sent after the request, in pending, are the first ones of the tunnel
+	// every direction is relayed until its sender closes, the close is passed on as a shutdown of the other side's write half,
+	// the tunnel ends when both directions are closed
+	void handleConnect(int client_fd, int server_fd, std::vector<char> & pending)
 	{
 		// send a 200 OK to client
-		const char * okMsg = "200 OK";
-		int len = send(client_fd, okMsg, strlen(okMsg) + 1, 0);
+		const char * okMsg = "HTTP/1.1 200 OK\r\n\r\n";
+		int len = send(client_fd, okMsg, strlen(okMsg), 0);
 		if(len == -1)
 		{
 			throw ProxyException("Send 200 OK to client error");
 		}
 
+		// both sides stop blocking, so that a side taking nothing can't hold the worker past TUNNEL_SEND_TIMEOUT
+		EventLoop::setNonBlocking(client_fd);
+		EventLoop::setNonBlocking(server_fd);
+		sendTunnel(server_fd, pending.data(), pending.size());
+		pending.clear();
+
 		// select and keep listening
-		bool connectionEnd = false;
 		fd_set rfds;
 		int fds[] = { client_fd, server_fd };
 		int max_fd = std::max(fds[0], fds[1]) + 1; // argument of select() is the maximum fd + 1
-		std::vector<char> buffer(BUFFER_SIZE, '\0'); // buffer to store request or response
-		while(true)
+		bool eof[] = { false, false };
+		std::unique_ptr<SplicePipe> pipes[2];
+		openTunnelPipes(pipes);
+		std::vector<char> buffer(BUFFER_SIZE, '\0'); // buffer of the directions without a pipe
+		while(!eof[0] || !eof[1])
 		{
-			// check if break loop
-			if(connectionEnd)
+			// initialize the fd set with the sides still sending
+			FD_ZERO(&rfds);
+			for(int i = 0; i < 2; ++i)
 			{
-				break;
+				if(!eof[i])
+				{
+					FD_SET(fds[i], &rfds);
+				}
 			}
 
-			// initialize the fd set
-			FD_ZERO(&rfds);
-			FD_SET(fds[0], &rfds);
-			FD_SET(fds[1], &rfds);
-
 			// listen to fds in a blocking way
 			status = select(max_fd, &rfds, NULL, NULL, NULL); 
 			if(status == -1)
@@ -693,45 +1353,70 @@ private:
 				throw ProxyException("Server or client select error");
 			}
 
-			// receive request or respond from the set fd
-			// send to the other fd
+			// receive from the set fd, send everything to the other fd
 			for(int i = 0; i < 2; ++i)
 			{
-				if(FD_ISSET(fds[i], &rfds))
+				if(!FD_ISSET(fds[i], &rfds))
+				{
+					continue;
+				}
+				if(pipes[i])
 				{
-					// receive
-					len = recv(fds[i], &buffer.data()[0], BUFFER_SIZE - 1, 0);
-					if(len == -1)
+					len = pipes[i]->fill(fds[i]);
+					if(len > 0)
 					{
-						throw ProxyException("Receive request or respond error");
+						drainTunnelPipe(*pipes[i], fds[1 - i]);
 					}
-
-					// decide the end of CONNECT
-					else if(len == 0)
+				}
+				else
+				{
+					len = recv(fds[i], &buffer.data()[0], BUFFER_SIZE, 0);
+					if(len == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
 					{
-						connectionEnd = true;
-						break;
+						throw ProxyException("Receive request or respond error");
 					}
-					buffer[len] = '\0';
-
-					// send
-					len = send(fds[1 - i], &buffer.data()[0], len, 0);
-					if(len == -1)
+					if(len > 0)
 					{
-						throw ProxyException("Send to client or server error");
+						sendTunnel(fds[1 - i], &buffer.data()[0], len);
 					}
 				}
+
+				// the side closed, pass it on, the other direction goes on
+				// nothing to read after all (-1) leaves the direction as it is
+				if(len == 0)
+				{
+					eof[i] = true;
+					shutdown(fds[1 - i], SHUT_WR);
+				}
 			}
 		}
 	}
 
-	// handle request(actions after accept)
-	// (1) connect server by client
-	// (2) handle request accordingly
+	// handle the requests of a client (actions after accept), one after another until the connection ends
+	// every request after the first gets an id of its own
 	void handleRequest(int client_id, int client_fd, const std::string & client_ip)
+	{
+		std::vector<char> pending; // received bytes of the requests not handled yet
+		while(handleNextRequest(client_id, client_fd, client_ip, pending))
+		{
+			client_id = next_client_id.fetch_add(1) & INT_MAX;
+		}
+		close(client_fd);
+	}
+
+	// handle the next request of a client
+	// (1) accept the request
+	// (2) connect server by client
+	// (3) handle request accordingly
+	// return true if the client connection carries another request
+	bool handleNextRequest(int client_id, int client_fd, const std::string & client_ip, std::vector<char> & pending)
 	{
 		int server_fd = -1;
+		bool server_pooled = false; // server fd counts against the upstream pool
+		bool server_reusable = false; // server fd may serve another request
+		bool persistent = false; // client fd may carry another request
 		Request request;
+		RequestTiming timing;
 
 		try
 		{
@@ -739,7 +1424,17 @@ private:
 			// if an error occurs, throw the exception
 			try
 			{
-				request = acceptRequest(client_fd);
+				if(!acceptRequest(client_fd, pending, request))
+				{
+					return false;
+				}
+				timing.start();
+				if(isStatsRequest(request))
+				{
+					const std::string response = statsResponse();
+					return respondClient(client_fd, response.data(), response.size()) && keepClient(request, true);
+				}
+				countRequest(request);
 
 				// record request to log
 				std::string log_content = std::to_string(client_id) + ": " + request.httpAction + " from " + client_ip + " @ " + request.request_time;
@@ -750,18 +1445,8 @@ private:
 				throw e;
 			}
 
-			// try to connect server, and get the server fd
-			// if an error occurs, throw the exception
-			try
-			{
-				connectServer(request, server_fd);	
-			}
-			catch(std::exception & e)
-			{
-				throw e;
-			}
-
 			// handle specific http request
+			// the server is connected once the request needs it, so that cache hits never wait for the server
 			try
 			{
 				std::string httpAction = request.httpAction;
@@ -772,7 +1457,8 @@ private:
 
 				if(httpAction == "CONNECT")
 				{
-					handleConnect(client_id, client_fd, server_fd, request);
+					connectServer(request, server_fd, server_pooled, timing);
+					handleConnect(client_fd, server_fd, pending);
 
 					// write tunnel status to log
 					std::string log_content = std::to_string(client_id) + ": Tunnel closed";
@@ -787,10 +1473,12 @@ private:
 					// anyway, the response has been sent to the client
 					try
 					{
-						bool cacheValid = checkCaching(client_id, client_fd, server_fd, request);
+						FlightGuard lead(coalescer, request.url);
+						bool cacheValid = checkCaching(client_id, client_fd, server_fd, server_pooled, request, lead, timing, server_reusable, persistent);
 						if(!cacheValid)
 						{
-							handleGetPost(client_id, client_fd, server_fd, request);
+							server_reusable = handleGetPost(client_id, client_fd, server_fd, server_pooled, request, timing, lead.get());
+							persistent = server_reusable;
 						}
 					}
 					catch(std::exception & e)
@@ -801,16 +1489,24 @@ private:
 				else if(httpAction == "POST")
 				{
 					std::cout << "begin post action" << std::endl;
-					handleGetPost(client_id, client_fd, server_fd, request);
+					server_reusable = handleGetPost(client_id, client_fd, server_fd, server_pooled, request, timing);
+					persistent = server_reusable;
 				}	
 				else
 				{
 					throw ProxyException("Unknown HTTP request category");
 				}
 
-				// release client and server fd
-				close(server_fd);
-				close(client_fd);
+				// server fd goes back to the upstream pool if it can be reused
+				if(server_fd != -1)
+				{
+					upstream.checkin(upstreamKey(request), server_fd, server_pooled, server_reusable);
+					server_fd = -1;
+				}
+				if(httpAction != "CONNECT")
+				{
+					finishTiming(client_id, request, timing);
+				}
 			}
 			catch(std::exception & e)
 			{
@@ -818,62 +1514,1200 @@ private:
 			}
 		}
 
-		// when an exception happens, write the exception into log and quit the thread
+		// when an exception happens, write the exception into log and end the client connection
 		catch(std::exception & e)
 		{
 			// write exception into log
 			std::string errMsg(e.what());
 			std::string log_content = std::to_string(client_id) + ": ERROR " + errMsg;
 			logger.log(log_content);
+			metrics.add(Metrics::REQUEST_ERRORS);
 
 			// close the allocated resource
-			close(client_fd);
-			if(server_fd != -1) close(server_fd);
-			return;
+			if(server_fd != -1) upstream.checkin(upstreamKey(request), server_fd, server_pooled, false);
+			return false;
 		}
+		return keepClient(request, persistent);
 	}
 
-public:
-	Proxy() : 
-		logger { "log.txt" },
-		cache { LRUCache(CACHE_SIZE) }
+	// ---------------- event-driven engine ----------------
+	// every loop thread owns an EventLoop and the connections it accepted
+	// client and server fds are registered edge-triggered, so every handler reads/writes until EAGAIN
+	// the same Connection is driven whenever either of its fds becomes ready
+
+	// receive whatever is available from fd, append it to the end of buffer
+	// return received length, 0 for peer closed, -1 for no data available now
+	int recvSome(int fd, std::vector<char> & buffer)
 	{
-		// error shouldn't happen in the constructor
-		// but if it does, release all the resouces allocated and exit the process
-		constructServer();
+		size_t old_size = buffer.size();
+		buffer.resize(old_size + BUFFER_SIZE);
+		int len = -1;
+		do
+		{
+			len = recv(fd, &buffer.data()[0] + old_size, BUFFER_SIZE, 0);
+		} while(len == -1 && errno == EINTR);
+		buffer.resize(old_size + (len > 0 ? len : 0));
+		if(len == -1)
+		{
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				return -1;
+			}
+			throw ProxyException("Event loop receive error");
+		}
+		return len;
 	}
 
-	~Proxy() noexcept
+	// send as many pending bytes in buffer (starting from off) as the socket accepts
+	// return true if any byte is sent
+	bool flushSome(int fd, std::vector<char> & buffer, size_t & off)
 	{
-		close(socket_fd);
+		bool progress = false;
+		while(off < buffer.size())
+		{
+			int len = send(fd, &buffer.data()[0] + off, buffer.size() - off, MSG_NOSIGNAL);
+			if(len == -1)
+			{
+				if(errno == EINTR) continue;
+				if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+				throw ProxyException("Event loop send error");
+			}
+			off += len;
+			progress = true;
+		}
+
+		// reclaim the sent part, so that the buffer doesn't keep growing
+		if(off == buffer.size())
+		{
+			buffer.clear();
+			off = 0;
+		}
+		else if(off > BUFFER_SIZE && off * 2 > buffer.size())
+		{
+			buffer.erase(buffer.begin(), buffer.begin() + off);
+			off = 0;
+		}
+		return progress;
 	}
 
-	void run()
+	// event-driven version of acceptConnection(), accept until no pending connection is left
+	void acceptConnections(int socket_fd, EventLoop & loop, ConnectionMap & conns)
 	{
-		unsigned client_id = 0; // id to mark different 
-
-		// (1) wait until an request of sending arrives
-		// (2) every time a client fd is caught, create a new thread to handle the request
 		while(true)
-		{ 
+		{
 			std::string client_ip;
-			int client_fd = acceptConnection(client_ip);
-			if(client_fd == -1) // request error
+			int client_fd = acceptConnection(socket_fd, client_ip, SOCK_NONBLOCK | SOCK_CLOEXEC);
+			if(client_fd == -1)
+			{
+				if(errno == EINTR || errno == ECONNABORTED) continue;
+				return; // EAGAIN, or running out of fds which is retried on the next connection
+			}
+
+			int client_id = next_client_id.fetch_add(1) & INT_MAX;
+			std::shared_ptr<Connection> conn(new Connection(client_id, client_fd, client_ip));
+			try
+			{
+				loop.add(client_fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+			}
+			catch(std::exception & e)
 			{
+				close(client_fd);
 				continue;
 			}
-			std::thread thd(&Proxy::handleRequest, this, client_id, client_fd, client_ip);
-			thd.detach();
+			conns[client_fd] = conn;
+		}
+	}
+
+	// event-driven version of acceptRequest(), receive until the whole request arrives
+	// a pipelined request may be there already, received together with the previous one
+	// return true if there is progress
+	bool readRequest(EventLoop & loop, ConnectionMap & conns, Connection & conn)
+	{
+		long request_length = requestLength(conn.request_head, conn.client_in);
+		if(request_length != -1)
+		{
+			startRequest(loop, conns, conn, request_length);
+			return true;
+		}
 
-			// assign every request/thread a unique id
-			client_id = (client_id == INT_MAX) ? 0 : ++client_id;
+		int len = recvSome(conn.client_fd, conn.client_in);
+		if(len == -1)
+		{
+			return false;
+		}
+		if(len == 0)
+		{
+			// client leaves between two requests, or before sending a complete request
+			conn.state = Connection::CLOSED;
+			return false;
 		}
+		return true;
 	}
-};
 
-int main(int argc, char ** argv)
-{
-	Proxy proxy;
+	// the request is complete, decide how to respond
+	// (1) fresh cache hit: respond from cache without touching the server
+	// (2) otherwise connect to the server, with a validation section inserted if necessary
+	// the request is the first request_length bytes of client_in, the bytes after it are kept for later
+	void startRequest(EventLoop & loop, ConnectionMap & conns, Connection & conn, long request_length)
+	{
+		Request & request = conn.request;
+		request = Request(currentTime(), conn.client_in, request_length);
+		conn.client_in.erase(conn.client_in.begin(), conn.client_in.begin() + request_length);
+		parser.parseRequest(request, conn.request_head);
+		conn.request_head.reset(); // a pipelined request starts at the beginning of client_in now
+		conn.timing.start();
+		if(isStatsRequest(request))
+		{
+			const std::string response = statsResponse();
+			conn.client_out.insert(conn.client_out.end(), response.begin(), response.end());
+			conn.persistent = true;
+			conn.state = Connection::WRITE_RESPONSE;
+			return;
+		}
+		countRequest(request);
+
+		// record request to log
+		std::string log_content = std::to_string(conn.client_id) + ": " + request.httpAction + " from " + conn.client_ip + " @ " + request.request_time;
+		logger.log(log_content);
+		log_content = std::to_string(conn.client_id) + ": Requesting " + request.first_line + " from " + request.url;
+		logger.log(log_content);
+
+		const std::string & httpAction = request.httpAction;
+		if(httpAction == "GET")
+		{
+			std::shared_ptr<const Response> cached;
+			std::vector<char> content_to_send;
+			CacheStatus cache_status = lookupCache(conn.client_id, request, cached, content_to_send);
+			conn.timing.lap(RequestTiming::CACHE);
+			conn.timing.outcome = outcomeName(cache_status);
+			if(cache_status == CACHE_FRESH)
+			{
+				queueCached(conn, cached);
+				conn.persistent = delimited(*cached);
+				conn.state = Connection::WRITE_RESPONSE;
+				return;
+			}
+
+			// concurrent misses and re-validations of the url share one fetch, unless the response may be for this client only
+			if(config.coalesce && !request.credentials)
+			{
+				Coalescer::Role role = coalescer.join(request.url, conn.client_id, conn.flight);
+				conn.flight_leader = role == Coalescer::LEADER;
+				if(role == Coalescer::FOLLOWER)
+				{
+					log_content = std::to_string(conn.client_id) + ": NOTE coalesced with request " + std::to_string(conn.flight->leader_id);
+					logger.log(log_content);
+
+					// the flight may be published from another loop, which wakes this loop up
+					int client_fd = conn.client_fd;
+					EventLoop * owner = &loop;
+					conn.flight->watch([owner, client_fd]
+					{
+						owner->post(client_fd);
+					});
+					conn.state = Connection::FOLLOW;
+					return;
+				}
+			}
+
+			if(cache_status == CACHE_REVALIDATE)
+			{
+				conn.revalidating = true;
+				conn.cached = cached; // kept for status code 304
+				conn.server_out.swap(content_to_send);
+			}
+			else
+			{
+				conn.server_out = request.content;
+			}
+		}
+		else if(httpAction == "POST" || httpAction == "CONNECT")
+		{
+			if(httpAction == "POST")
+			{
+				conn.server_out = request.content;
+			}
+			else
+			{
+				// the client may start the tunnel without waiting for 200 OK
+				conn.server_out.swap(conn.client_in);
+			}
+		}
+		else
+		{
+			throw ProxyException("Unknown HTTP request category");
+		}
+
+		connectServerAsync(loop, conns, conn);
+	}
+
+	// event-driven version of connectServer(), the connect completes in finishConnect()
+	// a connection from the upstream pool is ready at once, a GET sent on it is kept for retryServer()
+	// a name missing in the resolver cache is looked up in the background meanwhile the connection waits in RESOLVE,
+	// the lookup wakes the loop up and connecting starts over
+	void connectServerAsync(EventLoop & loop, ConnectionMap & conns, Connection & conn)
+	{
+		// a pooled connection skips the handshake, tunnels always get their own
+		const Request & request = conn.request;
+		bool poolable = upstream.enabled() && request.httpAction != "CONNECT";
+		conn.upstream_key = upstreamKey(request);
+		conn.upstream_pooled = false;
+		if(poolable && !conn.upstream_fresh)
+		{
+			int server_fd = upstream.checkout(conn.upstream_key);
+			if(server_fd != -1)
+			{
+				conn.timing.lap(RequestTiming::CONNECT);
+				metrics.add(Metrics::UPSTREAM_POOLED);
+				conn.server_fd = server_fd;
+				conn.upstream_pooled = true;
+				if(request.httpAction == "GET")
+				{
+					conn.upstream_retry = conn.server_out;
+				}
+				conns[conn.server_fd] = conns[conn.client_fd];
+				loop.add(conn.server_fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+				conn.state = Connection::FORWARD;
+				return;
+			}
+		}
+
+	    // get host information, the loop never waits for a lookup
+	    ServerAddress address;
+	    bool found = false;
+	    int client_fd = conn.client_fd;
+	    EventLoop * owner = &loop;
+	    if(!resolver.tryResolve(request.hostname, request.port, address, found, [owner, client_fd]
+	    {
+	    	owner->post(client_fd);
+	    }))
+	    {
+	    	conn.state = Connection::RESOLVE;
+	    	return;
+	    }
+	    if(!found)
+	    {
+	      	throw ProxyException("Connect server getaddrinfo error");
+	    }
+	    conn.timing.lap(RequestTiming::DNS); // a connection waiting in RESOLVE has come back here
+
+	    // create a non-blocking socket and start connecting
+	    conn.server_fd = socket(address.family, address.socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, address.protocol);
+	    if(conn.server_fd == -1)
+	    {
+	      	throw ProxyException("Connect server create socket error");
+	    }
+	    int res = connect(conn.server_fd, (struct sockaddr *)&address.addr, address.addr_len);
+	    if(res == -1 && errno != EINPROGRESS)
+	    {
+	      	throw ProxyException("Connect socket to server error");
+	    }
+	    conn.upstream_pooled = poolable && upstream.admit(conn.upstream_key);
+
+	    // the server fd is owned by the same connection
+	    conns[conn.server_fd] = conns[conn.client_fd];
+	    loop.add(conn.server_fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+	    conn.state = Connection::CONNECT_SERVER;
+	}
+
+	// called when the server fd is ready during CONNECT_SERVER
+	void finishConnect(Connection & conn, uint32_t events)
+	{
+		int err = 0;
+		socklen_t err_len = sizeof(err);
+		if(getsockopt(conn.server_fd, SOL_SOCKET, SO_ERROR, &err, &err_len) == -1 || err != 0)
+		{
+			throw ProxyException("Connect socket to server error");
+		}
+
+		// still connecting
+		struct sockaddr_storage peer;
+		socklen_t peer_len = sizeof(peer);
+		if(!(events & EPOLLOUT) || getpeername(conn.server_fd, (struct sockaddr *)&peer, &peer_len) == -1)
+		{
+			return;
+		}
+		conn.timing.lap(RequestTiming::CONNECT);
+		metrics.record(Metrics::CONNECT, conn.timing.get(RequestTiming::DNS) + conn.timing.get(RequestTiming::CONNECT));
+		metrics.add(Metrics::UPSTREAM_NEW);
+
+		if(conn.request.httpAction == "CONNECT")
+		{
+			const std::string okMsg = "HTTP/1.1 200 OK\r\n\r\n";
+			conn.client_out.insert(conn.client_out.end(), okMsg.begin(), okMsg.end());
+			openTunnelPipes(conn.tunnel_pipes);
+			conn.state = Connection::TUNNEL;
+		}
+		else
+		{
+			conn.state = Connection::FORWARD;
+		}
+	}
+
+	// respond with the cached response, its buffer is sent directly without copying
+	void queueCached(Connection & conn, const std::shared_ptr<const Response> & cached)
+	{
+		metrics.add(Metrics::BYTES_CACHE, cached->content.size());
+		conn.cached = cached;
+		conn.cached_sender.reset(cached->content.data(), cached->content.size());
+		if(config.zerocopy)
+		{
+			conn.cached_sender.enableZerocopy(conn.client_fd);
+		}
+	}
+
+	// send as many bytes of the cached response as the client accepts
+	// the response is released once it is sent and the kernel no longer reads it
+	// return true if any byte is sent
+	bool flushCached(Connection & conn)
+	{
+		bool progress = false;
+		while(!conn.cached_sender.done() && conn.cached_sender.sendSome(conn.client_fd) != -1)
+		{
+			progress = true;
+		}
+		conn.cached_sender.readCompletions(conn.client_fd);
+		if(conn.cached_sender.done() && !conn.cached_sender.pendingCompletions())
+		{
+			conn.cached.reset();
+		}
+		return progress;
+	}
+
+	// event-driven version of getResponse(): send request, receive response and relay it to client
+	// return true if there is progress
+	bool forwardResponse(EventLoop & loop, ConnectionMap & conns, Connection & conn)
+	{
+		bool progress = false;
+		try
+		{
+			progress = flushSome(conn.server_fd, conn.server_out, conn.server_out_off);
+		}
+		catch(ProxyException & e)
+		{
+			if(!retryServer(loop, conns, conn)) throw;
+			return true;
+		}
+		progress = flushSome(conn.client_fd, conn.client_out, conn.client_out_off) || progress;
+
+		// the client is slow, wait until it drains
+		if(conn.pendingClient() >= HIGH_WATER_MARK)
+		{
+			return progress;
+		}
+
+		std::vector<char> & buffer = conn.scratch;
+		buffer.clear();
+		int len = -1;
+		try
+		{
+			len = recvSome(conn.server_fd, buffer);
+		}
+		catch(ProxyException & e)
+		{
+			if(!retryServer(loop, conns, conn)) throw;
+			return true;
+		}
+		if(len == -1)
+		{
+			return progress;
+		}
+
+		// server closes the connection, which marks the end of response without length
+		if(len == 0)
+		{
+			if(retryServer(loop, conns, conn))
+			{
+				return true;
+			}
+			if(!conn.header_done || conn.content_length != -1 || conn.chunked)
+			{
+				throw ProxyException("Proxy received from server error");
+			}
+			completeResponse(loop, conns, conn, false);
+			return true;
+		}
+
+		// wait until the whole header arrives
+		long body_offset = 0; // where the body starts in buffer
+		if(!conn.header_done)
+		{
+			if(conn.header_buf.empty())
+			{
+				conn.timing.lap(RequestTiming::WAIT);
+				metrics.record(Metrics::FIRST_BYTE, conn.timing.get(RequestTiming::WAIT));
+			}
+			conn.header_buf.insert(conn.header_buf.end(), buffer.begin(), buffer.end());
+			HttpParser::Result res = conn.response_head.parse(conn.header_buf.data(), conn.header_buf.size());
+			if(res == HttpParser::ERROR)
+			{
+				throw ProxyException("Receive header error");
+			}
+			if(res == HttpParser::INCOMPLETE)
+			{
+				return true;
+			}
+			long header_length = conn.response_head.headerLength();
+			conn.header_done = true;
+			conn.header.assign(conn.header_buf.begin(), conn.header_buf.begin() + header_length);
+
+			if(conn.revalidating)
+			{
+				metrics.add(conn.response_head.status() == 304 ? Metrics::REVALIDATED_NOT_MODIFIED : Metrics::REVALIDATED_MODIFIED);
+			}
+
+			// status code 304 of the re-validation, respond with cached content
+			if(conn.revalidating && conn.response_head.status() == 304)
+			{
+				std::string first_line = parser.extractFirstLine(conn.header);
+				std::string log_content = std::to_string(conn.client_id) + ": Received " + first_line + " from " + conn.request.url;
+				logger.log(log_content);
+				log_content = std::to_string(conn.client_id) + ": Responding " + first_line;
+				logger.log(log_content);
+				if(conn.flight_leader)
+				{
+					conn.flight->finishCached(conn.cached);
+				}
+
+				// a 304 has no body, nothing may follow the header
+				releaseServer(loop, conns, conn, (long)conn.header_buf.size() == header_length && keepsAlive(conn.header.data(), conn.response_head));
+				queueCached(conn, conn.cached);
+				conn.persistent = delimited(*conn.cached);
+				conn.state = Connection::WRITE_RESPONSE;
+				return true;
+			}
+			conn.cached.reset(); // the server sends a new response instead
+			if(conn.flight_leader)
+			{
+				leadFlight(conn.flight.get(), conn.header.data(), conn.response_head);
+			}
+
+			conn.content_length = conn.response_head.contentLength();
+			conn.chunked = conn.response_head.chunked();
+
+			// the whole response fits into one allocation
+			if(conn.content_length != -1 && (size_t)header_length + conn.content_length <= config.max_object)
+			{
+				conn.body.reserve(header_length + conn.content_length);
+			}
+			buffer.swap(conn.header_buf);
+			body_offset = header_length;
+			conn.body_received = buffer.size() - header_length;
+		}
+		else
+		{
+			conn.body_received += len;
+		}
+
+		// relay to client and keep the bytes for cache
+		conn.client_out.insert(conn.client_out.end(), buffer.begin(), buffer.end());
+		metrics.add(Metrics::BYTES_ORIGIN, buffer.size());
+		if(conn.flight_leader)
+		{
+			conn.flight->publish(&buffer.data()[0], buffer.size());
+		}
+
+		// decide whether the response is complete
+		// the server fd may serve another request only if nothing follows the end of response
+		bool complete = false;
+		bool reusable = false;
+		if(conn.chunked)
+		{
+			// the header is kept as it is, the chunks decoded, which is done in place since the client has its copy
+			conn.kept_length += body_offset;
+			keepResponse(conn.body, conn.kept_length, &buffer.data()[0], body_offset);
+			size_t consumed = keepChunked(conn.decoder, conn.body, conn.kept_length,
+				&buffer.data()[0] + body_offset, buffer.size() - body_offset);
+			complete = conn.decoder.done();
+			reusable = complete && body_offset + consumed == buffer.size();
+		}
+		else
+		{
+			conn.kept_length += buffer.size();
+			keepResponse(conn.body, conn.kept_length, &buffer.data()[0], buffer.size());
+		}
+		if(conn.content_length != -1)
+		{
+			complete = conn.body_received >= conn.content_length;
+			reusable = conn.body_received == conn.content_length;
+		}
+		if(complete)
+		{
+			completeResponse(loop, conns, conn, reusable);
+		}
+		return true;
+	}
+
+	// event-driven version of the retry in fetchHeader(): an idle pooled server fd closed by the server right after
+	// the check in checkout() fails before the first byte of the response, the GET sent on it goes to a new connection
+	// return false if the request can't be retried
+	bool retryServer(EventLoop & loop, ConnectionMap & conns, Connection & conn)
+	{
+		if(conn.upstream_retry.empty() || conn.header_done || !conn.header_buf.empty())
+		{
+			return false;
+		}
+		std::string log_content = std::to_string(conn.client_id) + ": NOTE pooled server connection closed, retrying on a new one";
+		logger.log(log_content);
+		releaseServer(loop, conns, conn, false);
+		conn.server_out.swap(conn.upstream_retry);
+		conn.server_out_off = 0;
+		conn.upstream_retry.clear();
+		conn.upstream_fresh = true;
+		connectServerAsync(loop, conns, conn);
+		return true;
+	}
+
+	// reusable tells whether the response ended exactly where the server fd may serve another request
+	// then the client can tell the end as well
+	void completeResponse(EventLoop & loop, ConnectionMap & conns, Connection & conn, bool reusable)
+	{
+		reusable = reusable && keepsAlive(conn.header.data(), conn.response_head);
+		releaseServer(loop, conns, conn, reusable);
+		conn.timing.lap(RequestTiming::TRANSFER);
+		storeResponse(conn.client_id, conn.request.url, conn.header, conn.body, conn.request.httpAction, conn.kept_length > config.max_object,
+			conn.chunked);
+		conn.timing.lap(RequestTiming::CACHE);
+		if(conn.flight_leader)
+		{
+			conn.flight->finish(reusable);
+		}
+		conn.persistent = reusable;
+		conn.state = Connection::WRITE_RESPONSE;
+	}
+
+	// the server side of the connection is done, the server fd goes back to the upstream pool if reusable,
+	// otherwise it is closed, the client side goes on alone
+	void releaseServer(EventLoop & loop, ConnectionMap & conns, Connection & conn, bool reusable)
+	{
+		loop.remove(conn.server_fd);
+		conns.erase(conn.server_fd);
+		upstream.checkin(conn.upstream_key, conn.server_fd, conn.upstream_pooled, reusable);
+		conn.server_fd = -1;
+	}
+
+	// event-driven version of followFlight(), relay the bytes published by the leader
+	// return true if there is progress
+	bool followResponse(EventLoop & loop, ConnectionMap & conns, Connection & conn)
+	{
+		bool progress = flushSome(conn.client_fd, conn.client_out, conn.client_out_off);
+
+		// the client is slow, wait until it drains
+		if(conn.pendingClient() >= HIGH_WATER_MARK)
+		{
+			return progress;
+		}
+
+		std::vector<Flight::Chunk> chunks;
+		Flight::State state = conn.flight->take(conn.flight_next, chunks);
+		for(const Flight::Chunk & chunk : chunks)
+		{
+			conn.client_out.insert(conn.client_out.end(), chunk->begin(), chunk->end());
+			metrics.add(Metrics::BYTES_ORIGIN, chunk->size());
+		}
+		conn.flight_next += chunks.size();
+		progress = progress || !chunks.empty();
+
+		if(state == Flight::DONE || state == Flight::CACHED)
+		{
+			conn.timing.lap(RequestTiming::TRANSFER);
+			conn.timing.outcome = "coalesced";
+		}
+		if(state == Flight::DONE)
+		{
+			conn.persistent = conn.flight->isPersistent();
+			conn.flight.reset();
+			conn.state = Connection::WRITE_RESPONSE;
+			return true;
+		}
+		if(state == Flight::CACHED)
+		{
+			queueCached(conn, conn.flight->response());
+			conn.persistent = delimited(*conn.cached);
+			conn.flight.reset();
+			conn.state = Connection::WRITE_RESPONSE;
+			return true;
+		}
+		if(state == Flight::FAILED)
+		{
+			if(conn.flight_next > 0)
+			{
+				throw ProxyException("Coalesced request failed");
+			}
+
+			// the leader failed before responding, fetch on our own
+			std::string log_content = std::to_string(conn.client_id) + ": NOTE request " + std::to_string(conn.flight->leader_id) + " failed, fetching alone";
+			logger.log(log_content);
+			conn.flight.reset();
+			conn.server_out = conn.request.content;
+			connectServerAsync(loop, conns, conn);
+			return true;
+		}
+		return progress;
+	}
+
+	// relay one direction of a tunnel, from in_fd to out_fd
+	// bytes queued in out go first: the 200 OK, bytes received with the request, or every byte if the direction has no pipe
+	// once the sender closed and nothing is left, the close is passed on as a shutdown of out_fd's write half
+	// return true if there is progress
+	bool relayDirection(Connection & conn, int dir, int in_fd, int out_fd, std::vector<char> & out, size_t & off)
+	{
+		bool progress = flushSome(out_fd, out, off);
+		SplicePipe * pipe = conn.tunnel_pipes[dir].get();
+		size_t queued = out.size() - off;
+		while(pipe && queued == 0 && pipe->size() > 0 && pipe->drain(out_fd) > 0)
+		{
+			progress = true;
+		}
+
+		// read only while the other side keeps up
+		if(!conn.tunnel_eof[dir])
+		{
+			ssize_t len = -1;
+			if(pipe && !pipe->full())
+			{
+				len = pipe->fill(in_fd);
+			}
+			else if(!pipe && queued < HIGH_WATER_MARK)
+			{
+				len = recvSome(in_fd, out);
+			}
+			conn.tunnel_eof[dir] = len == 0;
+			progress = progress || len >= 0;
+		}
+
+		if(conn.tunnel_eof[dir] && !conn.tunnel_shut[dir] && out.size() == off && (!pipe || pipe->size() == 0))
+		{
+			shutdown(out_fd, SHUT_WR);
+			conn.tunnel_shut[dir] = true;
+			progress = true;
+		}
+		return progress;
+	}
+
+	// event-driven version of handleConnect(), relay bytes in both directions
+	// return true if there is progress
+	bool relayTunnel(Connection & conn)
+	{
+		bool progress = relayDirection(conn, 0, conn.client_fd, conn.server_fd, conn.server_out, conn.server_out_off);
+		progress = relayDirection(conn, 1, conn.server_fd, conn.client_fd, conn.client_out, conn.client_out_off) || progress;
+
+		// decide the end of CONNECT
+		if(conn.tunnel_shut[0] && conn.tunnel_shut[1])
+		{
+			std::string log_content = std::to_string(conn.client_id) + ": Tunnel closed";
+			logger.log(log_content);
+			conn.state = Connection::CLOSED;
+			return false;
+		}
+		return progress;
+	}
+
+	// run the state machine of the connection until no more progress can be made
+	void driveConnection(EventLoop & loop, ConnectionMap & conns, Connection & conn, int fd, uint32_t events)
+	{
+		// a tunnel hangs up once both halves are shut down, its own reads and writes report real errors
+		if(fd == conn.client_fd && (events & (EPOLLERR | EPOLLHUP)) && conn.state != Connection::TUNNEL)
+		{
+			// EPOLLERR also reports zerocopy completions in the error queue, which are not errors
+			int err = 0;
+			socklen_t err_len = sizeof(err);
+			if((events & EPOLLHUP) || !conn.cached_sender.pendingCompletions()
+				|| getsockopt(conn.client_fd, SOL_SOCKET, SO_ERROR, &err, &err_len) == -1 || err != 0)
+			{
+				throw ProxyException("Client connection error");
+			}
+		}
+		if(conn.state == Connection::CONNECT_SERVER && fd == conn.server_fd)
+		{
+			finishConnect(conn, events);
+		}
+
+		bool progress = true;
+		while(progress)
+		{
+			switch(conn.state)
+			{
+				case Connection::READ_REQUEST:
+					progress = readRequest(loop, conns, conn);
+					break;
+				case Connection::FORWARD:
+					progress = forwardResponse(loop, conns, conn);
+					break;
+				case Connection::FOLLOW:
+					progress = followResponse(loop, conns, conn);
+					break;
+				case Connection::RESOLVE:
+					connectServerAsync(loop, conns, conn);
+					progress = conn.state != Connection::RESOLVE;
+					break;
+				case Connection::TUNNEL:
+					progress = relayTunnel(conn);
+					break;
+				case Connection::WRITE_RESPONSE:
+					progress = flushSome(conn.client_fd, conn.client_out, conn.client_out_off);
+					if(conn.pendingClient() == 0 && conn.cached)
+					{
+						progress = flushCached(conn) || progress;
+					}
+					if(conn.pendingClient() == 0 && !conn.cached)
+					{
+						finishResponse(conn);
+						progress = true; // a pipelined request may be waiting in client_in
+					}
+					break;
+				default: // CONNECT_SERVER waits for the next event, CLOSED has nothing to do
+					progress = false;
+					break;
+			}
+		}
+	}
+
+	// the response is sent, wait for the next request of a kept-alive client, otherwise close
+	void finishResponse(Connection & conn)
+	{
+		if(!isStatsRequest(conn.request) && conn.request.httpAction != "CONNECT")
+		{
+			finishTiming(conn.client_id, conn.request, conn.timing);
+		}
+
+		// later requests for the url start a new flight, like a threaded leader leaving with its FlightGuard
+		if(conn.flight_leader && conn.flight)
+		{
+			coalescer.leave(conn.request.url, conn.flight);
+			conn.flight.reset();
+		}
+		if(!keepClient(conn.request, conn.persistent))
+		{
+			conn.state = Connection::CLOSED;
+			return;
+		}
+		conn.nextRequest(next_client_id.fetch_add(1) & INT_MAX);
+	}
+
+	// close the client connections which waited for a request longer than the idle timeout
+	void expireIdle(EventLoop & loop, ConnectionMap & conns)
+	{
+		std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() - std::chrono::seconds(config.client_idle_timeout);
+		std::vector<std::shared_ptr<Connection>> expired;
+		for(const auto & p : conns)
+		{
+			const Connection & conn = *p.second;
+			if(p.first == conn.client_fd && conn.state == Connection::READ_REQUEST && conn.read_since < deadline)
+			{
+				expired.push_back(p.second);
+			}
+		}
+		for(const std::shared_ptr<Connection> & conn : expired)
+		{
+			closeConnection(loop, conns, *conn);
+		}
+	}
+
+	// release both fds of the connection
+	void closeConnection(EventLoop & loop, ConnectionMap & conns, Connection & conn)
+	{
+		// followers of an unfinished response must not wait for it forever
+		if(conn.flight_leader && conn.flight)
+		{
+			coalescer.leave(conn.request.url, conn.flight);
+			conn.flight.reset();
+		}
+
+		// a server fd in the middle of a response can't be reused, but still counts against the upstream pool
+		if(conn.server_fd != -1)
+		{
+			releaseServer(loop, conns, conn, false);
+		}
+		loop.remove(conn.client_fd);
+		conns.erase(conn.client_fd);
+		close(conn.client_fd);
+	}
+
+	// main loop of an event loop thread
+	void runEventLoop(std::vector<int> loop_listen_fds)
+	{
+		try
+		{
+			EventLoop loop;
+			ConnectionMap conns;
+
+			// loops sharing a listening socket use EPOLLEXCLUSIVE, only one of them wakes up per connection
+			for(int listen_fd : loop_listen_fds)
+			{
+				loop.add(listen_fd, EPOLLIN | EPOLLET | EPOLLEXCLUSIVE);
+			}
+			dispatchEvents(loop_listen_fds, loop, conns);
+		}
+		catch(ProxyException & e)
+		{
+			std::cerr << e.what() << std::endl;
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	// wait for ready fds and drive the connections they belong to
+	void dispatchEvents(const std::vector<int> & loop_listen_fds, EventLoop & loop, ConnectionMap & conns)
+	{
+		// idle clients are looked for once per second
+		std::chrono::steady_clock::time_point last_expire = std::chrono::steady_clock::now();
+		while(true)
+		{
+			int n = loop.wait(config.client_idle_timeout > 0 ? 1000 : -1);
+			if(config.client_idle_timeout > 0 && std::chrono::steady_clock::now() - last_expire >= std::chrono::seconds(1))
+			{
+				expireIdle(loop, conns);
+				last_expire = std::chrono::steady_clock::now();
+			}
+			for(int i = 0; i < n; ++i)
+			{
+				const struct epoll_event & ev = loop.event(i);
+				int fd = ev.data.fd;
+				if(std::find(loop_listen_fds.begin(), loop_listen_fds.end(), fd) != loop_listen_fds.end())
+				{
+					acceptConnections(fd, loop, conns);
+					continue;
+				}
+
+				// fds posted by other threads, a posted fd may be closed or even reused meanwhile,
+				// driving a connection without a reason is harmless
+				if(fd == loop.wakeFd())
+				{
+					for(int posted : loop.takePosted())
+					{
+						handleEvent(loop, conns, posted, 0);
+					}
+					continue;
+				}
+				handleEvent(loop, conns, fd, ev.events);
+			}
+		}
+	}
+
+	void handleEvent(EventLoop & loop, ConnectionMap & conns, int fd, uint32_t events)
+	{
+		// the connection may be closed by an earlier event of the same round
+		ConnectionMap::iterator it = conns.find(fd);
+		if(it == conns.end())
+		{
+			return;
+		}
+		std::shared_ptr<Connection> conn = it->second;
+		try
+		{
+			driveConnection(loop, conns, *conn, fd, events);
+		}
+
+		// when an exception happens, write the exception into log and close the connection
+		catch(std::exception & e)
+		{
+			std::string errMsg(e.what());
+			std::string log_content = std::to_string(conn->client_id) + ": ERROR " + errMsg;
+			logger.log(log_content);
+			metrics.add(Metrics::REQUEST_ERRORS);
+			conn->state = Connection::CLOSED;
+		}
+		if(conn->state == Connection::CLOSED)
+		{
+			closeConnection(loop, conns, *conn);
+		}
+	}
+
+public:
+	Proxy(const Config & _config) : 
+		logger { "log.txt", _config.log_buffer, _config.log_block },
+		cache { _config.cache_size, _config.cache_shards, _config.cache_bytes, _config.max_object },
+		config { _config },
+		snapshot { _config.snapshot },
+		coalescer { _config.max_object },
+		upstream { (size_t)_config.upstream_idle, (size_t)_config.upstream_max, _config.upstream_idle_timeout },
+		resolver { (size_t)_config.dns_cache, _config.dns_ttl, _config.dns_negative_ttl },
+		next_client_id { 0 }
+	{
+		// error shouldn't happen in the constructor
+		// but if it does, release all the resouces allocated and exit the process
+		for(int i = 0; i < config.listeners; ++i)
+		{
+			listen_fds.push_back(constructServer());
+		}
+
+		// only event loops hand lookups to the resolver threads, thread mode looks names up in its workers
+		if(config.mode == Config::EVENT)
+		{
+			resolver.start();
+		}
+
+		// responses evicted from memory move down to disk
+		if(!config.disk_dir.empty())
+		{
+			try
+			{
+				disk.open(config.disk_dir, config.disk_bytes);
+			}
+			catch(ProxyException & e)
+			{
+				std::cerr << e.what() << std::endl;
+				exit(EXIT_FAILURE);
+			}
+			cache.setEvictCallback([this](const std::string & url, const std::shared_ptr<const Response> & response)
+			{
+				disk.store(url, response);
+			});
+		}
+
+		// start with the responses cached before the last shutdown, a broken snapshot only means a cold cache
+		if(!config.snapshot.empty())
+		{
+			try
+			{
+				size_t loaded = snapshot.load(cache);
+				logger.log("snapshot: " + std::to_string(loaded) + " responses loaded from " + config.snapshot);
+			}
+			catch(ProxyException & e)
+			{
+				logger.log("snapshot: ERROR " + std::string(e.what()));
+			}
+		}
+	}
+
+	~Proxy() noexcept
+	{
+		for(int fd : listen_fds)
+		{
+			close(fd);
+		}
+	}
+
+	// pin the thread to a cpu, the thread keeps running unpinned if it fails
+	static void pinThread(std::thread & thd, int cpu)
+	{
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(cpu % Config::cores(), &cpus);
+		pthread_setaffinity_np(thd.native_handle(), sizeof(cpu_set_t), &cpus);
+	}
+
+	void run()
+	{
+		std::thread saver(&Proxy::signalLoop, this);
+		saver.detach();
+		if(config.mode == Config::EVENT)
+		{
+			runEventLoops();
+		}
+		else
+		{
+			runThreads();
+		}
+	}
+
+	// EVENT mode: one event loop per core, the listening sockets are spread over the loops
+	void runEventLoops()
+	{
+		std::vector<std::thread> loops;
+		int N = listen_fds.size();
+		for(int i = 0; i < config.loops; ++i)
+		{
+			// every listener is owned by at least one loop, and every loop owns at least one listener
+			std::vector<int> loop_listen_fds;
+			for(int j = 0; j < N; ++j)
+			{
+				if(j % config.loops == i || j == i % N)
+				{
+					loop_listen_fds.push_back(listen_fds[j]);
+				}
+			}
+			loops.push_back(std::thread(&Proxy::runEventLoop, this, loop_listen_fds));
+			if(config.pin)
+			{
+				pinThread(loops.back(), i);
+			}
+		}
+		for(std::thread & thd : loops)
+		{
+			thd.join();
+		}
+	}
+
+	// THREAD mode: a fixed number of workers run handleRequest() for accepted connections
+	// connections beyond the workers wait in the admission queue, overload is handled by config.overload
+	void runThreads()
+	{
+		ThreadPool pool(config.workers, config.queue_size);
+		std::thread monitor(&Proxy::logPoolStats, this, std::ref(pool));
+		monitor.detach();
+
+		// every listening socket has its own acceptor
+		std::vector<std::thread> acceptors;
+		for(size_t i = 0; i < listen_fds.size(); ++i)
+		{
+			acceptors.push_back(std::thread(&Proxy::acceptLoop, this, listen_fds[i], std::ref(pool)));
+			if(config.pin)
+			{
+				pinThread(acceptors.back(), i);
+			}
+		}
+		for(std::thread & thd : acceptors)
+		{
+			thd.join();
+		}
+	}
+
+	// acceptor of THREAD mode
+	// (1) wait until an request of sending arrives
+	// (2) every time a client fd is caught, hand it to the pool
+	void acceptLoop(int listen_fd, ThreadPool & pool)
+	{
+		while(true)
+		{ 
+			std::string client_ip;
+			int client_fd = acceptConnection(listen_fd, client_ip);
+			if(client_fd == -1) // request error
+			{
+				continue;
+			}
+
+			// assign every request a unique id
+			int client_id = next_client_id.fetch_add(1) & INT_MAX;
+
+			std::function<void()> task = std::bind(&Proxy::handleRequest, this, client_id, client_fd, client_ip);
+			bool admitted = true;
+			if(config.overload == Config::BLOCK)
+			{
+				pool.submit(task);
+			}
+			else if(config.overload == Config::SHED)
+			{
+				admitted = pool.trySubmitIdle(task);
+			}
+			else
+			{
+				admitted = pool.trySubmit(task);
+			}
+			if(!admitted)
+			{
+				rejectOverload(client_id, client_fd);
+			}
+		}
+	}
+
+	// respond 503 to a client that cannot be admitted to the pool
+	void rejectOverload(int client_id, int client_fd)
+	{
+		const char * msg = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+		send(client_fd, msg, strlen(msg), MSG_NOSIGNAL | MSG_DONTWAIT);
+		close(client_fd);
+		std::string log_content = std::to_string(client_id) + ": Responding HTTP/1.1 503 Service Unavailable";
+		logger.log(log_content);
+	}
+
+	// save the snapshot now, a failure is only logged
+	void saveSnapshot()
+	{
+		try
+		{
+			size_t saved = snapshot.save(cache.entries());
+			logger.log("snapshot: " + std::to_string(saved) + " responses saved to " + config.snapshot);
+		}
+		catch(ProxyException & e)
+		{
+			logger.log("snapshot: ERROR " + std::string(e.what()));
+		}
+	}
+
+	// save the snapshot every snapshot_interval seconds, and a last time on SIGTERM/SIGINT before exiting
+	// the log lines not written yet are written before exiting as well
+	// both signals are blocked in every thread, so that this one receives them
+	void signalLoop()
+	{
+		sigset_t signals;
+		sigemptyset(&signals);
+		sigaddset(&signals, SIGTERM);
+		sigaddset(&signals, SIGINT);
+		while(true)
+		{
+			int sig = -1;
+			if(!config.snapshot.empty() && config.snapshot_interval > 0)
+			{
+				struct timespec timeout;
+				timeout.tv_sec = config.snapshot_interval;
+				timeout.tv_nsec = 0;
+				sig = sigtimedwait(&signals, NULL, &timeout);
+				if(sig == -1 && errno != EAGAIN)
+				{
+					continue;
+				}
+			}
+			else if(sigwait(&signals, &sig) != 0)
+			{
+				continue;
+			}
+
+			if(!config.snapshot.empty())
+			{
+				saveSnapshot();
+			}
+			if(sig == SIGTERM || sig == SIGINT)
+			{
+				logger.flush();
+				exit(EXIT_SUCCESS);
+			}
+		}
+	}
+
+	// write queue depth and wait time of the pool to log periodically
+	void logPoolStats(const ThreadPool & pool)
+	{
+		unsigned long long last_executed = 0;
+		unsigned long long last_rejected = 0;
+		while(true)
+		{
+			std::this_thread::sleep_for(std::chrono::seconds(POOL_STATS_INTERVAL));
+			ThreadPool::Stats stats = pool.stats();
+			if(stats.executed == last_executed && stats.rejected == last_rejected && stats.queued == 0)
+			{
+				continue;
+			}
+			last_executed = stats.executed;
+			last_rejected = stats.rejected;
+
+			double avg_wait_ms = stats.executed == 0 ? 0 : stats.total_wait_us / 1000.0 / stats.executed;
+			std::string log_content = "pool: " + std::to_string(stats.busy) + "/" + std::to_string(stats.workers) + " busy"
+									+ ", queued " + std::to_string(stats.queued) + "/" + std::to_string(stats.capacity)
+									+ ", executed " + std::to_string(stats.executed)
+									+ ", rejected " + std::to_string(stats.rejected)
+									+ ", stolen " + std::to_string(stats.stolen)
+									+ ", wait avg " + std::to_string(avg_wait_ms) + " ms"
+									+ ", max " + std::to_string(stats.max_wait_us / 1000.0) + " ms";
+			logger.log(log_content);
+		}
+	}
+};
+
+int main(int argc, char ** argv)
+{
+	Config config;
+	try
+	{
+		config.parse(argc, argv);
+	}
+	catch(ProxyException & e)
+	{
+		std::cerr << e.what() << std::endl << Config::usage() << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	// a client leaving in the middle of a response shouldn't kill the proxy
+	signal(SIGPIPE, SIG_IGN);
+
+	// shutdown signals go to the signal thread, every thread created from here on inherits the mask
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	Proxy proxy(config);
 	proxy.run();
 	return EXIT_SUCCESS;
 }
@@ -15,12 +15,20 @@ public:
 	std::string hostname;
 	std::string port; // 80 for HTTP, 443 for HTTPS
 	std::vector<char> content; // the complete http request from client
+	bool keep_alive; // the client keeps the connection for another request, read from the header by the parser
+	bool credentials; // carries Cookie or Authorization, read from the header by the parser
 
-	Request() {}
+	Request() :
+		keep_alive { false },
+		credentials { false }
+		{}
 
-	Request(const std::string & cur_time, std::vector<char> buffer, int len) :
+	// the request is the first len bytes of buffer, only those are copied
+	Request(const std::string & cur_time, const std::vector<char> & buffer, int len) :
 		request_time { cur_time },
-		content { std::vector<char>(buffer.begin(), buffer.begin() + len) }
+		content { std::vector<char>(buffer.begin(), buffer.begin() + len) },
+		keep_alive { false },
+		credentials { false }
 		{}
 
 	Request & operator=(const Request & rhs)
@@ -34,6 +42,8 @@ public:
 			hostname = rhs.hostname;
 			port = rhs.port;
 			content = rhs.content;
+			keep_alive = rhs.keep_alive;
+			credentials = rhs.credentials;
 		}
 		return *this;
 	}
@@ -0,0 +1,97 @@
+#ifndef REQUEST_TIMING_HPP__
+#define REQUEST_TIMING_HPP__
+
+#include <chrono>
+#include <string>
+#include <cstdio>
+
+// where the time of one request went
+// a monotonic timestamp is taken at every phase boundary, and the time since the previous boundary is added to the
+// phase which just ended, so the phases always add up to the total
+// reading the monotonic clock is a vDSO call without a syscall, cheap enough for every request, the metrics are
+// recorded from the same timestamps; only the line written to the log is sampled
+class RequestTiming
+{
+public:
+	enum Phase
+	{
+		CACHE, // looking up and storing the response in the cache, waiting for the locks of the cache included
+		DNS, // resolving the server name, a lookup cache hit included
+		CONNECT, // connecting to the server, or taking a connection from the upstream pool
+		WAIT, // from a connected server until the first byte of its response, sending the request included
+		TRANSFER, // from the first byte of the response until its last one, or relaying a coalesced response
+		DRAIN, // sending the response to the client after it is complete, a cached response is only sent here
+		PHASES
+	};
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	Clock::time_point begin; // the request is complete
+	Clock::time_point last; // the last phase boundary
+	Clock::duration spent[PHASES];
+
+	static const char * name(int phase)
+	{
+		static const char * names[PHASES] = { "cache", "dns", "connect", "wait", "transfer", "drain" };
+		return names[phase];
+	}
+
+	static long long micros(Clock::duration d)
+	{
+		return (long long)std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+	}
+
+public:
+	const char * outcome; // of the cache lookup, "-" for a request which is not looked up
+
+	RequestTiming()
+	{
+		start();
+	}
+
+	void start()
+	{
+		begin = last = Clock::now();
+		for(Clock::duration & d : spent)
+		{
+			d = Clock::duration::zero();
+		}
+		outcome = "-";
+	}
+
+	// a phase boundary, the time since the last one goes to phase
+	void lap(Phase phase)
+	{
+		Clock::time_point now = Clock::now();
+		spent[phase] += now - last;
+		last = now;
+	}
+
+	Clock::duration get(Phase phase) const
+	{
+		return spent[phase];
+	}
+
+	// until the last phase boundary
+	Clock::duration total() const
+	{
+		return last - begin;
+	}
+
+	// "outcome=miss cache_us=3 dns_us=0 ... total_us=2051"
+	std::string str() const
+	{
+		std::string res = std::string("outcome=") + outcome;
+		char field[48];
+		for(int phase = 0; phase < PHASES; ++phase)
+		{
+			snprintf(field, sizeof(field), " %s_us=%lld", name(phase), micros(spent[phase]));
+			res += field;
+		}
+		snprintf(field, sizeof(field), " total_us=%lld", micros(total()));
+		return res + field;
+	}
+};
+
+#endif
@@ -0,0 +1,286 @@
+#ifndef RESOLVER_HPP__
+#define RESOLVER_HPP__
+
+#include <deque>
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstring>
+#include <netdb.h>
+#include <functional>
+#include <unordered_map>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <condition_variable>
+#define RESOLVER_SHARDS 8 // independently locked parts of the resolver cache
+#define RESOLVER_THREADS 2 // threads running asynchronous lookups
+
+// address of a server, enough to create a socket and connect it
+struct ServerAddress
+{
+	int family;
+	int socktype;
+	int protocol;
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+};
+
+// cache of server name lookups, shared by all threads
+// answers are kept for ttl seconds, failed lookups for negative_ttl seconds, so a broken name isn't looked up per request
+// the cache is split into shards keyed by host:port, every shard has its own lock and holds a bounded number of answers
+// resolve() looks up a miss in the calling thread, tryResolve() hands it to background threads and never blocks,
+// concurrent misses of the same name share one lookup
+// the lookup itself is pluggable, getaddrinfo() by default
+class Resolver
+{
+public:
+	// look up host and port, return false if the name can't be resolved
+	typedef std::function<bool(const std::string & host, const std::string & port, ServerAddress & address)> Lookup;
+	typedef std::function<void()> Callback; // called from a resolver thread once an asynchronous lookup is done
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	struct Entry
+	{
+		bool found;
+		ServerAddress address;
+		Clock::time_point expiration;
+	};
+
+	struct Shard
+	{
+		std::mutex mtx;
+		size_t capacity;
+		std::unordered_map<std::string, Entry> entries; // key for host:port
+
+		explicit Shard(size_t _capacity) :
+			capacity { _capacity }
+			{}
+	};
+
+	Lookup lookup;
+	std::chrono::seconds ttl;
+	std::chrono::seconds negative_ttl;
+	std::vector<std::unique_ptr<Shard>> shards;
+
+	// asynchronous lookups
+	std::mutex mtx; // protects everything below
+	std::condition_variable not_empty;
+	std::deque<std::pair<std::string, std::string>> queue; // host and port waiting for a resolver thread
+	std::unordered_map<std::string, std::vector<Callback>> waiting; // callbacks of the lookups queued or running
+	bool stopping;
+	std::vector<std::thread> threads;
+
+	static std::string keyOf(const std::string & host, const std::string & port)
+	{
+		return host + ":" + port;
+	}
+
+	Shard & shardOf(const std::string & key)
+	{
+		return *shards[std::hash<std::string>()(key) % shards.size()];
+	}
+
+	// return false on a miss or an expired answer
+	bool find(const std::string & key, bool & found, ServerAddress & address)
+	{
+		Shard & shard = shardOf(key);
+		std::unique_lock<std::mutex> lck(shard.mtx);
+		std::unordered_map<std::string, Entry>::iterator it = shard.entries.find(key);
+		if(it == shard.entries.end() || it->second.expiration <= Clock::now())
+		{
+			return false;
+		}
+		found = it->second.found;
+		address = it->second.address;
+		return true;
+	}
+
+	// a full shard drops its expired answers first, then the answer closest to expiring
+	// a shard without room (fewer answers kept than shards) keeps nothing
+	void store(const std::string & key, bool found, const ServerAddress & address)
+	{
+		Entry entry;
+		entry.found = found;
+		entry.address = address;
+		entry.expiration = Clock::now() + (found ? ttl : negative_ttl);
+
+		Shard & shard = shardOf(key);
+		std::unique_lock<std::mutex> lck(shard.mtx);
+		if(shard.capacity == 0)
+		{
+			return;
+		}
+		if(shard.entries.size() >= shard.capacity && shard.entries.find(key) == shard.entries.end())
+		{
+			Clock::time_point now = Clock::now();
+			std::unordered_map<std::string, Entry>::iterator oldest = shard.entries.begin();
+			for(std::unordered_map<std::string, Entry>::iterator it = shard.entries.begin(); it != shard.entries.end(); )
+			{
+				if(it->second.expiration <= now)
+				{
+					it = shard.entries.erase(it);
+					oldest = shard.entries.begin();
+					continue;
+				}
+				if(it->second.expiration < oldest->second.expiration)
+				{
+					oldest = it;
+				}
+				++it;
+			}
+			if(shard.entries.size() >= shard.capacity)
+			{
+				shard.entries.erase(oldest);
+			}
+		}
+		shard.entries[key] = entry;
+	}
+
+	bool lookupAndStore(const std::string & host, const std::string & port, ServerAddress & address)
+	{
+		bool found = lookup(host, port, address);
+		store(keyOf(host, port), found, address);
+		return found;
+	}
+
+	void resolverLoop()
+	{
+		while(true)
+		{
+			std::pair<std::string, std::string> name;
+			{
+				std::unique_lock<std::mutex> lck(mtx);
+				while(!stopping && queue.empty())
+				{
+					not_empty.wait(lck);
+				}
+				if(stopping)
+				{
+					return;
+				}
+				name = queue.front();
+				queue.pop_front();
+			}
+
+			ServerAddress address;
+			lookupAndStore(name.first, name.second, address);
+
+			std::vector<Callback> callbacks;
+			{
+				std::unique_lock<std::mutex> lck(mtx);
+				std::unordered_map<std::string, std::vector<Callback>>::iterator it = waiting.find(keyOf(name.first, name.second));
+				callbacks.swap(it->second);
+				waiting.erase(it);
+			}
+			for(const Callback & callback : callbacks)
+			{
+				callback();
+			}
+		}
+	}
+
+public:
+	// capacity is the total number of answers kept, divided evenly among shards
+	// the first capacity % shards shards hold one answer more, so the shard capacities add up to capacity
+	Resolver(size_t capacity, int _ttl, int _negative_ttl, const Lookup & _lookup = systemLookup) :
+		lookup { _lookup },
+		ttl { _ttl },
+		negative_ttl { _negative_ttl },
+		stopping { false }
+	{
+		for(size_t i = 0; i < RESOLVER_SHARDS; ++i)
+		{
+			size_t capacity_of_shard = capacity / RESOLVER_SHARDS + (i < capacity % RESOLVER_SHARDS ? 1 : 0);
+			shards.push_back(std::unique_ptr<Shard>(new Shard(capacity_of_shard)));
+		}
+	}
+
+	Resolver(const Resolver &) = delete;
+	Resolver & operator=(const Resolver &) = delete;
+
+	// lookups in progress are waited for, their callbacks are dropped
+	~Resolver()
+	{
+		{
+			std::unique_lock<std::mutex> lck(mtx);
+			stopping = true;
+		}
+		not_empty.notify_all();
+		for(std::thread & thd : threads)
+		{
+			thd.join();
+		}
+	}
+
+	// the first address getaddrinfo() returns
+	static bool systemLookup(const std::string & host, const std::string & port, ServerAddress & address)
+	{
+		struct addrinfo host_info;
+		struct addrinfo * host_info_list;
+		memset(&host_info, 0, sizeof(host_info));
+		host_info.ai_family = AF_UNSPEC;
+		host_info.ai_socktype = SOCK_STREAM;
+		if(getaddrinfo(host.c_str(), port.c_str(), &host_info, &host_info_list) != 0)
+		{
+			return false;
+		}
+		address.family = host_info_list->ai_family;
+		address.socktype = host_info_list->ai_socktype;
+		address.protocol = host_info_list->ai_protocol;
+		memcpy(&address.addr, host_info_list->ai_addr, host_info_list->ai_addrlen);
+		address.addr_len = host_info_list->ai_addrlen;
+		freeaddrinfo(host_info_list);
+		return true;
+	}
+
+	// resolve host and port, looking up a miss in the calling thread
+	// return false if the name can't be resolved
+	bool resolve(const std::string & host, const std::string & port, ServerAddress & address)
+	{
+		bool found = false;
+		if(find(keyOf(host, port), found, address))
+		{
+			return found;
+		}
+		return lookupAndStore(host, port, address);
+	}
+
+	// start the threads which look up the misses of tryResolve(), must be called before it is used
+	void start()
+	{
+		for(int i = 0; i < RESOLVER_THREADS; ++i)
+		{
+			threads.push_back(std::thread(&Resolver::resolverLoop, this));
+		}
+	}
+
+	// resolve host and port without blocking
+	// return true if the answer is cached, found then tells whether the name can be resolved
+	// otherwise the name is looked up in the background and done is called once its answer is cached
+	bool tryResolve(const std::string & host, const std::string & port, ServerAddress & address, bool & found, const Callback & done)
+	{
+		const std::string key = keyOf(host, port);
+		if(find(key, found, address))
+		{
+			return true;
+		}
+
+		std::unique_lock<std::mutex> lck(mtx);
+		std::vector<Callback> & callbacks = waiting[key];
+		callbacks.push_back(done);
+		if(callbacks.size() == 1)
+		{
+			queue.push_back(std::make_pair(host, port));
+			lck.unlock();
+			not_empty.notify_one();
+		}
+		return false;
+	}
+};
+
+#endif
@@ -1,12 +1,15 @@
 #ifndef RESPONSE_HPP__
 #define RESPONSE_HPP__
 
+#include "ResponseBuffer.hpp"
+#include "HeaderMap.hpp"
 #include <ctime>
 #include <string>
 #include <vector>
 #include <cstring>
+#include <utility>
+#include <algorithm>
 #include <iostream>
-#include <unordered_map>
 
 class Response
 {
@@ -15,8 +18,8 @@ public:
 	std::string first_line; // used in first line
 	std::string url; // receive url from request
 	std::string header; // need to extract expiration related information from header
-	std::vector<std::vector<char>> content; // all the content response from server
-	std::unordered_map<std::string, std::string> kv; // k-v pair of the response header
+	ResponseBuffer content; // the complete response from server, header and body in one contiguous block
+	HeaderMap kv; // k-v pair of the response header, kept as spans into header
 
 	// several key attributes of the header
 	bool no_store;
@@ -38,11 +41,11 @@ public:
 		last_modified { 0 }
 		{} 
 
-	Response(const std::string _url, std::vector<std::vector<char>> buffer, const std::string h) : 
+	Response(const std::string _url, ResponseBuffer buffer, const std::string h) : 
 		status_code { -1 },
 		url { _url },
 		header { h },
-		content { buffer },
+		content { std::move(buffer) },
 		no_store { false }, // default can be stored in the cache
 		no_cache { false }, // default can be cached in the cache(need to check e-tag)
 		has_expiration { false }, // has expiration calculation machanism
@@ -72,6 +75,16 @@ public:
 		}
 		return *this;
 	}
+
+	// memory held by the response, used by the cache to account its byte budget
+	// heap blocks are counted by capacity
+	size_t footprint() const
+	{
+		size_t res = sizeof(Response) + first_line.capacity() + url.capacity() + header.capacity() + etag.capacity();
+		res += std::max(content.capacity(), content.size()); // a mapped response still takes its size of page cache
+		res += kv.footprint();
+		return res;
+	}
 };
 
 #endif
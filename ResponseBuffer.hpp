@@ -0,0 +1,214 @@
+#ifndef RESPONSE_BUFFER_HPP__
+#define RESPONSE_BUFFER_HPP__
+
+#include <memory>
+#include <cstring>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#define RESPONSE_BUFFER_MIN 65536 // first allocation when the length is unknown
+
+// contiguous storage of a complete response, header and body in one heap block
+// sized up front when the length is known, so keeping a response costs a single allocation
+// otherwise it grows by doubling, and shrink() trims the slack before the response is cached
+// unlike std::vector<char>, bytes are received straight into the spare room without zero filling it first
+// a buffer can also be a view into a read-only mapping of a file, used to serve responses of the disk cache
+// and of a snapshot without reading them, several buffers may share one mapping
+class ResponseBuffer
+{
+public:
+	typedef std::shared_ptr<const char> Mapping; // unmapped once the last buffer viewing it is gone
+
+private:
+	std::unique_ptr<char[]> buf;
+	size_t len; // bytes stored
+	size_t cap; // bytes allocated
+	Mapping mapping; // empty for heap storage
+	const char * mapped; // first byte of the response inside mapping
+
+	void unmap()
+	{
+		if(mapping)
+		{
+			mapping.reset();
+			mapped = NULL;
+			len = 0;
+		}
+	}
+
+	void reallocate(size_t new_cap)
+	{
+		std::unique_ptr<char[]> new_buf(new char[new_cap]);
+		if(len > 0)
+		{
+			memcpy(new_buf.get(), buf.get(), len);
+		}
+		buf.swap(new_buf);
+		cap = new_cap;
+	}
+
+public:
+	ResponseBuffer() :
+		len { 0 },
+		cap { 0 },
+		mapped { NULL }
+		{}
+
+	// a copy always lives on the heap, even if rhs is mapped
+	ResponseBuffer(const ResponseBuffer & rhs) :
+		len { 0 },
+		cap { 0 },
+		mapped { NULL }
+	{
+		append(rhs.data(), rhs.size());
+	}
+
+	ResponseBuffer(ResponseBuffer && rhs) :
+		buf { std::move(rhs.buf) },
+		len { rhs.len },
+		cap { rhs.cap },
+		mapping { std::move(rhs.mapping) },
+		mapped { rhs.mapped }
+	{
+		rhs.len = 0;
+		rhs.cap = 0;
+		rhs.mapped = NULL;
+	}
+
+	ResponseBuffer & operator=(ResponseBuffer rhs)
+	{
+		buf.swap(rhs.buf);
+		std::swap(len, rhs.len);
+		std::swap(cap, rhs.cap);
+		mapping.swap(rhs.mapping);
+		std::swap(mapped, rhs.mapped);
+		return *this;
+	}
+
+	const char * data() const
+	{
+		return mapping ? mapped : buf.get();
+	}
+
+	size_t size() const
+	{
+		return len;
+	}
+
+	// heap bytes allocated, a mapped buffer holds none
+	size_t capacity() const
+	{
+		return cap;
+	}
+
+	bool empty() const
+	{
+		return len == 0;
+	}
+
+	// make room for n bytes in total, exactly
+	void reserve(size_t n)
+	{
+		if(n > cap)
+		{
+			reallocate(n);
+		}
+	}
+
+	// spare room after the stored bytes, at least one byte
+	// receive into it, then commit() the received length
+	char * tail()
+	{
+		if(len == cap)
+		{
+			reallocate(std::max((size_t)RESPONSE_BUFFER_MIN, 2 * cap));
+		}
+		return buf.get() + len;
+	}
+
+	size_t spare() const
+	{
+		return cap - len;
+	}
+
+	void commit(size_t n)
+	{
+		len += n;
+	}
+
+	void append(const char * src, size_t n)
+	{
+		if(len + n > cap)
+		{
+			reallocate(std::max(len + n, 2 * cap));
+		}
+		memcpy(buf.get() + len, src, n);
+		len += n;
+	}
+
+	// give back the slack of a grown buffer, once nothing is appended anymore
+	void shrink()
+	{
+		if(cap - len > len / 8)
+		{
+			reallocate(len);
+		}
+	}
+
+	// drop the bytes and release the memory
+	void release()
+	{
+		unmap();
+		buf.reset();
+		len = 0;
+		cap = 0;
+	}
+
+	// map n bytes of the file starting at offset read-only, the result points at the first of them
+	// the mapping outlives the fd and the file name, so the file may be closed, unlinked or replaced afterwards
+	// return an empty mapping if the file cannot be mapped
+	static Mapping mapFile(int fd, off_t offset, size_t n)
+	{
+		off_t base = offset - offset % sysconf(_SC_PAGESIZE);
+		size_t map_len = n + (offset - base);
+		void * addr = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, base);
+		if(addr == MAP_FAILED)
+		{
+			return Mapping();
+		}
+		return Mapping((const char *)addr + (offset - base), [addr, map_len](const char *)
+		{
+			munmap(addr, map_len);
+		});
+	}
+
+	// view n bytes of a mapping, instead of holding them on the heap
+	void view(const Mapping & _mapping, const char * data, size_t n)
+	{
+		release();
+		mapping = _mapping;
+		mapped = data;
+		len = n;
+	}
+
+	// map n bytes of the file at offset on its own
+	// return false if the file cannot be mapped
+	bool map(int fd, off_t offset, size_t n)
+	{
+		release();
+		if(n == 0)
+		{
+			return true;
+		}
+		Mapping file = mapFile(fd, offset, n);
+		if(!file)
+		{
+			return false;
+		}
+		view(file, file.get(), n);
+		return true;
+	}
+};
+
+#endif
@@ -0,0 +1,187 @@
+#ifndef SEGMENT_SENDER_HPP__
+#define SEGMENT_SENDER_HPP__
+
+#include "ProxyException.hpp"
+#include <poll.h>
+#include <cerrno>
+#include <chrono>
+#include <vector>
+#include <climits>
+#include <cstring>
+#include <algorithm>
+#include <sys/uio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <linux/errqueue.h>
+#define ZEROCOPY_MIN 16384 // MSG_ZEROCOPY only pays off for large sends
+
+// send a cached response buffer, or any list of spans, with scatter-gather I/O, one sendmsg() covers up to IOV_MAX spans
+// optionally uses MSG_ZEROCOPY, the spans must then stay alive until every completion is read
+class SegmentSender
+{
+private:
+	std::vector<struct iovec> iov; // remaining spans, iov[idx] may be partially sent
+	size_t idx;
+	size_t remaining; // bytes not sent yet
+	bool zerocopy;
+	unsigned zc_sent; // sendmsg() calls with MSG_ZEROCOPY
+	unsigned zc_done; // completions read from the error queue
+
+	void advance(size_t len)
+	{
+		remaining -= len;
+		while(len > 0 && len >= iov[idx].iov_len)
+		{
+			len -= iov[idx].iov_len;
+			++idx;
+		}
+		if(len > 0)
+		{
+			iov[idx].iov_base = (char *)iov[idx].iov_base + len;
+			iov[idx].iov_len -= len;
+		}
+	}
+
+public:
+	SegmentSender() :
+		idx { 0 },
+		remaining { 0 },
+		zerocopy { false },
+		zc_sent { 0 },
+		zc_done { 0 }
+		{}
+
+	// start sending a contiguous buffer from the beginning
+	void reset(const char * data, size_t len)
+	{
+		clear();
+		addSpan(data, len);
+	}
+
+	// queue one more span behind the ones not sent yet
+	void addSpan(const char * data, size_t len)
+	{
+		if(len == 0) return;
+		struct iovec span;
+		span.iov_base = (void *)data;
+		span.iov_len = len;
+		iov.push_back(span);
+		remaining += len;
+	}
+
+	void clear()
+	{
+		iov.clear();
+		idx = 0;
+		remaining = 0;
+		zerocopy = false;
+		zc_sent = 0;
+		zc_done = 0;
+	}
+
+	// try to use MSG_ZEROCOPY on the socket, stays with copying sends if the kernel doesn't support it
+	void enableZerocopy(int fd)
+	{
+		int yes = 1;
+		zerocopy = remaining >= ZEROCOPY_MIN && setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &yes, sizeof(yes)) == 0;
+	}
+
+	bool done() const
+	{
+		return remaining == 0;
+	}
+
+	size_t remainingBytes() const
+	{
+		return remaining;
+	}
+
+	// true while the kernel may still read from the spans
+	bool pendingCompletions() const
+	{
+		return zc_done != zc_sent;
+	}
+
+	// one sendmsg() over as many remaining spans as allowed
+	// return bytes sent, -1 if the socket would block
+	ssize_t sendSome(int fd)
+	{
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov[idx];
+		msg.msg_iovlen = std::min(iov.size() - idx, (size_t)IOV_MAX);
+
+		bool use_zerocopy = zerocopy && remaining >= ZEROCOPY_MIN;
+		ssize_t len = -1;
+		while(true)
+		{
+			len = sendmsg(fd, &msg, MSG_NOSIGNAL | (use_zerocopy ? MSG_ZEROCOPY : 0));
+			if(len != -1) break;
+			if(errno == EINTR) continue;
+			if(errno == ENOBUFS && use_zerocopy)
+			{
+				// out of pinned memory for zerocopy, copy this time
+				use_zerocopy = false;
+				continue;
+			}
+			if(errno == EAGAIN || errno == EWOULDBLOCK) return -1;
+			throw ProxyException("Send with cached response error");
+		}
+		if(use_zerocopy)
+		{
+			++zc_sent;
+		}
+		advance(len);
+		return len;
+	}
+
+	// read zerocopy completions from the error queue of the socket, without blocking
+	void readCompletions(int fd)
+	{
+		while(pendingCompletions())
+		{
+			char control[128];
+			struct msghdr msg;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+			if(recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+			{
+				if(errno == EINTR) continue;
+				return;
+			}
+			for(struct cmsghdr * cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm))
+			{
+				struct sock_extended_err * serr = (struct sock_extended_err *)CMSG_DATA(cm);
+				if(serr->ee_errno == 0 && serr->ee_origin == SO_EE_ORIGIN_ZEROCOPY)
+				{
+					zc_done += serr->ee_data - serr->ee_info + 1; // completions of [ee_info, ee_data]
+				}
+			}
+		}
+	}
+
+	// block until every zerocopy completion is read, or the timeout (ms) passes
+	// return false on timeout
+	bool waitCompletions(int fd, int timeout)
+	{
+		std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+		readCompletions(fd);
+		while(pendingCompletions())
+		{
+			int left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+			if(left <= 0)
+			{
+				return false;
+			}
+			struct pollfd pfd;
+			pfd.fd = fd;
+			pfd.events = 0; // the error queue is reported as POLLERR
+			poll(&pfd, 1, left);
+			readCompletions(fd);
+		}
+		return true;
+	}
+};
+
+#endif
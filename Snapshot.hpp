@@ -0,0 +1,171 @@
+#ifndef SNAPSHOT_HPP__
+#define SNAPSHOT_HPP__
+
+#include "ProxyException.hpp"
+#include "Parser.hpp"
+#include "Response.hpp"
+#include "ResponseBuffer.hpp"
+#include "LRUCache.hpp"
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <utility>
+#include <fstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#define SNAPSHOT_MAGIC 0x31534348 // "HCS1"
+
+// binary snapshot of the cached responses, so that a restarted proxy starts with a warm cache
+// layout: a file header, then one record per response, least recently used first
+// record: a fixed record header, the url, the etag, the response header, then the raw response
+// loading maps the file once, the raw responses stay in the mapping and are only read from disk when served
+class Snapshot
+{
+private:
+	struct FileHeader
+	{
+		uint32_t magic;
+		uint32_t reserved;
+		uint64_t count; // number of records
+	};
+
+	struct RecordHeader
+	{
+		uint32_t url_length;
+		uint32_t etag_length;
+		uint64_t header_length;
+		uint64_t content_length;
+		int64_t cur_time; // when the response was received
+		int64_t expiration_time;
+		int64_t last_modified;
+	};
+
+	Parser parser;
+	std::string path;
+
+public:
+	explicit Snapshot(const std::string & _path) :
+		path { _path }
+		{}
+
+	// write the responses to a new file which then replaces the snapshot
+	// responses mapped from the old snapshot stay valid, the old file is only gone once they are
+	// return the number of responses written
+	size_t save(const std::vector<std::pair<std::string, std::shared_ptr<const Response>>> & entries)
+	{
+		const std::string tmp = path + ".tmp";
+		std::ofstream out(tmp, std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
+		if(!out.is_open())
+		{
+			throw ProxyException("Open snapshot error");
+		}
+
+		FileHeader head;
+		memset(&head, 0, sizeof(head));
+		head.magic = SNAPSHOT_MAGIC;
+		head.count = entries.size();
+		out.write((const char *)&head, sizeof(head));
+		for(const auto & p : entries)
+		{
+			const std::string & url = p.first;
+			const Response & response = *p.second;
+			RecordHeader record;
+			memset(&record, 0, sizeof(record));
+			record.url_length = url.size();
+			record.etag_length = response.etag.size();
+			record.header_length = response.header.size();
+			record.content_length = response.content.size();
+			record.cur_time = response.cur_time;
+			record.expiration_time = response.expiration_time;
+			record.last_modified = response.last_modified;
+			out.write((const char *)&record, sizeof(record));
+			out.write(url.data(), url.size());
+			out.write(response.etag.data(), response.etag.size());
+			out.write(response.header.data(), response.header.size());
+			out.write(response.content.data(), response.content.size());
+		}
+		out.close();
+		if(out.fail() || rename(tmp.c_str(), path.c_str()) == -1)
+		{
+			unlink(tmp.c_str());
+			throw ProxyException("Write snapshot error");
+		}
+		return entries.size();
+	}
+
+	// put every response of the snapshot into cache, a missing snapshot is an empty one
+	// a truncated snapshot is loaded up to its last complete record
+	// return the number of responses loaded
+	size_t load(LRUCache & cache)
+	{
+		int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if(fd == -1)
+		{
+			return 0;
+		}
+		struct stat st;
+		if(fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(FileHeader))
+		{
+			close(fd);
+			return 0;
+		}
+		size_t file_bytes = st.st_size;
+		ResponseBuffer::Mapping file = ResponseBuffer::mapFile(fd, 0, file_bytes);
+		close(fd);
+		if(!file)
+		{
+			throw ProxyException("Map snapshot error");
+		}
+
+		const char * base = file.get();
+		FileHeader head;
+		memcpy(&head, base, sizeof(head));
+		if(head.magic != SNAPSHOT_MAGIC)
+		{
+			throw ProxyException("Invalid snapshot");
+		}
+
+		size_t loaded = 0;
+		size_t off = sizeof(head);
+		for(uint64_t i = 0; i < head.count && off + sizeof(RecordHeader) <= file_bytes; ++i)
+		{
+			RecordHeader record;
+			memcpy(&record, base + off, sizeof(record));
+			off += sizeof(record);
+			size_t record_bytes = (size_t)record.url_length + record.etag_length + record.header_length + record.content_length;
+			if(record_bytes > file_bytes - off)
+			{
+				break;
+			}
+			const std::string url(base + off, record.url_length);
+			off += record.url_length;
+			const std::string etag(base + off, record.etag_length);
+			off += record.etag_length;
+			const std::string header(base + off, record.header_length);
+			off += record.header_length;
+			ResponseBuffer content;
+			content.view(file, base + off, record.content_length);
+			off += record.content_length;
+
+			// the header map is rebuilt, freshness comes from the snapshot
+			std::shared_ptr<Response> response = std::make_shared<Response>(url, std::move(content), header);
+			response->cur_time = record.cur_time;
+			parser.parseResponse(*response);
+			response->expiration_time = record.expiration_time;
+			response->last_modified = record.last_modified;
+			response->etag = etag;
+			if(cache.put(url, response))
+			{
+				++loaded;
+			}
+		}
+		return loaded;
+	}
+};
+
+#endif
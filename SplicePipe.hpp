@@ -0,0 +1,105 @@
+#ifndef SPLICE_PIPE_HPP__
+#define SPLICE_PIPE_HPP__
+
+#include "ProxyException.hpp"
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+// one direction of a tunnel, bytes move from a socket into a pipe and from the pipe into the other socket with splice(),
+// so they are never copied into user space
+// the pipe holds the bytes the other socket hasn't taken yet, at most capacity() of them
+class SplicePipe
+{
+private:
+	int read_fd;
+	int write_fd;
+	size_t pending; // bytes in the pipe
+	size_t capacity_bytes;
+
+public:
+	SplicePipe() :
+		read_fd { -1 },
+		write_fd { -1 },
+		pending { 0 },
+		capacity_bytes { 0 }
+		{}
+
+	SplicePipe(const SplicePipe &) = delete;
+	SplicePipe & operator=(const SplicePipe &) = delete;
+
+	~SplicePipe()
+	{
+		if(read_fd != -1)
+		{
+			close(read_fd);
+			close(write_fd);
+		}
+	}
+
+	// create the pipe, asking for size bytes of room
+	// return false if no pipe can be created, the tunnel then copies through user space
+	bool open(size_t size)
+	{
+		int fds[2];
+		if(pipe2(fds, O_NONBLOCK | O_CLOEXEC) == -1)
+		{
+			return false;
+		}
+		read_fd = fds[0];
+		write_fd = fds[1];
+		fcntl(write_fd, F_SETPIPE_SZ, (int)size); // the default size is kept if the limit is lower
+		int res = fcntl(write_fd, F_GETPIPE_SZ);
+		capacity_bytes = res > 0 ? res : 65536;
+		return true;
+	}
+
+	size_t size() const
+	{
+		return pending;
+	}
+
+	bool full() const
+	{
+		return pending >= capacity_bytes;
+	}
+
+	// move bytes available on fd into the pipe
+	// return bytes moved, 0 for EOF, -1 if fd has nothing now
+	ssize_t fill(int fd)
+	{
+		while(true)
+		{
+			ssize_t len = splice(fd, NULL, write_fd, NULL, capacity_bytes - pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if(len >= 0)
+			{
+				pending += len;
+				return len;
+			}
+			if(errno == EINTR) continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK) return -1;
+			throw ProxyException("Tunnel splice from socket error");
+		}
+	}
+
+	// move bytes of the pipe into fd
+	// return bytes moved, -1 if fd takes nothing now
+	ssize_t drain(int fd)
+	{
+		while(true)
+		{
+			ssize_t len = splice(read_fd, NULL, fd, NULL, pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if(len >= 0)
+			{
+				pending -= len;
+				return len;
+			}
+			if(errno == EINTR) continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK) return -1;
+			throw ProxyException("Tunnel splice to socket error");
+		}
+	}
+};
+
+#endif
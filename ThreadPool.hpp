@@ -0,0 +1,254 @@
+#ifndef THREAD_POOL_HPP__
+#define THREAD_POOL_HPP__
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+
+// fixed-size worker pool with a bounded admission queue
+// every worker owns a deque, tasks are distributed round-robin and idle workers steal from the others
+class ThreadPool
+{
+public:
+	// snapshot of the pool, used to size the pool and the queue
+	struct Stats
+	{
+		size_t workers;
+		size_t capacity;
+		size_t queued; // tasks waiting for a worker
+		size_t busy; // workers running a task
+		unsigned long long executed;
+		unsigned long long rejected;
+		unsigned long long stolen;
+		unsigned long long total_wait_us; // time spent in the queue, summed over executed tasks
+		unsigned long long max_wait_us;
+	};
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	struct Task
+	{
+		std::function<void()> func;
+		Clock::time_point enqueue_time;
+	};
+
+	struct Worker
+	{
+		std::mutex mtx;
+		std::deque<Task> tasks;
+	};
+
+	size_t capacity;
+	std::vector<std::unique_ptr<Worker>> workers;
+	std::vector<std::thread> threads;
+
+	// idle workers and blocked submitters sleep on these
+	std::mutex mtx;
+	std::condition_variable not_empty;
+	std::condition_variable not_full;
+	bool stopping;
+
+	std::atomic<size_t> queued;
+	std::atomic<size_t> busy;
+	std::atomic<size_t> next; // round-robin index of the next worker
+	std::atomic<unsigned long long> executed;
+	std::atomic<unsigned long long> rejected;
+	std::atomic<unsigned long long> stolen;
+	std::atomic<unsigned long long> total_wait_us;
+	std::atomic<unsigned long long> max_wait_us;
+
+	// take a task from the front of own deque, or steal from the back of another deque
+	bool takeTask(size_t idx, Task & task)
+	{
+		size_t N = workers.size();
+		for(size_t i = 0; i < N; ++i)
+		{
+			Worker & worker = *workers[(idx + i) % N];
+			std::unique_lock<std::mutex> lck(worker.mtx);
+			if(worker.tasks.empty())
+			{
+				continue;
+			}
+			if(i == 0)
+			{
+				task = std::move(worker.tasks.front());
+				worker.tasks.pop_front();
+			}
+			else
+			{
+				task = std::move(worker.tasks.back());
+				worker.tasks.pop_back();
+				++stolen;
+			}
+			return true;
+		}
+		return false;
+	}
+
+	void recordWait(const Task & task)
+	{
+		unsigned long long wait = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - task.enqueue_time).count();
+		total_wait_us += wait;
+		unsigned long long cur = max_wait_us.load();
+		while(wait > cur && !max_wait_us.compare_exchange_weak(cur, wait)) {}
+	}
+
+	void workerLoop(size_t idx)
+	{
+		while(true)
+		{
+			Task task;
+			if(!takeTask(idx, task))
+			{
+				std::unique_lock<std::mutex> lck(mtx);
+				while(!stopping && queued.load() == 0)
+				{
+					not_empty.wait(lck);
+				}
+				if(stopping && queued.load() == 0)
+				{
+					return;
+				}
+				continue;
+			}
+
+			--queued;
+			++busy;
+			not_full.notify_one();
+			recordWait(task);
+			task.func();
+			--busy;
+			++executed;
+		}
+	}
+
+	void push(std::function<void()> && func)
+	{
+		Worker & worker = *workers[next.fetch_add(1) % workers.size()];
+		{
+			std::unique_lock<std::mutex> lck(worker.mtx);
+			Task task;
+			task.func = std::move(func);
+			task.enqueue_time = Clock::now();
+			worker.tasks.push_back(std::move(task));
+		}
+		std::unique_lock<std::mutex> lck(mtx);
+		not_empty.notify_one();
+	}
+
+public:
+	ThreadPool(size_t num_workers, size_t _capacity) :
+		capacity { _capacity },
+		stopping { false },
+		queued { 0 },
+		busy { 0 },
+		next { 0 },
+		executed { 0 },
+		rejected { 0 },
+		stolen { 0 },
+		total_wait_us { 0 },
+		max_wait_us { 0 }
+	{
+		for(size_t i = 0; i < num_workers; ++i)
+		{
+			workers.push_back(std::unique_ptr<Worker>(new Worker()));
+		}
+		for(size_t i = 0; i < num_workers; ++i)
+		{
+			threads.push_back(std::thread(&ThreadPool::workerLoop, this, i));
+		}
+	}
+
+	ThreadPool(const ThreadPool &) = delete;
+	ThreadPool & operator=(const ThreadPool &) = delete;
+
+	// finish queued tasks, then join every worker
+	~ThreadPool()
+	{
+		{
+			std::unique_lock<std::mutex> lck(mtx);
+			stopping = true;
+		}
+		not_empty.notify_all();
+		for(std::thread & thd : threads)
+		{
+			thd.join();
+		}
+	}
+
+	// enqueue the task if there is room in the queue, false if the queue is full
+	bool trySubmit(std::function<void()> func)
+	{
+		size_t cur = queued.load();
+		do
+		{
+			if(cur >= capacity)
+			{
+				++rejected;
+				return false;
+			}
+		} while(!queued.compare_exchange_weak(cur, cur + 1));
+		push(std::move(func));
+		return true;
+	}
+
+	// enqueue the task only if a worker is idle to pick it up immediately
+	bool trySubmitIdle(std::function<void()> func)
+	{
+		size_t cur = queued.load();
+		do
+		{
+			if(cur + busy.load() >= workers.size())
+			{
+				++rejected;
+				return false;
+			}
+		} while(!queued.compare_exchange_weak(cur, cur + 1));
+		push(std::move(func));
+		return true;
+	}
+
+	// enqueue the task, block the caller until there is room in the queue
+	void submit(std::function<void()> func)
+	{
+		size_t cur = queued.load();
+		while(true)
+		{
+			if(cur >= capacity)
+			{
+				std::unique_lock<std::mutex> lck(mtx);
+				not_full.wait_for(lck, std::chrono::milliseconds(10), [this] { return queued.load() < capacity; });
+				cur = queued.load();
+			}
+			else if(queued.compare_exchange_weak(cur, cur + 1))
+			{
+				break;
+			}
+		}
+		push(std::move(func));
+	}
+
+	Stats stats() const
+	{
+		Stats res;
+		res.workers = workers.size();
+		res.capacity = capacity;
+		res.queued = queued.load();
+		res.busy = busy.load();
+		res.executed = executed.load();
+		res.rejected = rejected.load();
+		res.stolen = stolen.load();
+		res.total_wait_us = total_wait_us.load();
+		res.max_wait_us = max_wait_us.load();
+		return res;
+	}
+};
+
+#endif
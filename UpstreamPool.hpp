@@ -0,0 +1,196 @@
+#ifndef UPSTREAM_POOL_HPP__
+#define UPSTREAM_POOL_HPP__
+
+#include <deque>
+#include <mutex>
+#include <cerrno>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+// idle keep-alive connections to servers, keyed by host:port and shared by all threads
+// a server connection is pooled if it belongs to the first max_total connections of its host,
+// connections beyond that serve one response and are closed
+// an idle connection is not registered with any event loop, whoever checks it out owns it
+// idle connections expire after idle_timeout, and are checked on checkout for a close by the server
+class UpstreamPool
+{
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	struct Idle
+	{
+		int fd;
+		Clock::time_point since;
+	};
+
+	struct Host
+	{
+		std::deque<Idle> idle; // most recently released at the back
+		size_t total; // pooled connections, idle or in use
+		Host() : total { 0 } {}
+	};
+
+	std::mutex mtx;
+	std::unordered_map<std::string, Host> hosts;
+	size_t max_idle; // idle connections per host
+	size_t max_total; // pooled connections per host
+	std::chrono::seconds idle_timeout;
+	Clock::time_point last_sweep;
+
+	// the server closes an idle connection by sending FIN, and never sends data unasked
+	static bool healthy(int fd)
+	{
+		char c;
+		ssize_t len = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+		return len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+	}
+
+	// drop expired idle connections of every host, at most once per second
+	// fds to close are collected, so that close() happens outside the lock
+	void sweep(Clock::time_point now, std::vector<int> & to_close)
+	{
+		if(now - last_sweep < std::chrono::seconds(1))
+		{
+			return;
+		}
+		last_sweep = now;
+		for(auto it = hosts.begin(); it != hosts.end(); )
+		{
+			Host & host = it->second;
+			while(!host.idle.empty() && now - host.idle.front().since > idle_timeout)
+			{
+				to_close.push_back(host.idle.front().fd);
+				host.idle.pop_front();
+				--host.total;
+			}
+			if(host.total == 0)
+			{
+				it = hosts.erase(it);
+			}
+			else
+			{
+				++it;
+			}
+		}
+	}
+
+	static void closeAll(const std::vector<int> & to_close)
+	{
+		for(int fd : to_close)
+		{
+			close(fd);
+		}
+	}
+
+public:
+	UpstreamPool(size_t _max_idle, size_t _max_total, int _idle_timeout) :
+		max_idle { _max_idle },
+		max_total { _max_total },
+		idle_timeout { _idle_timeout },
+		last_sweep { Clock::now() }
+		{}
+
+	UpstreamPool(const UpstreamPool &) = delete;
+	UpstreamPool & operator=(const UpstreamPool &) = delete;
+
+	~UpstreamPool()
+	{
+		for(auto & p : hosts)
+		{
+			for(const Idle & idle : p.second.idle)
+			{
+				close(idle.fd);
+			}
+		}
+	}
+
+	bool enabled() const
+	{
+		return max_idle > 0;
+	}
+
+	// take a healthy idle connection to key, -1 if there is none
+	// the most recently released connection goes first, it is the least likely to be closed by the server
+	int checkout(const std::string & key)
+	{
+		std::vector<int> to_close;
+		int fd = -1;
+		while(fd == -1)
+		{
+			{
+				std::unique_lock<std::mutex> lck(mtx);
+				Clock::time_point now = Clock::now();
+				sweep(now, to_close);
+				std::unordered_map<std::string, Host>::iterator it = hosts.find(key);
+				if(it == hosts.end() || it->second.idle.empty())
+				{
+					break;
+				}
+				Host & host = it->second;
+				Idle idle = host.idle.back();
+				host.idle.pop_back();
+				if(now - idle.since > idle_timeout || !healthy(idle.fd))
+				{
+					to_close.push_back(idle.fd);
+					--host.total;
+					continue;
+				}
+				fd = idle.fd;
+			}
+		}
+		closeAll(to_close);
+		return fd;
+	}
+
+	// a new connection to key is made, return true if it is pooled, which has to be passed to checkin()
+	bool admit(const std::string & key)
+	{
+		std::unique_lock<std::mutex> lck(mtx);
+		Host & host = hosts[key];
+		if(host.total >= max_total)
+		{
+			return false;
+		}
+		++host.total;
+		return true;
+	}
+
+	// give back a connection after a response, it becomes idle if pooled and reusable, otherwise it is closed
+	// a connection from checkout() is always pooled
+	void checkin(const std::string & key, int fd, bool pooled, bool reusable)
+	{
+		std::vector<int> to_close;
+		{
+			std::unique_lock<std::mutex> lck(mtx);
+			sweep(Clock::now(), to_close);
+			if(pooled)
+			{
+				Host & host = hosts[key];
+				if(reusable && host.idle.size() < max_idle)
+				{
+					Idle idle;
+					idle.fd = fd;
+					idle.since = Clock::now();
+					host.idle.push_back(idle);
+					fd = -1;
+				}
+				else
+				{
+					--host.total;
+				}
+			}
+		}
+		if(fd != -1)
+		{
+			to_close.push_back(fd);
+		}
+		closeAll(to_close);
+	}
+};
+
+#endif
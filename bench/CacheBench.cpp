@@ -0,0 +1,105 @@
+// contention benchmark of LRUCache
+// compares one globally locked cache (1 shard) against the sharded cache
+// every thread runs a get/put mix on a shared key set, output is ops/sec per thread count
+#include "../LRUCache.hpp"
+#include "../Response.hpp"
+#include <atomic>
+#include <memory>
+#include <chrono>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+
+#define GET_RATIO 90 // percentage of get among all operations
+#define DURATION_MS 500
+
+static std::vector<std::string> urls;
+static int num_keys = 10000;
+static int capacity = 8192; // smaller than the key set, so puts keep evicting
+
+// run the mix on the cache with the given number of threads, return ops/sec
+static double runMix(LRUCache & cache, const std::shared_ptr<const Response> & value, int num_threads)
+{
+	std::atomic<bool> start { false };
+	std::atomic<bool> stop { false };
+	std::vector<unsigned long long> ops(num_threads, 0);
+	std::vector<std::thread> threads;
+	for(int t = 0; t < num_threads; ++t)
+	{
+		threads.push_back(std::thread([&, t]
+		{
+			std::mt19937 rng(t + 1);
+			std::uniform_int_distribution<int> key(0, num_keys - 1);
+			std::uniform_int_distribution<int> pct(0, 99);
+			unsigned long long cnt = 0;
+			while(!start.load()) {}
+			while(!stop.load())
+			{
+				const std::string & url = urls[key(rng)];
+				if(pct(rng) < GET_RATIO)
+				{
+					std::shared_ptr<const Response> response;
+					cache.tryGet(url, response);
+				}
+				else
+				{
+					cache.put(url, value);
+				}
+				++cnt;
+			}
+			ops[t] = cnt;
+		}));
+	}
+
+	std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+	start = true;
+	std::this_thread::sleep_for(std::chrono::milliseconds(DURATION_MS));
+	stop = true;
+	for(std::thread & thd : threads)
+	{
+		thd.join();
+	}
+	double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+	unsigned long long total = 0;
+	for(unsigned long long cnt : ops)
+	{
+		total += cnt;
+	}
+	return total / secs;
+}
+
+int main(int argc, char ** argv)
+{
+	int max_threads = argc > 1 ? atoi(argv[1]) : 2 * std::thread::hardware_concurrency();
+	int shards = argc > 2 ? atoi(argv[2]) : 16;
+	if(argc > 3) num_keys = atoi(argv[3]);
+	if(max_threads <= 0) max_threads = 1;
+	if(num_keys <= 0) num_keys = 1;
+	capacity = num_keys - num_keys / 5;
+	if(capacity <= 0) capacity = 1;
+
+	for(int i = 0; i < num_keys; ++i)
+	{
+		urls.push_back("http://bench.example.com/object/" + std::to_string(i));
+	}
+
+	// small response, so that the benchmark measures locking rather than copying
+	ResponseBuffer content;
+	content.append(std::string(512, 'x').data(), 512);
+	std::shared_ptr<const Response> value = std::make_shared<Response>("http://bench.example.com/", content, "HTTP/1.1 200 OK\r\nContent-Length: 512\r\n\r\n");
+
+	printf("%-8s %16s %16s %8s\n", "threads", "global ops/s", "sharded ops/s", "speedup");
+	for(int num_threads = 1; num_threads <= max_threads; num_threads *= 2)
+	{
+		LRUCache global(capacity, 1);
+		LRUCache sharded(capacity, shards);
+		double global_ops = runMix(global, value, num_threads);
+		double sharded_ops = runMix(sharded, value, num_threads);
+		printf("%-8d %16.0f %16.0f %7.2fx\n", num_threads, global_ops, sharded_ops, sharded_ops / global_ops);
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,636 @@
+// end-to-end load benchmark of the proxy on loopback
+// a local origin server runs in this process and serves three kinds of objects:
+//   /hit/N         Cache-Control: max-age=3600, fresh in the proxy cache once fetched
+//   /revalidate/N  Cache-Control: no-cache with an ETag, re-validated by the proxy every time, the origin answers 304
+//   /miss/N        Cache-Control: no-store, fetched from the origin every time
+// client threads send requests through the proxy over kept-alive connections, one at a time (closed loop),
+// each picks the kind by --hit / --revalidate (percent, misses take the rest) and the object by a Zipfian distribution
+// the proxy is started from --proxy with --proxy-args unless --pid names one already listening on 5555
+// output is req/s, p50/p99/p999 latency, CPU time of the proxy per request (from /proc/PID/stat), and the hit ratio:
+// the share of requests the origin sent no body for (fresh hits and 304s), measured for --duration seconds after
+// --warmup seconds
+#include "../HttpParser.hpp"
+#include "../ChunkedDecoder.hpp"
+#include <cmath>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#define PROXY_PORT 5555
+#define IO_SIZE (64 << 10)
+#define CHUNK_SIZE 4096 // of chunked responses
+#define LAST_MODIFIED "Mon, 01 Jan 2024 00:00:00 GMT"
+
+enum Kind
+{
+	HIT,
+	REVALIDATE,
+	MISS,
+	KINDS
+};
+
+static const char * kind_names[KINDS] = { "hit", "revalidate", "miss" };
+
+struct Options
+{
+	int threads;
+	double duration; // seconds measured
+	double warmup; // seconds before, not measured
+	int objects; // per kind
+	double zipf; // exponent of the Zipfian distribution
+	int hit; // percent of requests for fresh objects
+	int revalidate; // percent of requests for objects re-validated every time
+	size_t min_size; // bodies are sized log-uniformly between min_size and max_size, fixed per object
+	size_t max_size;
+	int chunked; // percent of objects sent chunked
+	int origin_delay; // milliseconds the origin waits before every response
+	std::string proxy; // the proxy binary started
+	std::string proxy_args; // its options, separated by spaces
+	int pid; // a running proxy instead, 0 for none
+
+	Options() :
+		threads { 8 },
+		duration { 10 },
+		warmup { 2 },
+		objects { 200 },
+		zipf { 0.99 },
+		hit { 80 },
+		revalidate { 0 },
+		min_size { 4096 },
+		max_size { 4096 },
+		chunked { 0 },
+		origin_delay { 0 },
+		proxy { "./proxy" },
+		pid { 0 }
+		{}
+};
+
+static Options options;
+static int origin_port = 0;
+static std::atomic<unsigned long long> origin_full { 0 }; // 200 responses of the origin
+static std::atomic<unsigned long long> origin_not_modified { 0 }; // 304 responses of the origin
+
+static size_t toBytes(const std::string & val)
+{
+	char * end = NULL;
+	double res = strtod(val.c_str(), &end);
+	if(*end == 'K' || *end == 'k') res *= 1 << 10;
+	else if(*end == 'M' || *end == 'm') res *= 1 << 20;
+	return (size_t)res;
+}
+
+static void usage()
+{
+	fprintf(stderr, "usage: load_bench [--threads=N] [--duration=S] [--warmup=S] [--objects=N] [--zipf=S] [--hit=P] [--revalidate=P] "
+		"[--size=N[K|M] | --size=MIN-MAX] [--chunked=P] [--origin-delay=MS] [--proxy=PATH] [--proxy-args=\"...\"] [--pid=PID]\n");
+	exit(EXIT_FAILURE);
+}
+
+static void parseOptions(int argc, char ** argv)
+{
+	for(int i = 1; i < argc; ++i)
+	{
+		const std::string arg(argv[i]);
+		size_t idx = arg.find('=');
+		if(arg.find("--") != 0 || idx == std::string::npos)
+		{
+			usage();
+		}
+		const std::string key = arg.substr(2, idx - 2);
+		const std::string val = arg.substr(idx + 1);
+		if(key == "threads") options.threads = atoi(val.c_str());
+		else if(key == "duration") options.duration = atof(val.c_str());
+		else if(key == "warmup") options.warmup = atof(val.c_str());
+		else if(key == "objects") options.objects = atoi(val.c_str());
+		else if(key == "zipf") options.zipf = atof(val.c_str());
+		else if(key == "hit") options.hit = atoi(val.c_str());
+		else if(key == "revalidate") options.revalidate = atoi(val.c_str());
+		else if(key == "size")
+		{
+			size_t dash = val.find('-');
+			options.min_size = toBytes(val.substr(0, dash));
+			options.max_size = dash == std::string::npos ? options.min_size : toBytes(val.substr(dash + 1));
+		}
+		else if(key == "chunked") options.chunked = atoi(val.c_str());
+		else if(key == "origin-delay") options.origin_delay = atoi(val.c_str());
+		else if(key == "proxy") options.proxy = val;
+		else if(key == "proxy-args") options.proxy_args = val;
+		else if(key == "pid") options.pid = atoi(val.c_str());
+		else usage();
+	}
+	if(options.threads <= 0 || options.objects <= 0 || options.duration <= 0 || options.hit < 0 || options.revalidate < 0 ||
+		options.hit + options.revalidate > 100 || options.min_size > options.max_size)
+	{
+		usage();
+	}
+}
+
+// user + system CPU seconds of a process, all threads included
+static double cpuSeconds(int pid)
+{
+	std::string path = "/proc/" + std::to_string(pid) + "/stat";
+	FILE * file = fopen(path.c_str(), "r");
+	if(file == NULL)
+	{
+		perror("open /proc/PID/stat");
+		exit(EXIT_FAILURE);
+	}
+	char line[4096];
+	size_t len = fread(line, 1, sizeof(line) - 1, file);
+	fclose(file);
+	line[len] = '\0';
+
+	// utime and stime are the 12th and 13th fields after the command name
+	const char * p = strrchr(line, ')');
+	unsigned long long utime = 0, stime = 0;
+	if(p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2)
+	{
+		fprintf(stderr, "cannot parse %s\n", path.c_str());
+		exit(EXIT_FAILURE);
+	}
+	return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static bool sendAll(int fd, const char * data, size_t length)
+{
+	size_t sent = 0;
+	while(sent < length)
+	{
+		ssize_t len = send(fd, data + sent, length - sent, MSG_NOSIGNAL);
+		if(len <= 0)
+		{
+			return false;
+		}
+		sent += len;
+	}
+	return true;
+}
+
+static int connectTo(int port)
+{
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+	{
+		close(fd);
+		return -1;
+	}
+	int yes = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+	return fd;
+}
+
+// ---------------- origin ----------------
+
+// deterministic per object, so that every fetch of an object gets the same body
+static size_t objectSize(int kind, int id)
+{
+	if(options.min_size == options.max_size)
+	{
+		return options.min_size;
+	}
+	unsigned h = (unsigned)(kind * 7919 + id) * 2654435761u;
+	double frac = (double)h / 4294967296.0;
+	return (size_t)(options.min_size * pow((double)options.max_size / options.min_size, frac));
+}
+
+static bool objectChunked(int id)
+{
+	return id % 100 < options.chunked;
+}
+
+static std::string etagOf(int kind, int id)
+{
+	return "\"" + std::string(kind_names[kind]) + "-" + std::to_string(id) + "\"";
+}
+
+// the response to a GET of target, which may be in absolute form
+static std::string originResponse(const std::string & target, const std::string & if_none_match, const std::string & body_bytes)
+{
+	size_t path = 0;
+	if(target.compare(0, 7, "http://") == 0)
+	{
+		path = target.find('/', 7);
+	}
+	int kind = KINDS;
+	for(int k = 0; k < KINDS && path != std::string::npos; ++k)
+	{
+		std::string prefix = "/" + std::string(kind_names[k]) + "/";
+		if(target.compare(path, prefix.size(), prefix) == 0)
+		{
+			kind = k;
+		}
+	}
+	if(kind == KINDS)
+	{
+		return "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+	}
+	int id = atoi(target.c_str() + target.find('/', path + 1) + 1);
+	static const char * cache_control[KINDS] = { "max-age=3600", "no-cache", "no-store" };
+	std::string etag = etagOf(kind, id);
+	std::string header = std::string("Cache-Control: ") + cache_control[kind] + "\r\nETag: " + etag + "\r\nLast-Modified: " LAST_MODIFIED "\r\n";
+	if(!if_none_match.empty() && if_none_match == etag)
+	{
+		origin_not_modified.fetch_add(1);
+		return "HTTP/1.1 304 Not Modified\r\n" + header + "\r\n";
+	}
+	origin_full.fetch_add(1);
+
+	size_t size = objectSize(kind, id);
+	std::string res = "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\n" + header;
+	if(!objectChunked(id))
+	{
+		res += "Content-Length: " + std::to_string(size) + "\r\n\r\n";
+		res.append(body_bytes, 0, size);
+		return res;
+	}
+	res += "Transfer-Encoding: chunked\r\n\r\n";
+	char line[32];
+	for(size_t off = 0; off < size; off += CHUNK_SIZE)
+	{
+		size_t len = std::min((size_t)CHUNK_SIZE, size - off);
+		snprintf(line, sizeof(line), "%zx\r\n", len);
+		res += line;
+		res.append(body_bytes, 0, len);
+		res += "\r\n";
+	}
+	return res + "0\r\n\r\n";
+}
+
+// one kept-alive connection of the proxy to the origin
+static void serveConnection(int fd, const std::string * body_bytes)
+{
+	std::vector<char> buf;
+	std::vector<char> recv_buf(IO_SIZE);
+	HttpParser head(HttpParser::REQUEST);
+	while(true)
+	{
+		HttpParser::Result res = head.parse(buf.data(), buf.size());
+		if(res == HttpParser::ERROR)
+		{
+			break;
+		}
+		if(res == HttpParser::INCOMPLETE)
+		{
+			ssize_t len = recv(fd, &recv_buf.data()[0], recv_buf.size(), 0);
+			if(len <= 0)
+			{
+				break;
+			}
+			buf.insert(buf.end(), recv_buf.begin(), recv_buf.begin() + len);
+			continue;
+		}
+
+		const HttpParser::Field * inm = head.find(buf.data(), "if-none-match");
+		std::string response = originResponse(head.target().str(buf.data()), inm != NULL ? inm->value.str(buf.data()) : std::string(),
+			*body_bytes);
+		buf.erase(buf.begin(), buf.begin() + head.headerLength());
+		head.reset();
+		if(options.origin_delay > 0)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(options.origin_delay));
+		}
+		if(!sendAll(fd, response.data(), response.size()))
+		{
+			break;
+		}
+	}
+	close(fd);
+}
+
+// listen on an ephemeral loopback port, every connection gets a thread
+static void startOrigin()
+{
+	int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t addr_len = sizeof(addr);
+	if(bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(listen_fd, 1024) == -1 ||
+		getsockname(listen_fd, (struct sockaddr *)&addr, &addr_len) == -1)
+	{
+		perror("origin");
+		exit(EXIT_FAILURE);
+	}
+	origin_port = ntohs(addr.sin_port);
+
+	const std::string * body_bytes = new std::string(std::max(options.max_size, (size_t)CHUNK_SIZE), 'x');
+	std::thread([listen_fd, body_bytes]
+	{
+		while(true)
+		{
+			int fd = accept(listen_fd, NULL, NULL);
+			if(fd == -1)
+			{
+				continue;
+			}
+			int yes = 1;
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+			std::thread(serveConnection, fd, body_bytes).detach();
+		}
+	}).detach();
+}
+
+// ---------------- proxy ----------------
+
+static int startProxy()
+{
+	std::vector<std::string> args;
+	args.push_back(options.proxy);
+	size_t pos = 0;
+	while(pos < options.proxy_args.size())
+	{
+		size_t end = options.proxy_args.find(' ', pos);
+		end = end == std::string::npos ? options.proxy_args.size() : end;
+		if(end > pos)
+		{
+			args.push_back(options.proxy_args.substr(pos, end - pos));
+		}
+		pos = end + 1;
+	}
+
+	int pid = fork();
+	if(pid == 0)
+	{
+		std::vector<char *> argv;
+		for(std::string & arg : args)
+		{
+			argv.push_back(&arg[0]);
+		}
+		argv.push_back(NULL);
+		freopen("/dev/null", "w", stdout);
+		execv(argv[0], argv.data());
+		perror(argv[0]);
+		_exit(EXIT_FAILURE);
+	}
+
+	// wait until it accepts connections
+	for(int i = 0; i < 100; ++i)
+	{
+		int status = 0;
+		if(waitpid(pid, &status, WNOHANG) == pid)
+		{
+			fprintf(stderr, "%s exited\n", options.proxy.c_str());
+			exit(EXIT_FAILURE);
+		}
+		int fd = connectTo(PROXY_PORT);
+		if(fd != -1)
+		{
+			close(fd);
+			return pid;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	}
+	fprintf(stderr, "%s does not listen on %d\n", options.proxy.c_str(), PROXY_PORT);
+	kill(pid, SIGTERM);
+	exit(EXIT_FAILURE);
+}
+
+// ---------------- load ----------------
+
+// inverse of the cumulative distribution of a Zipfian distribution over n ranks
+class Zipf
+{
+private:
+	std::vector<double> cdf;
+
+public:
+	Zipf(int n, double s)
+	{
+		double sum = 0;
+		for(int i = 1; i <= n; ++i)
+		{
+			sum += 1.0 / pow(i, s);
+			cdf.push_back(sum);
+		}
+		for(double & c : cdf)
+		{
+			c /= sum;
+		}
+	}
+
+	int sample(double u) const
+	{
+		return std::lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin();
+	}
+};
+
+struct Worker
+{
+	std::vector<uint32_t> latencies_us; // of the requests completed while measuring
+	unsigned long long errors;
+
+	Worker() :
+		errors { 0 }
+		{}
+};
+
+static std::atomic<int> phase { 0 }; // 0 warm-up, 1 measuring, 2 done
+
+// send the request and receive the whole response, false if the connection failed
+// keep tells whether the connection carries the next request
+static bool exchange(int fd, const std::string & request, std::vector<char> & buf, bool & keep)
+{
+	keep = false;
+	if(!sendAll(fd, request.data(), request.size()))
+	{
+		return false;
+	}
+	buf.clear();
+	HttpParser head(HttpParser::RESPONSE);
+	size_t len = 0;
+	while(head.parse(buf.data(), len) == HttpParser::INCOMPLETE)
+	{
+		buf.resize(len + IO_SIZE);
+		ssize_t received = recv(fd, &buf.data()[len], IO_SIZE, 0);
+		if(received <= 0)
+		{
+			return false;
+		}
+		len += received;
+	}
+	if(head.state() == HttpParser::ERROR)
+	{
+		return false;
+	}
+
+	size_t body = len - head.headerLength();
+	keep = head.find(buf.data(), "connection") == NULL;
+	if(head.chunked())
+	{
+		ChunkedDecoder decoder;
+		size_t data_length = 0;
+		decoder.decode(&buf.data()[head.headerLength()], body, data_length);
+		while(!decoder.done())
+		{
+			ssize_t received = recv(fd, &buf.data()[0], buf.size(), 0);
+			if(received <= 0)
+			{
+				return false;
+			}
+			decoder.decode(&buf.data()[0], received, data_length);
+		}
+	}
+	else if(head.contentLength() != -1 || head.status() == 304)
+	{
+		size_t content_length = head.status() == 304 ? 0 : head.contentLength();
+		while(body < content_length)
+		{
+			ssize_t received = recv(fd, &buf.data()[0], std::min(buf.size(), content_length - body), 0);
+			if(received <= 0)
+			{
+				return false;
+			}
+			body += received;
+		}
+	}
+	else
+	{
+		keep = false;
+		while(recv(fd, &buf.data()[0], buf.size(), 0) > 0);
+	}
+	return true;
+}
+
+static void generate(Worker & worker, int thread_id)
+{
+	std::mt19937_64 rng(thread_id + 1);
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
+	Zipf zipf(options.objects, options.zipf);
+	std::vector<char> buf;
+	const std::string host = "127.0.0.1:" + std::to_string(origin_port);
+	int fd = -1;
+	while(phase.load() != 2)
+	{
+		double pick = uniform(rng) * 100;
+		int kind = pick < options.hit ? HIT : pick < options.hit + options.revalidate ? REVALIDATE : MISS;
+		int id = zipf.sample(uniform(rng));
+		std::string request = "GET http://" + host + "/" + kind_names[kind] + "/" + std::to_string(id) + " HTTP/1.1\r\nHost: " + host + "\r\n\r\n";
+
+		if(fd == -1 && (fd = connectTo(PROXY_PORT)) == -1)
+		{
+			++worker.errors;
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			continue;
+		}
+		bool measuring = phase.load() == 1;
+		std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+		bool keep = false;
+		bool ok = false;
+		try
+		{
+			ok = exchange(fd, request, buf, keep);
+		}
+		catch(std::exception & e)
+		{
+			keep = false;
+		}
+		uint32_t us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - begin).count();
+		if(!ok || !keep)
+		{
+			close(fd);
+			fd = -1;
+		}
+		if(!ok)
+		{
+			++worker.errors;
+		}
+		else if(measuring && phase.load() == 1)
+		{
+			worker.latencies_us.push_back(us);
+		}
+	}
+	if(fd != -1)
+	{
+		close(fd);
+	}
+}
+
+static double percentile(const std::vector<uint32_t> & sorted, double p)
+{
+	if(sorted.empty())
+	{
+		return 0;
+	}
+	size_t idx = std::min(sorted.size() - 1, (size_t)(p * sorted.size()));
+	return sorted[idx] / 1000.0;
+}
+
+int main(int argc, char ** argv)
+{
+	parseOptions(argc, argv);
+	signal(SIGPIPE, SIG_IGN);
+	startOrigin();
+	int pid = options.pid != 0 ? options.pid : startProxy();
+
+	printf("proxy: %s (pid %d)\n", options.pid != 0 ? "running" : (options.proxy + " " + options.proxy_args).c_str(), pid);
+	printf("origin: port %d, %d objects per kind, %zu-%zu bytes, %d%% chunked, %d ms delay\n", origin_port, options.objects,
+		options.min_size, options.max_size, options.chunked, options.origin_delay);
+	printf("load: %d threads, zipf %.2f, %d%% hit, %d%% revalidate, %d%% miss, %.0f s after %.0f s warm-up\n", options.threads,
+		options.zipf, options.hit, options.revalidate, 100 - options.hit - options.revalidate, options.duration, options.warmup);
+
+	std::vector<Worker> workers(options.threads);
+	std::vector<std::thread> threads;
+	for(int t = 0; t < options.threads; ++t)
+	{
+		threads.push_back(std::thread(generate, std::ref(workers[t]), t));
+	}
+	std::this_thread::sleep_for(std::chrono::duration<double>(options.warmup));
+
+	unsigned long long full_before = origin_full.load();
+	unsigned long long not_modified_before = origin_not_modified.load();
+	double cpu_before = cpuSeconds(pid);
+	std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+	phase.store(1);
+	std::this_thread::sleep_for(std::chrono::duration<double>(options.duration));
+	phase.store(2);
+	double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	double cpu = cpuSeconds(pid) - cpu_before;
+	unsigned long long full = origin_full.load() - full_before;
+	unsigned long long not_modified = origin_not_modified.load() - not_modified_before;
+	for(std::thread & thd : threads)
+	{
+		thd.join();
+	}
+
+	std::vector<uint32_t> all;
+	unsigned long long errors = 0;
+	for(const Worker & worker : workers)
+	{
+		all.insert(all.end(), worker.latencies_us.begin(), worker.latencies_us.end());
+		errors += worker.errors;
+	}
+	std::sort(all.begin(), all.end());
+	double requests = all.size();
+	printf("%10s %10s %9s %9s %9s %11s %10s %9s %8s\n", "requests", "req/s", "p50 ms", "p99 ms", "p999 ms", "cpu us/req", "hit ratio",
+		"304s", "errors");
+	printf("%10.0f %10.1f %9.3f %9.3f %9.3f %11.1f %9.1f%% %9llu %8llu\n", requests, requests / secs, percentile(all, 0.5),
+		percentile(all, 0.99), percentile(all, 0.999), requests > 0 ? cpu * 1e6 / requests : 0,
+		requests > 0 ? 100.0 * (1 - std::min(1.0, full / requests)) : 0, not_modified, errors);
+
+	if(options.pid == 0)
+	{
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,109 @@
+// logging benchmark, the synchronous logger (mutex, open, write with std::endl and close per line, how log.txt was
+// written before) against the asynchronous Logger, for 1, 2, 4, ... threads logging lines like the proxy does
+// output is lines logged per second, measured until the last log() call returns; for Logger with a full buffer
+// blocking the thread, a second figure includes writing every line out with flush(); with a full buffer dropping the
+// line, the share of lines dropped
+#include "../Logger.hpp"
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+
+// the logger before: every line reopens the file and flushes it
+class SyncLogger
+{
+private:
+	std::mutex mtx;
+	std::string path;
+	std::ofstream out;
+
+public:
+	SyncLogger(std::string _path) :
+		path { _path }
+		{}
+
+	void log(const std::string & content)
+	{
+		std::unique_lock<std::mutex> lck(mtx);
+		if(!out.is_open())
+		{
+			out.open(path, std::ofstream::out | std::ofstream::app);
+		}
+		out << content << std::endl;
+		out.close();
+	}
+
+	void flush()
+	{
+	}
+};
+
+template <typename L>
+static void logLines(L & logger, int thread_id, int lines)
+{
+	for(int i = 0; i < lines; ++i)
+	{
+		int client_id = thread_id * lines + i;
+		logger.log(std::to_string(client_id) + ": Requesting GET http://www.example.com/static/js/app.min.js HTTP/1.1 from http://www.example.com/static/js/app.min.js");
+	}
+}
+
+// seconds until every thread is done logging, and until every line is written
+template <typename L>
+static std::pair<double, double> run(L & logger, int threads, int lines)
+{
+	std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+	std::vector<std::thread> workers;
+	for(int t = 0; t < threads; ++t)
+	{
+		workers.push_back(std::thread([&logger, t, lines] { logLines(logger, t, lines); }));
+	}
+	for(std::thread & thd : workers)
+	{
+		thd.join();
+	}
+	double logged = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	logger.flush();
+	double written = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	return std::make_pair(logged, written);
+}
+
+int main(int argc, char ** argv)
+{
+	int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+	int lines = argc > 2 ? atoi(argv[2]) : 20000;
+	if(max_threads <= 0) max_threads = 1;
+	if(lines <= 0) lines = 1;
+	const char * sync_path = "log_bench_sync.txt";
+	const char * async_path = "log_bench_async.txt";
+
+	printf("%d lines per thread\n", lines);
+	printf("%-8s %14s %16s %16s %16s %10s\n", "threads", "sync/s", "async block/s", "written/s", "async drop/s", "dropped");
+	for(int threads = 1; threads <= max_threads; threads *= 2)
+	{
+		double total = (double)threads * lines;
+		SyncLogger sync_logger(sync_path);
+		std::pair<double, double> sync_secs = run(sync_logger, threads, lines);
+		std::pair<double, double> block_secs;
+		{
+			Logger logger(async_path, 256 << 10, true);
+			block_secs = run(logger, threads, lines);
+		}
+		std::pair<double, double> drop_secs;
+		unsigned long long dropped = 0;
+		{
+			Logger logger(async_path, 256 << 10, false);
+			drop_secs = run(logger, threads, lines);
+			dropped = logger.dropped();
+		}
+		printf("%-8d %14.0f %16.0f %16.0f %16.0f %9.1f%%\n", threads, total / sync_secs.first, total / block_secs.first,
+			total / block_secs.second, total / drop_secs.first, 100.0 * dropped / total);
+		remove(sync_path);
+		remove(async_path);
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,466 @@
+// microbenchmarks of the per-request work of Parser and LRUCache
+// Parser: parseRequest (walking the request, and from an HttpParser), parseResponse, extractContentLength and
+// checkEtagValidiklity, on a corpus of headers as sent by browsers, curl, and common servers and CDNs
+// LRUCache: get and put alone, and a 90% get / 10% put mix on 1, 2, 4, ... threads, for several key set and value sizes
+// every benchmark runs long enough to take min_time, the number of operations is found the way Go's testing package
+// does; output is one line per benchmark in the format of Go benchmarks, which benchstat reads:
+//   BenchmarkName-THREADS  OPERATIONS  NS ns/op  BYTES B/op  ALLOCS allocs/op
+// ns/op is wall time divided by operations of all threads, allocations are counted by replacing operator new
+#include "../Parser.hpp"
+#include "../HttpParser.hpp"
+#include "../LRUCache.hpp"
+#include "../Response.hpp"
+#include <new>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+// ---------------- allocation counting ----------------
+
+static thread_local unsigned long long alloc_count = 0;
+static thread_local unsigned long long alloc_bytes = 0;
+
+// the replacements below are the program's operator new and delete, so malloc() and free() do match, but GCC
+// sees new in a caller inlined against free() here and warns; older GCC doesn't know the warning
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpragmas"
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+void * operator new(size_t n)
+{
+	++alloc_count;
+	alloc_bytes += n;
+	void * p = malloc(n == 0 ? 1 : n);
+	if(p == NULL)
+	{
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+void * operator new[](size_t n)
+{
+	return operator new(n);
+}
+
+void operator delete(void * p) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void * p) noexcept
+{
+	free(p);
+}
+
+// the sized forms, which C++14 and later call for most deletes, go to the same free()
+void operator delete(void * p, size_t) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void * p, size_t) noexcept
+{
+	free(p);
+}
+
+#pragma GCC diagnostic pop
+
+// ---------------- harness ----------------
+
+static double min_time = 0.5; // seconds every benchmark runs at least
+static std::string filter; // only benchmarks whose name contains it run
+
+struct Totals
+{
+	std::atomic<unsigned long long> allocs;
+	std::atomic<unsigned long long> bytes;
+};
+
+// run op(thread, i) n times in total, split over threads, return seconds of wall time
+// allocations of all threads are added to totals
+template <typename Op>
+static double runOps(unsigned long long n, int threads, Op & op, Totals & totals)
+{
+	totals.allocs = 0;
+	totals.bytes = 0;
+	std::atomic<int> ready { 0 };
+	std::atomic<bool> go { false };
+	auto work = [&](int t)
+	{
+		unsigned long long first = n * t / threads;
+		unsigned long long last = n * (t + 1) / threads;
+		ready.fetch_add(1);
+		while(!go.load()) {}
+		unsigned long long allocs = alloc_count;
+		unsigned long long bytes = alloc_bytes;
+		for(unsigned long long i = first; i < last; ++i)
+		{
+			op(t, i);
+		}
+		totals.allocs.fetch_add(alloc_count - allocs);
+		totals.bytes.fetch_add(alloc_bytes - bytes);
+	};
+
+	std::vector<std::thread> workers;
+	for(int t = 1; t < threads; ++t)
+	{
+		workers.push_back(std::thread(work, t));
+	}
+	while(ready.load() != threads - 1) {}
+	std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+	go = true;
+	work(0);
+	for(std::thread & thd : workers)
+	{
+		thd.join();
+	}
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+}
+
+// grow the number of operations until a run takes min_time, then print its figures
+template <typename Op>
+static void bench(const std::string & name, int threads, Op op)
+{
+	if(name.find(filter) == std::string::npos)
+	{
+		return;
+	}
+	Totals totals;
+	unsigned long long n = 1;
+	double secs = runOps(n, threads, op, totals);
+	while(secs < min_time && n < 1000000000ULL)
+	{
+		// aim 20% past min_time, but grow at most 100 times, and at least by one
+		double per_op = std::max(secs, 1e-9) / n;
+		unsigned long long next = (unsigned long long)(min_time * 1.2 / per_op);
+		next = std::min(next, n * 100);
+		n = std::max(next, n + 1);
+		secs = runOps(n, threads, op, totals);
+	}
+	printf("Benchmark%s-%d\t%llu\t%.1f ns/op\t%.0f B/op\t%.2f allocs/op\n", name.c_str(), threads, n, secs * 1e9 / n,
+		(double)totals.bytes / n, (double)totals.allocs / n);
+	fflush(stdout);
+}
+
+// small and fast random numbers for picking keys, one generator per thread
+struct XorShift
+{
+	unsigned long long state;
+
+	explicit XorShift(unsigned long long seed) :
+		state { seed * 0x9E3779B97F4A7C15ULL + 1 }
+		{}
+
+	unsigned long long next()
+	{
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		return state;
+	}
+};
+
+// ---------------- corpus ----------------
+
+struct Sample
+{
+	const char * name;
+	const char * text;
+};
+
+static const Sample requests[] = {
+	{ "firefox", "GET http://www.example.com/static/js/app.min.js?v=20200224 HTTP/1.1\r\n"
+		"Host: www.example.com\r\n"
+		"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:73.0) Gecko/20100101 Firefox/73.0\r\n"
+		"Accept: */*\r\n"
+		"Accept-Language: en-US,en;q=0.5\r\n"
+		"Accept-Encoding: gzip, deflate\r\n"
+		"Referer: http://www.example.com/index.html\r\n"
+		"Cookie: session=8f14e45fceea167a5a36dedd4bea2543; theme=dark\r\n"
+		"Connection: keep-alive\r\n"
+		"Proxy-Connection: keep-alive\r\n"
+		"\r\n" },
+	{ "chrome", "GET http://news.example.org/2020/02/24/world/europe/story.html HTTP/1.1\r\n"
+		"Host: news.example.org\r\n"
+		"Proxy-Connection: keep-alive\r\n"
+		"Upgrade-Insecure-Requests: 1\r\n"
+		"User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/80.0.3987.116 Safari/537.36\r\n"
+		"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/webp,image/apng,*/*;q=0.8,application/signed-exchange;v=b3;q=0.9\r\n"
+		"Accept-Encoding: gzip, deflate\r\n"
+		"Accept-Language: en-US,en;q=0.9,de;q=0.8\r\n"
+		"Cookie: nyt-a=Zt3Xb2k9qLmN0pQrStUvWx; nyt-gdpr=0; nyt-purr=cfhhcfhhhu; _ga=GA1.2.1234567890.1582500000; "
+			"_gid=GA1.2.987654321.1582500000; optimizelyEndUserId=oeu1582500000000r0.123456789\r\n"
+		"If-None-Match: W/\"4f2a-170744f1a40\"\r\n"
+		"If-Modified-Since: Mon, 24 Feb 2020 00:00:00 GMT\r\n"
+		"\r\n" },
+	{ "curl", "GET http://127.0.0.1:8080/small.txt HTTP/1.1\r\n"
+		"Host: 127.0.0.1:8080\r\n"
+		"User-Agent: curl/7.68.0\r\n"
+		"Accept: */*\r\n"
+		"Proxy-Connection: Keep-Alive\r\n"
+		"\r\n" },
+	{ "post", "POST http://api.example.com/v1/events HTTP/1.1\r\n"
+		"Host: api.example.com\r\n"
+		"User-Agent: python-requests/2.22.0\r\n"
+		"Accept-Encoding: gzip, deflate\r\n"
+		"Accept: application/json\r\n"
+		"Connection: keep-alive\r\n"
+		"Content-Type: application/json\r\n"
+		"Content-Length: 27\r\n"
+		"\r\n"
+		"{\"event\":\"click\",\"id\":1234}" },
+	{ "connect", "CONNECT www.google.com:443 HTTP/1.1\r\n"
+		"Host: www.google.com:443\r\n"
+		"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:73.0) Gecko/20100101 Firefox/73.0\r\n"
+		"Proxy-Connection: keep-alive\r\n"
+		"\r\n" }
+};
+
+static const Sample responses[] = {
+	{ "apache", "HTTP/1.1 200 OK\r\n"
+		"Date: Mon, 24 Feb 2020 00:32:34 GMT\r\n"
+		"Server: Apache/2.4.41 (Ubuntu)\r\n"
+		"Last-Modified: Sun, 23 Feb 2020 18:00:00 GMT\r\n"
+		"ETag: \"5e52c0a0-1a2b\"\r\n"
+		"Accept-Ranges: bytes\r\n"
+		"Cache-Control: public, max-age=3600\r\n"
+		"Vary: Accept-Encoding\r\n"
+		"Content-Type: application/javascript; charset=utf-8\r\n"
+		"Content-Length: 6699\r\n"
+		"Keep-Alive: timeout=5, max=100\r\n"
+		"Connection: Keep-Alive\r\n"
+		"\r\n" },
+	{ "nginx", "HTTP/1.1 200 OK\r\n"
+		"Server: nginx/1.17.8\r\n"
+		"Date: Mon, 24 Feb 2020 00:32:34 GMT\r\n"
+		"Content-Type: text/css\r\n"
+		"Content-Length: 48213\r\n"
+		"Last-Modified: Thu, 20 Feb 2020 09:15:02 GMT\r\n"
+		"Connection: keep-alive\r\n"
+		"ETag: \"5e4e4e36-bc55\"\r\n"
+		"Expires: Tue, 24 Mar 2020 00:32:34 GMT\r\n"
+		"Cache-Control: max-age=2592000\r\n"
+		"Accept-Ranges: bytes\r\n"
+		"\r\n" },
+	{ "cdn", "HTTP/1.1 200 OK\r\n"
+		"Content-Type: image/jpeg\r\n"
+		"Content-Length: 125731\r\n"
+		"Connection: keep-alive\r\n"
+		"Date: Mon, 24 Feb 2020 00:30:11 GMT\r\n"
+		"Last-Modified: Fri, 21 Feb 2020 14:22:45 GMT\r\n"
+		"ETag: \"a8f3c5d1e2b4f6a7c8d9e0f1a2b3c4d5\"\r\n"
+		"x-amz-version-id: 3HL4kqtJlcpXroDTDmJ.rmSpXd3dIbrHY\r\n"
+		"Accept-Ranges: bytes\r\n"
+		"Server: AmazonS3\r\n"
+		"Cache-Control: public, max-age=31536000, immutable\r\n"
+		"Age: 143\r\n"
+		"Via: 1.1 7e9f4b1c2d3a4e5f6a7b8c9d0e1f2a3b.cloudfront.net (CloudFront)\r\n"
+		"X-Cache: Hit from cloudfront\r\n"
+		"X-Amz-Cf-Pop: IAD89-C1\r\n"
+		"X-Amz-Cf-Id: q0Wn8yYx2J7Lr3Kp5Vt9Zs1Bm4Cn6Dh8Fj0Gk2Hl4Jm6Kn8Lp0Mq==\r\n"
+		"Vary: Origin\r\n"
+		"\r\n" },
+	{ "chunked", "HTTP/1.1 200 OK\r\n"
+		"Date: Mon, 24 Feb 2020 00:32:34 GMT\r\n"
+		"Content-Type: text/html; charset=UTF-8\r\n"
+		"Transfer-Encoding: chunked\r\n"
+		"Connection: keep-alive\r\n"
+		"Set-Cookie: __cfduid=d1a2b3c4d5e6f7a8b9c0d1e2f3a4b5c6d1582504354; expires=Wed, 25-Mar-20 00:32:34 GMT; path=/; "
+			"domain=.example.com; HttpOnly; SameSite=Lax\r\n"
+		"Cache-Control: private, no-cache, no-store, must-revalidate\r\n"
+		"Pragma: no-cache\r\n"
+		"Expires: Thu, 01 Jan 1970 00:00:01 GMT\r\n"
+		"X-Frame-Options: SAMEORIGIN\r\n"
+		"Vary: Accept-Encoding\r\n"
+		"Server: cloudflare\r\n"
+		"CF-RAY: 569a1b2c3d4e5f60-IAD\r\n"
+		"\r\n" },
+	{ "not-modified", "HTTP/1.1 304 Not Modified\r\n"
+		"Date: Mon, 24 Feb 2020 00:32:34 GMT\r\n"
+		"Server: Apache/2.4.41 (Ubuntu)\r\n"
+		"Connection: Keep-Alive\r\n"
+		"Keep-Alive: timeout=5, max=99\r\n"
+		"ETag: \"5e52c0a0-1a2b\"\r\n"
+		"\r\n" }
+};
+
+// ---------------- Parser ----------------
+
+static void benchParser()
+{
+	Parser parser;
+	for(const Sample & sample : requests)
+	{
+		std::vector<char> content(sample.text, sample.text + strlen(sample.text));
+		Request request(std::string(), content, content.size());
+		HttpParser head(HttpParser::REQUEST);
+		head.parse(request.content.data(), request.content.size());
+
+		// the fields parseRequest() fills start empty every time, as in a new Request, the content is not copied
+		auto clear = [](Request & req)
+		{
+			req.first_line = std::string();
+			req.httpAction = std::string();
+			req.url = std::string();
+			req.hostname = std::string();
+			req.port = std::string();
+		};
+		bench(std::string("ParseRequest/") + sample.name, 1, [&](int, unsigned long long)
+		{
+			clear(request);
+			parser.parseRequest(request);
+		});
+		bench(std::string("ParseRequestHead/") + sample.name, 1, [&](int, unsigned long long)
+		{
+			clear(request);
+			parser.parseRequest(request, head);
+		});
+	}
+
+	for(const Sample & sample : responses)
+	{
+		const std::string header = sample.text;
+		Response response(std::string(), ResponseBuffer(), header);
+
+		// same for parseResponse(), the header stays
+		bench(std::string("ParseResponse/") + sample.name, 1, [&](int, unsigned long long)
+		{
+			response.first_line = std::string();
+			response.etag = std::string();
+			parser.parseResponse(response);
+		});
+		bench(std::string("ExtractContentLength/") + sample.name, 1, [&](int, unsigned long long)
+		{
+			volatile int length = parser.extractContentLength(header);
+			(void)length;
+		});
+
+		// re-validating with the same ETag, the cached response is parsed already
+		std::vector<char> buffer(header.begin(), header.end());
+		if(!response.etag.empty())
+		{
+			bench(std::string("CheckEtagValidity/") + sample.name, 1, [&](int, unsigned long long)
+			{
+				volatile bool valid = parser.checkEtagValidiklity(buffer, response);
+				(void)valid;
+			});
+		}
+	}
+}
+
+// ---------------- LRUCache ----------------
+
+static std::vector<std::string> makeKeys(int n)
+{
+	std::vector<std::string> keys;
+	for(int i = 0; i < n; ++i)
+	{
+		keys.push_back("http://www.example.com/static/assets/" + std::to_string(i) + "/bundle.min.js?v=20200224");
+	}
+	return keys;
+}
+
+// a cached response with a body of size bytes and the apache header
+static std::shared_ptr<const Response> makeValue(size_t size)
+{
+	std::string header = responses[0].text;
+	ResponseBuffer body;
+	body.append(header.data(), header.size());
+	std::string data(size, 'x');
+	body.append(data.data(), data.size());
+	std::shared_ptr<Response> res = std::make_shared<Response>(std::string(), body, header);
+	Parser parser;
+	parser.parseResponse(*res);
+	return res;
+}
+
+static void benchCache(int max_threads)
+{
+	static const int key_counts[] = { 1000, 100000 };
+	static const size_t value_sizes[] = { 1 << 10, 64 << 10 };
+	for(int keys_n : key_counts)
+	{
+		std::vector<std::string> keys = makeKeys(keys_n);
+		for(size_t value_size : value_sizes)
+		{
+			std::shared_ptr<const Response> value = makeValue(value_size);
+			std::string suffix = "/keys=" + std::to_string(keys_n) + "/value=" + std::to_string(value_size >> 10) + "K";
+
+			// every key cached, every get hits; the byte budget holds them all
+			{
+				LRUCache cache(keys_n, 16, SIZE_MAX);
+				for(const std::string & key : keys)
+				{
+					cache.put(key, value);
+				}
+				std::vector<XorShift> rngs(1, XorShift(1));
+				bench("CacheGet" + suffix, 1, [&](int t, unsigned long long)
+				{
+					std::shared_ptr<const Response> res;
+					cache.tryGet(keys[rngs[t].next() % keys_n], res);
+				});
+			}
+
+			// room for half the keys and a 256M byte budget, as the proxy defaults, so puts keep evicting
+			{
+				LRUCache cache(keys_n / 2, 16, 256ULL << 20);
+				std::vector<XorShift> rngs(1, XorShift(1));
+				bench("CachePut" + suffix, 1, [&](int t, unsigned long long)
+				{
+					cache.put(keys[rngs[t].next() % keys_n], value);
+				});
+			}
+
+			// 90% get / 10% put on a shared cache of the same shape
+			for(int threads = 1; threads <= max_threads; threads *= 2)
+			{
+				LRUCache cache(keys_n / 2, 16, 256ULL << 20);
+				for(int i = 0; i < keys_n / 2; ++i)
+				{
+					cache.put(keys[i], value);
+				}
+				std::vector<XorShift> rngs;
+				for(int t = 0; t < threads; ++t)
+				{
+					rngs.push_back(XorShift(t + 1));
+				}
+				bench("CacheMix90" + suffix, threads, [&](int t, unsigned long long)
+				{
+					unsigned long long r = rngs[t].next();
+					const std::string & key = keys[(r >> 8) % keys_n];
+					if(r % 100 < 90)
+					{
+						std::shared_ptr<const Response> res;
+						cache.tryGet(key, res);
+					}
+					else
+					{
+						cache.put(key, value);
+					}
+				});
+			}
+		}
+	}
+}
+
+int main(int argc, char ** argv)
+{
+	filter = argc > 1 ? argv[1] : "";
+	min_time = argc > 2 ? atoi(argv[2]) / 1000.0 : 0.5;
+	int max_threads = argc > 3 ? atoi(argv[3]) : 8;
+	if(min_time <= 0) min_time = 0.5;
+	if(max_threads <= 0) max_threads = 1;
+
+	printf("cpus: %u\n", std::thread::hardware_concurrency());
+	benchParser();
+	benchCache(max_threads);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,138 @@
+// header parsing benchmark, Parser against the incremental HttpParser
+// every round parses a typical request and response header, either received whole or in small fragments
+// Parser needs the whole header, so with fragments the end of header is searched from the start after every receive,
+// the way the proxy found it before HttpParser
+// output is headers parsed per second
+#include "../Parser.hpp"
+#include "../HttpParser.hpp"
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+
+static const char * REQUEST_HEADER =
+	"GET http://www.example.com/static/js/app.min.js?v=20200224 HTTP/1.1\r\n"
+	"Host: www.example.com\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:73.0) Gecko/20100101 Firefox/73.0\r\n"
+	"Accept: */*\r\n"
+	"Accept-Language: en-US,en;q=0.5\r\n"
+	"Accept-Encoding: gzip, deflate\r\n"
+	"Referer: http://www.example.com/index.html\r\n"
+	"Cookie: session=8f14e45fceea167a5a36dedd4bea2543; theme=dark\r\n"
+	"Connection: keep-alive\r\n"
+	"Proxy-Connection: keep-alive\r\n"
+	"\r\n";
+
+static const char * RESPONSE_HEADER =
+	"HTTP/1.1 200 OK\r\n"
+	"Date: Mon, 24 Feb 2020 00:32:34 GMT\r\n"
+	"Server: Apache/2.4.41 (Ubuntu)\r\n"
+	"Last-Modified: Sun, 23 Feb 2020 18:00:00 GMT\r\n"
+	"ETag: \"5e52c0a0-1a2b\"\r\n"
+	"Accept-Ranges: bytes\r\n"
+	"Cache-Control: public, max-age=3600\r\n"
+	"Vary: Accept-Encoding\r\n"
+	"Content-Type: application/javascript; charset=utf-8\r\n"
+	"Content-Length: 6699\r\n"
+	"Keep-Alive: timeout=5, max=100\r\n"
+	"Connection: Keep-Alive\r\n"
+	"\r\n";
+
+static long findHeaderEnd(const std::vector<char> & buffer)
+{
+	const char * sep = "\r\n\r\n";
+	std::vector<char>::const_iterator it = std::search(buffer.begin(), buffer.end(), sep, sep + 4);
+	return it == buffer.end() ? -1 : it - buffer.begin() + 4;
+}
+
+// receive the header in pieces of fragment bytes (0 for all at once), looking for its end after every piece
+static size_t parseOld(Parser & parser, const std::string & text, size_t fragment, bool request)
+{
+	std::vector<char> buffer;
+	long header_length = -1;
+	for(size_t off = 0; header_length == -1; off += fragment)
+	{
+		size_t len = fragment == 0 ? text.size() : std::min(fragment, text.size() - off);
+		buffer.insert(buffer.end(), text.begin() + off, text.begin() + off + len);
+		header_length = findHeaderEnd(buffer);
+	}
+	if(request)
+	{
+		Request req(std::string(), buffer, header_length);
+		parser.parseRequest(req);
+		return req.url.size();
+	}
+	Response response(std::string(), ResponseBuffer(), std::string(buffer.begin(), buffer.begin() + header_length));
+	parser.parseResponse(response);
+	return response.kv.size();
+}
+
+static size_t parseNew(HttpParser & head, const std::string & text, size_t fragment)
+{
+	head.reset();
+	std::vector<char> buffer;
+	buffer.reserve(text.size());
+	HttpParser::Result res = HttpParser::INCOMPLETE;
+	for(size_t off = 0; res == HttpParser::INCOMPLETE; off += fragment)
+	{
+		size_t len = fragment == 0 ? text.size() : std::min(fragment, text.size() - off);
+		buffer.insert(buffer.end(), text.begin() + off, text.begin() + off + len);
+		res = head.parse(buffer.data(), buffer.size());
+	}
+	if(res != HttpParser::DONE)
+	{
+		fprintf(stderr, "parse error\n");
+		exit(EXIT_FAILURE);
+	}
+	return head.fieldCount();
+}
+
+template <typename F>
+static double perSecond(int rounds, F parse)
+{
+	size_t sink = 0;
+	std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+	for(int r = 0; r < rounds; ++r)
+	{
+		sink += parse();
+	}
+	double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	if(sink == 0)
+	{
+		fprintf(stderr, "nothing parsed\n");
+	}
+	return rounds / secs;
+}
+
+int main(int argc, char ** argv)
+{
+	int rounds = argc > 1 ? atoi(argv[1]) : 200000;
+	size_t fragment = argc > 2 ? atoi(argv[2]) : 16;
+	if(rounds <= 0) rounds = 1;
+	if(fragment == 0) fragment = 16;
+
+	Parser parser;
+	HttpParser request_head(HttpParser::REQUEST);
+	HttpParser response_head(HttpParser::RESPONSE);
+	const std::string request = REQUEST_HEADER;
+	const std::string response = RESPONSE_HEADER;
+
+	printf("%d rounds, fragments of %zu bytes\n", rounds, fragment);
+	printf("%-10s %-10s %14s %14s %8s\n", "header", "arrival", "Parser/s", "HttpParser/s", "speedup");
+	for(int kind = 0; kind < 2; ++kind)
+	{
+		const std::string & text = kind == 0 ? request : response;
+		HttpParser & head = kind == 0 ? request_head : response_head;
+		for(int fragmented = 0; fragmented < 2; ++fragmented)
+		{
+			size_t piece = fragmented ? fragment : 0;
+			double old_rate = perSecond(rounds, [&] { return parseOld(parser, text, piece, kind == 0); });
+			double new_rate = perSecond(rounds, [&] { return parseNew(head, text, piece); });
+			printf("%-10s %-10s %14.0f %14.0f %7.1fx\n", kind == 0 ? "request" : "response", fragmented ? "fragments" : "whole",
+				old_rate, new_rate, new_rate / old_rate);
+		}
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,143 @@
+// send benchmark of a cached response over loopback TCP
+// compares one send() per segment against vectored sendmsg() of SegmentSender, with and without MSG_ZEROCOPY
+// output is syscalls per response and MB/s
+#include "../SegmentSender.hpp"
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define SEGMENT_SIZE 65536 // same as BUFFER_SIZE of the proxy
+#define RECV_SIZE (1 << 20)
+
+struct Result
+{
+	unsigned long long syscalls;
+	double mbps;
+};
+
+// connected loopback TCP pair, the reader thread drains the other end
+static void connectPair(int & sender_fd, int & reader_fd)
+{
+	int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = 0;
+	socklen_t len = sizeof(addr);
+	if(listen_fd == -1 || bind(listen_fd, (struct sockaddr *)&addr, len) == -1 || listen(listen_fd, 1) == -1
+		|| getsockname(listen_fd, (struct sockaddr *)&addr, &len) == -1)
+	{
+		perror("listen");
+		exit(EXIT_FAILURE);
+	}
+	sender_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if(connect(sender_fd, (struct sockaddr *)&addr, len) == -1)
+	{
+		perror("connect");
+		exit(EXIT_FAILURE);
+	}
+	reader_fd = accept(listen_fd, NULL, NULL);
+	close(listen_fd);
+}
+
+static void drain(int fd, size_t total)
+{
+	std::vector<char> buf(RECV_SIZE);
+	size_t received = 0;
+	while(received < total)
+	{
+		ssize_t len = recv(fd, &buf.data()[0], buf.size(), 0);
+		if(len <= 0) break;
+		received += len;
+	}
+}
+
+// mode 0: one send() loop per segment, mode 1: vectored, mode 2: vectored with MSG_ZEROCOPY
+static Result run(const std::vector<std::vector<char>> & content, size_t total, int rounds, int mode)
+{
+	int sender_fd, reader_fd;
+	connectPair(sender_fd, reader_fd);
+	std::thread reader(drain, reader_fd, total * rounds);
+
+	Result res = { 0, 0 };
+	std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+	for(int r = 0; r < rounds; ++r)
+	{
+		if(mode == 0)
+		{
+			for(const auto & seg : content)
+			{
+				size_t sent = 0;
+				while(sent < seg.size())
+				{
+					ssize_t len = send(sender_fd, &seg.data()[0] + sent, seg.size() - sent, MSG_NOSIGNAL);
+					++res.syscalls;
+					if(len == -1)
+					{
+						perror("send");
+						exit(EXIT_FAILURE);
+					}
+					sent += len;
+				}
+			}
+		}
+		else
+		{
+			SegmentSender sender;
+			for(const auto & seg : content)
+			{
+				sender.addSpan(&seg.data()[0], seg.size());
+			}
+			if(mode == 2)
+			{
+				sender.enableZerocopy(sender_fd);
+			}
+			while(!sender.done())
+			{
+				sender.sendSome(sender_fd);
+				++res.syscalls;
+			}
+			sender.waitCompletions(sender_fd, 1000);
+		}
+	}
+	reader.join();
+	double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	res.syscalls /= rounds;
+	res.mbps = total * rounds / secs / (1 << 20);
+	close(sender_fd);
+	close(reader_fd);
+	return res;
+}
+
+int main(int argc, char ** argv)
+{
+	size_t total = (argc > 1 ? atoi(argv[1]) : 16) * (1ULL << 20);
+	int rounds = argc > 2 ? atoi(argv[2]) : 20;
+	if(total == 0) total = SEGMENT_SIZE;
+	if(rounds <= 0) rounds = 1;
+
+	// the response as the segments it was received in, one span each for the vectored sends
+	std::vector<std::vector<char>> content;
+	for(size_t off = 0; off < total; off += SEGMENT_SIZE)
+	{
+		content.push_back(std::vector<char>(std::min((size_t)SEGMENT_SIZE, total - off), 'x'));
+	}
+
+	const char * names[] = { "per-segment send", "vectored sendmsg", "vectored zerocopy" };
+	printf("%zu MB response in %zu segments, %d rounds\n", total >> 20, content.size(), rounds);
+	printf("%-20s %18s %10s\n", "method", "syscalls/response", "MB/s");
+	for(int mode = 0; mode < 3; ++mode)
+	{
+		Result res = run(content, total, rounds, mode);
+		printf("%-20s %18llu %10.0f\n", names[mode], res.syscalls, res.mbps);
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,184 @@
+// CONNECT tunnel benchmark through a running proxy
+// every round opens a tunnel to a local server, uploads MB bytes, half-closes, then downloads MB bytes back
+// output is MB/s of both directions and CPU seconds the proxy spent per GB relayed, read from /proc/PID/stat
+// run it against the proxy started with --splice=0 and --splice=1 to compare
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define PROXY_PORT 5555
+#define IO_SIZE (1 << 20)
+
+// user + system CPU seconds of a process, all threads included
+static double cpuSeconds(int pid)
+{
+	std::string path = "/proc/" + std::to_string(pid) + "/stat";
+	FILE * file = fopen(path.c_str(), "r");
+	if(file == NULL)
+	{
+		perror("open /proc/PID/stat");
+		exit(EXIT_FAILURE);
+	}
+	char line[4096];
+	size_t len = fread(line, 1, sizeof(line) - 1, file);
+	fclose(file);
+	line[len] = '\0';
+
+	// utime and stime are the 12th and 13th fields after the command name
+	const char * p = strrchr(line, ')');
+	unsigned long long utime = 0, stime = 0;
+	if(p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2)
+	{
+		fprintf(stderr, "cannot parse %s\n", path.c_str());
+		exit(EXIT_FAILURE);
+	}
+	return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static void sendAll(int fd, const char * data, size_t length)
+{
+	size_t sent = 0;
+	while(sent < length)
+	{
+		ssize_t len = send(fd, data + sent, length - sent, MSG_NOSIGNAL);
+		if(len == -1)
+		{
+			perror("send");
+			exit(EXIT_FAILURE);
+		}
+		sent += len;
+	}
+}
+
+// receive until the peer closes, return bytes received
+static size_t recvAll(int fd)
+{
+	std::vector<char> buf(IO_SIZE);
+	size_t received = 0;
+	ssize_t len;
+	while((len = recv(fd, &buf.data()[0], buf.size(), 0)) > 0)
+	{
+		received += len;
+	}
+	return received;
+}
+
+// the far end of the tunnels: read everything a client sends, then send total bytes back and close
+static void serve(int listen_fd, size_t total, int rounds)
+{
+	std::vector<char> data(IO_SIZE, 'x');
+	for(int r = 0; r < rounds; ++r)
+	{
+		int fd = accept(listen_fd, NULL, NULL);
+		if(fd == -1)
+		{
+			perror("accept");
+			exit(EXIT_FAILURE);
+		}
+		recvAll(fd);
+		for(size_t off = 0; off < total; off += IO_SIZE)
+		{
+			sendAll(fd, &data.data()[0], std::min((size_t)IO_SIZE, total - off));
+		}
+		close(fd);
+	}
+}
+
+int main(int argc, char ** argv)
+{
+	if(argc < 2)
+	{
+		fprintf(stderr, "usage: %s PROXY_PID [MB] [rounds]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	int pid = atoi(argv[1]);
+	size_t total = (argc > 2 ? atoi(argv[2]) : 256) * (1ULL << 20);
+	int rounds = argc > 3 ? atoi(argv[3]) : 4;
+	if(total == 0) total = IO_SIZE;
+	if(rounds <= 0) rounds = 1;
+
+	int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t addr_len = sizeof(addr);
+	if(listen_fd == -1 || bind(listen_fd, (struct sockaddr *)&addr, addr_len) == -1 || listen(listen_fd, rounds) == -1
+		|| getsockname(listen_fd, (struct sockaddr *)&addr, &addr_len) == -1)
+	{
+		perror("listen");
+		return EXIT_FAILURE;
+	}
+	std::thread server(serve, listen_fd, total, rounds);
+
+	const std::string request = "CONNECT 127.0.0.1:" + std::to_string(ntohs(addr.sin_port)) + " HTTP/1.1\r\n"
+		+ "Host: 127.0.0.1:" + std::to_string(ntohs(addr.sin_port)) + "\r\n\r\n";
+	std::vector<char> data(IO_SIZE, 'y');
+	double upload_secs = 0, download_secs = 0;
+	double cpu_begin = cpuSeconds(pid);
+	for(int r = 0; r < rounds; ++r)
+	{
+		struct sockaddr_in proxy_addr;
+		memset(&proxy_addr, 0, sizeof(proxy_addr));
+		proxy_addr.sin_family = AF_INET;
+		proxy_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		proxy_addr.sin_port = htons(PROXY_PORT);
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+		if(fd == -1 || connect(fd, (struct sockaddr *)&proxy_addr, sizeof(proxy_addr)) == -1)
+		{
+			perror("connect proxy");
+			return EXIT_FAILURE;
+		}
+
+		// the far end sends nothing before the upload ends, so everything up to the blank line is the 200 OK
+		sendAll(fd, request.data(), request.size());
+		std::string response;
+		char c;
+		while(response.find("\r\n\r\n") == std::string::npos && recv(fd, &c, 1, 0) == 1)
+		{
+			response += c;
+		}
+		if(response.compare(0, 12, "HTTP/1.1 200") != 0)
+		{
+			fprintf(stderr, "tunnel refused: %s\n", response.c_str());
+			return EXIT_FAILURE;
+		}
+
+		std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+		for(size_t off = 0; off < total; off += IO_SIZE)
+		{
+			sendAll(fd, &data.data()[0], std::min((size_t)IO_SIZE, total - off));
+		}
+		shutdown(fd, SHUT_WR);
+		std::chrono::steady_clock::time_point middle = std::chrono::steady_clock::now();
+		size_t received = recvAll(fd);
+		std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+		close(fd);
+		if(received != total)
+		{
+			fprintf(stderr, "downloaded %zu of %zu bytes\n", received, total);
+			return EXIT_FAILURE;
+		}
+		upload_secs += std::chrono::duration<double>(middle - begin).count();
+		download_secs += std::chrono::duration<double>(end - middle).count();
+	}
+	double cpu = cpuSeconds(pid) - cpu_begin;
+	server.join();
+	close(listen_fd);
+
+	double mb = (double)total * rounds / (1 << 20);
+	printf("%d tunnels, %zu MB each way\n", rounds, total >> 20);
+	printf("upload %10.0f MB/s\n", mb / upload_secs);
+	printf("download %8.0f MB/s\n", mb / download_secs);
+	printf("proxy CPU %7.2f s/GB\n", cpu / (2 * mb / 1024));
+	return EXIT_SUCCESS;
+}